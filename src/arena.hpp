@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+/*
+    Bump allocator for build-time tree nodes.
+    Objects are placed contiguously into blocks of doubling size, pointers stay valid until release.
+    Nothing is destructed individually: releasing frees a handful of blocks regardless of object count.
+    Not thread-safe, use one arena per build task.
+*/
+template<typename T>
+class Arena
+{
+    static_assert(std::is_trivially_destructible<T>::value, "Arena objects are never destructed");
+
+public:
+    Arena(void) {}
+    Arena(Arena const&) = delete;
+    void operator=(Arena const&) = delete;
+
+    // Size of the next block, call before allocating to get a single block
+    void reserve(size_t count) { nextCapacity = std::max(nextCapacity, count); }
+
+    template<typename... Args>
+    T *alloc(Args&&... args)
+    {
+        if (used == capacity)
+            grow();
+
+        T *ptr = reinterpret_cast<T*>(&blocks.back()[used++]);
+        return new (ptr) T(std::forward<Args>(args)...);
+    }
+
+    void release()
+    {
+        blocks.clear();
+        used = capacity = allocated = reserved = 0;
+    }
+
+    size_t size() const { return allocated + used; }
+    size_t bytes() const { return reserved * sizeof(Storage); } // allocated block memory
+
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+    void grow()
+    {
+        allocated += used;
+        capacity = nextCapacity;
+        nextCapacity *= 2;
+        reserved += capacity;
+        used = 0;
+        blocks.emplace_back(new Storage[capacity]);
+    }
+
+    std::vector<std::unique_ptr<Storage[]>> blocks;
+    size_t capacity = 0;      // size of current block
+    size_t used = 0;          // objects in current block
+    size_t allocated = 0;     // objects in previous blocks
+    size_t reserved = 0;      // capacity of all blocks
+    size_t nextCapacity = 256;
+};
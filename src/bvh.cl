@@ -5,16 +5,224 @@
 #include "utils.cl"
 #include "intersect.cl"
 
+// Closest triangle of a leaf that is nearer than hit->t. Only the distance, barycentrics
+// and index list entry are recorded, shading attributes are fetched once by closestHit.
+inline bool intersectLeaf(Ray *r, Hit *hit, global LeafTriangle *leafTris, uint iStart, uint nPrims, float2 *uv, uint *entry)
+{
+    bool found = false;
+    for (uint i = iStart; i < iStart + nPrims; i++)
+    {
+        float t, u, v;
+        if (intersectTriangle(r, &leafTris[i], &t, &u, &v) && t > 0.0f && t < hit->t)
+        {
+            hit->t = t;
+            *uv = (float2)(u, v);
+            *entry = i;
+            found = true;
+        }
+    }
+    return found;
+}
+
+inline bool occludedLeaf(Ray *r, float maxDist, global LeafTriangle *leafTris, uint iStart, uint nPrims)
+{
+    for (uint i = iStart; i < iStart + nPrims; i++)
+    {
+        float t, u, v;
+        if (intersectTriangle(r, &leafTris[i], &t, &u, &v) && t > 0.0f && t < maxDist)
+            return true;
+    }
+    return false;
+}
+
+inline void closestHit(const Ray *r, Hit *hit, float2 uv, uint entry, global LeafTriangle *leafTris, global IndexedTriangle *tris, global PackedVertex *vertices)
+{
+    hit->P = r->orig + hit->t * r->dir;
+    setHitAttributes(hit, leafTris[entry].tri, uv.x, uv.y, tris, vertices);
+}
+
 //#define USE_BITSTACK
+//#define BVH_WIDTH 4
+//#define BVH_QUANTIZED
+
+#if defined(BVH_WIDTH) && (BVH_WIDTH > 2)
+// Wide BVH traversal, node buffer contains GPUNode4/8 or GPUQNode4/8 (see widebvh.hpp)
+#if BVH_WIDTH == 8
+typedef float8 floatW;
+typedef int8 intW;
+#define vloadW vload8
+#define vstoreW vstore8
+#define convert_floatW convert_float8
+#else
+typedef float4 floatW;
+typedef int4 intW;
+#define vloadW vload4
+#define vstoreW vstore4
+#define convert_floatW convert_float4
+#endif
+
+#if defined(BVH_QUANTIZED) && BVH_WIDTH == 8
+typedef GPUQNode8 WideNode;
+#elif defined(BVH_QUANTIZED)
+typedef GPUQNode4 WideNode;
+#elif BVH_WIDTH == 8
+typedef GPUNode8 WideNode;
+#else
+typedef GPUNode4 WideNode;
+#endif
+
+#ifdef BVH_QUANTIZED
+// Exact power of two, q * scale is exact => same rounding as encoder
+#define dequantize(q, axis) (n->origin[axis] + convert_floatW(vloadW(0, (global uchar*)(q))) * as_float(((int)n->exp[axis] + 127) << 23))
+#define childMinX dequantize(n->qminx, 0)
+#define childMinY dequantize(n->qminy, 1)
+#define childMinZ dequantize(n->qminz, 2)
+#define childMaxX dequantize(n->qmaxx, 0)
+#define childMaxY dequantize(n->qmaxy, 1)
+#define childMaxZ dequantize(n->qmaxz, 2)
+#else
+#define childMinX vloadW(0, n->minx)
+#define childMinY vloadW(0, n->miny)
+#define childMinZ vloadW(0, n->minz)
+#define childMaxX vloadW(0, n->maxx)
+#define childMaxY vloadW(0, n->maxy)
+#define childMaxZ vloadW(0, n->maxz)
+#endif
+
+// Slab test against all children at once, one vector load per plane.
+// Returns number of children hit, sorted near to far into 'order'.
+inline uint intersectChildren(Ray *r, const float3 dinv, global WideNode *n, float tMaxPrev, uint *order)
+{
+    const floatW t0x = (childMinX - r->orig.x) * dinv.x;
+    const floatW t1x = (childMaxX - r->orig.x) * dinv.x;
+    const floatW t0y = (childMinY - r->orig.y) * dinv.y;
+    const floatW t1y = (childMaxY - r->orig.y) * dinv.y;
+    const floatW t0z = (childMinZ - r->orig.z) * dinv.z;
+    const floatW t1z = (childMaxZ - r->orig.z) * dinv.z;
+
+    const floatW tminv = fmax(fmax(fmin(t0x, t1x), fmin(t0y, t1y)), fmin(t0z, t1z));
+    const floatW tmaxv = fmin(fmin(fmax(t0x, t1x), fmax(t0y, t1y)), fmax(t0z, t1z));
+    const intW hitv = (tmaxv >= 0.0f) & (tminv <= tmaxv) & (tminv < tMaxPrev);
+
+    float tmin[BVH_WIDTH];
+    int hit[BVH_WIDTH];
+    vstoreW(tminv, 0, tmin);
+    vstoreW(hitv, 0, hit);
+
+    // Insertion sort, at most BVH_WIDTH elements
+    uint count = 0;
+    for (uint i = 0; i < n->numChildren; i++)
+    {
+        if (!hit[i])
+            continue;
+
+        uint j = count++;
+        while (j > 0 && tmin[order[j - 1]] > tmin[i])
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    return count;
+}
+
+inline void bvh_intersect(Ray *r, Hit *hit, global IndexedTriangle *tris, global PackedVertex *vertices, global GPUNode *nodes, global LeafTriangle *leafTris, global GPUInstance *instances)
+{
+    global WideNode *wnodes = (global WideNode*)nodes;
+    const float3 dinv = native_recip(r->dir);
+
+    // Closest hit so far
+    float2 uv = (float2)(0.0f);
+    uint entry = 0;
+    bool found = false;
+
+    // Stack state
+    uint stack[WIDE_STACK_SIZE];
+    int stackptr = 0;
+
+    // Root node
+    stack[stackptr] = 0;
+
+    while (stackptr >= 0)
+    {
+        global WideNode *n = &wnodes[stack[stackptr]];
+        stackptr--;
+
+        uint order[BVH_WIDTH];
+        uint count = intersectChildren(r, dinv, n, hit->t, order);
+
+        // Inner children pushed far to near
+        for (int k = (int)count - 1; k >= 0; k--)
+        {
+            if (n->nPrims[order[k]] == 0)
+                stack[++stackptr] = n->child[order[k]];
+        }
+
+        // Leaves intersected near to far, shortens remaining rays
+        for (uint k = 0; k < count; k++)
+        {
+            uint c = order[k];
+            if (n->nPrims[c] != 0 && intersectLeaf(r, hit, leafTris, n->child[c], n->nPrims[c], &uv, &entry))
+                found = true;
+        }
+    }
+
+    if (found)
+        closestHit(r, hit, uv, entry, leafTris, tris, vertices);
+}
+
+inline bool bvh_occluded(Ray *r, float *maxDist, global GPUNode *nodes, global LeafTriangle *leafTris, global GPUInstance *instances)
+{
+    global WideNode *wnodes = (global WideNode*)nodes;
+    const float3 dinv = native_recip(r->dir);
+
+    // Stack state
+    uint stack[WIDE_STACK_SIZE];
+    int stackptr = 0;
+
+    // Root node
+    stack[stackptr] = 0;
 
-#ifdef USE_BITSTACK
+    while (stackptr >= 0)
+    {
+        global WideNode *n = &wnodes[stack[stackptr]];
+        stackptr--;
+
+        uint order[BVH_WIDTH];
+        uint count = intersectChildren(r, dinv, n, *maxDist, order);
+
+        for (uint k = 0; k < count; k++)
+        {
+            uint c = order[k];
+            if (n->nPrims[c] == 0)
+            {
+                stack[++stackptr] = n->child[c];
+                continue;
+            }
+
+            if (occludedLeaf(r, *maxDist, leafTris, n->child[c], n->nPrims[c]))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+#elif defined(USE_BITSTACK)
 // Traversal with bitstacks - https://github.com/martinradev/BVH-algo-lib/blob/master/shaders/trace.glsl
-inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNode *nodes, global uint *indices)
+inline void bvh_intersect(Ray *r, Hit *hit, global IndexedTriangle *tris, global PackedVertex *vertices, global GPUNode *nodes, global LeafTriangle *leafTris, global GPUInstance *instances)
 {
     int top = 0;
     int lstack = 0;
     int rstack = 0;
 
+    // Closest hit so far
+    float2 uv = (float2)(0.0f);
+    uint entry = 0;
+    bool found = false;
+
     while (top != -1) // not in root node
     {
         bool trackback = false;
@@ -22,38 +230,15 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
 
         if (n.nPrims != 0) // Leaf node
         {
-            float tmin = FLT_MAX, umin = 0.0f, vmin = 0.0f;
-            int imin = -1;
-            for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
-            {
-                float t, u, v;
-                if (intersectTriangle(r, &(tris[indices[i]]), &t, &u, &v))
-                {
-                    if (t > 0.0f && t < tmin)
-                    {
-                        imin = i;
-                        tmin = t;
-                        umin = u;
-                        vmin = v;
-                    }
-                }
-            }
-            if (imin != -1 && tmin < hit->t)
-            {
-                hit->i = indices[imin];
-                hit->matId = tris[indices[imin]].matId;
-                hit->t = tmin;
-                hit->P = r->orig + tmin * r->dir;
-                hit->N = normalize(lerp(umin, vmin, tris[indices[imin]].v0.n, tris[indices[imin]].v1.n, tris[indices[imin]].v2.n));
-                hit->uvTex = lerp(umin, vmin, tris[indices[imin]].v0.t, tris[indices[imin]].v1.t, tris[indices[imin]].v2.t).xy;
-            }
+            if (intersectLeaf(r, hit, leafTris, n.iStart, n.nPrims, &uv, &entry))
+                found = true;
 
             trackback = true;
         }
         else {
             float dummy, t1, t2;
 
-            bool r1 = intersectAABB(r, &(nodes[top + 1].box), &t1, &dummy, hit->t);
+            bool r1 = intersectAABB(r, &(nodes[n.leftChild].box), &t1, &dummy, hit->t);
             bool r2 = intersectAABB(r, &(nodes[n.rightChild].box), &t2, &dummy, hit->t);
 
             if (r1 && r2)
@@ -61,7 +246,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
                 if (t1 <= t2)
                 {
                     // first left
-                    top = top + 1; // left child
+                    top = n.leftChild;
                     lstack = (lstack | 1) << 1;
                     rstack <<= 1;
                 }
@@ -75,7 +260,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
             }
             else if (r1)
             {
-                top = top + 1;
+                top = n.leftChild;
                 lstack <<= 1;
                 rstack <<= 1;
             }
@@ -108,7 +293,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
                 }
                 else if ((rstack & 1) != 0) {
                     // visit left node
-                    top = top + 1;
+                    top = n.leftChild;
                     rstack &= ~1;
                     lstack <<= 1;
                     rstack <<= 1;
@@ -124,10 +309,13 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
                 break;
         }
     }
+
+    if (found)
+        closestHit(r, hit, uv, entry, leafTris, tris, vertices);
 }
 
 // Traversal with bitstacks - https://github.com/martinradev/BVH-algo-lib/blob/master/shaders/trace.glsl
-inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global GPUNode *nodes, global uint *indices)
+inline bool bvh_occluded(Ray *r, float *maxDist, global GPUNode *nodes, global LeafTriangle *leafTris, global GPUInstance *instances)
 {
     int top = 0;
     int lstack = 0;
@@ -140,21 +328,15 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
 
         if (n.nPrims != 0) // Leaf node
         {
-            for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
-            {
-                float t, u, v;
-                if (intersectTriangle(r, &(tris[indices[i]]), &t, &u, &v) && t > 0.0f && t < *maxDist)
-                {
-                    return true;
-                }
-            }
+            if (occludedLeaf(r, *maxDist, leafTris, n.iStart, n.nPrims))
+                return true;
 
             trackback = true;
         }
         else {
             float dummy, t1, t2;
 
-            bool r1 = intersectAABB(r, &(nodes[top + 1].box), &t1, &dummy, *maxDist);
+            bool r1 = intersectAABB(r, &(nodes[n.leftChild].box), &t1, &dummy, *maxDist);
             bool r2 = intersectAABB(r, &(nodes[n.rightChild].box), &t2, &dummy, *maxDist);
 
             if (r1 && r2)
@@ -162,7 +344,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
                 if (t1 <= t2)
                 {
                     // first left
-                    top = top + 1; // left child
+                    top = n.leftChild;
                     lstack = (lstack | 1) << 1;
                     rstack <<= 1;
                 }
@@ -176,7 +358,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
             }
             else if (r1)
             {
-                top = top + 1;
+                top = n.leftChild;
                 lstack <<= 1;
                 rstack <<= 1;
             }
@@ -209,7 +391,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
                 }
                 else if ((rstack & 1) != 0) {
                     // visit left node
-                    top = top + 1;
+                    top = n.leftChild;
                     rstack &= ~1;
                     lstack <<= 1;
                     rstack <<= 1;
@@ -230,16 +412,76 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
 }
 
 #else
+#ifdef USE_INSTANCING
+// Two-level traversal (see twolevelbvh.hpp): stack entries are node indices,
+// pending instances of a visited top-level leaf, or a marker for leaving the current instance.
+#define INSTANCE_BIT 0x80000000u
+#define INSTANCE_EXIT 0xFFFFFFFFu
+#define BVH_STACK_SIZE 96
+
+// World space ray to object space of an instance, direction not normalized => distances preserved
+inline Ray toObjectSpace(const Ray *r, global GPUInstance *inst)
+{
+    Ray o;
+    o.orig = (float3)(dot(inst->rows[0], r->orig), dot(inst->rows[1], r->orig), dot(inst->rows[2], r->orig)) + inst->offset;
+    o.dir = (float3)(dot(inst->rows[0], r->dir), dot(inst->rows[1], r->dir), dot(inst->rows[2], r->dir));
+    return o;
+}
+
+// Transposed linear part of the world-to-object transform
+inline float3 normalToWorld(float3 n, global GPUInstance *inst)
+{
+    return normalize(inst->rows[0] * n.x + inst->rows[1] * n.y + inst->rows[2] * n.z);
+}
+
+// Handles instance entries, returns false if 'entry' is a regular node
+inline bool instanceEntry(uint entry, const Ray *world, Ray *ray, int *inst, uint *stack, int *stackptr, global GPUInstance *instances)
+{
+    if (entry == INSTANCE_EXIT)
+    {
+        *ray = *world;
+        *inst = -1;
+        return true;
+    }
+
+    if (entry & INSTANCE_BIT)
+    {
+        *inst = (int)(entry & ~INSTANCE_BIT);
+        *ray = toObjectSpace(world, &instances[*inst]);
+        stack[++(*stackptr)] = INSTANCE_EXIT;
+        stack[++(*stackptr)] = instances[*inst].root;
+        return true;
+    }
+
+    return false;
+}
+#else
+#define BVH_STACK_SIZE 64
+#endif
+
 // BVH traversal using simulated stack
-inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNode *nodes, global uint *indices)
+inline void bvh_intersect(Ray *r, Hit *hit, global IndexedTriangle *tris, global PackedVertex *vertices, global GPUNode *nodes, global LeafTriangle *leafTris, global GPUInstance *instances)
 {
     float lnear, lfar, rnear, rfar; // AABB limits
     uint closer, farther;
 
     // Stack state
-    uint stack[64]; // causes large stack frames (NVIDIA build log)
+    uint stack[BVH_STACK_SIZE]; // causes large stack frames (NVIDIA build log)
     int stackptr = 0;
 
+#ifdef USE_INSTANCING
+    const Ray world = *r;
+    Ray ray = world;
+    r = &ray;
+    int inst = -1; // instance being traversed
+    int hitInst = -1;
+#endif
+
+    // Closest hit so far
+    float2 uv = (float2)(0.0f);
+    uint entry = 0;
+    bool found = false;
+
     // Root node
     stack[stackptr] = 0;
 
@@ -248,44 +490,39 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
         // Next node
         int ni = stack[stackptr];
         stackptr--;
+#ifdef USE_INSTANCING
+        if (instanceEntry((uint)ni, &world, &ray, &inst, stack, &stackptr, instances))
+            continue;
+#endif
         const GPUNode n = nodes[ni];
 
         if (n.nPrims != 0) // Leaf node
         {
-            float tmin = FLT_MAX, umin = 0.0f, vmin = 0.0f;
-            int imin = -1;
-            for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
+#ifdef USE_INSTANCING
+            // Top-level leaf: entries refer to instances
+            if (inst == -1)
             {
-                float t, u, v;
-                if (intersectTriangle(r, &(tris[indices[i]]), &t, &u, &v))
-                {
-                    if (t > 0.0f && t < tmin)
-                    {
-                        imin = i;
-                        tmin = t;
-                        umin = u;
-                        vmin = v;
-                    }
-                }
+                for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
+                    stack[++stackptr] = INSTANCE_BIT | leafTris[i].tri;
+                continue;
             }
-            if (imin != -1 && tmin < hit->t)
+#endif
+            if (intersectLeaf(r, hit, leafTris, n.iStart, n.nPrims, &uv, &entry))
             {
-                hit->i = indices[imin];
-                hit->matId = tris[indices[imin]].matId;
-                hit->t = tmin;
-                hit->P = r->orig + tmin * r->dir;
-                hit->N = normalize(lerp(umin, vmin, tris[indices[imin]].v0.n, tris[indices[imin]].v1.n, tris[indices[imin]].v2.n));
-                hit->uvTex = lerp(umin, vmin, tris[indices[imin]].v0.t, tris[indices[imin]].v1.t, tris[indices[imin]].v2.t).xy;
+                found = true;
+#ifdef USE_INSTANCING
+                hitInst = inst;
+#endif
             }
         }
         else // Internal node
         {
-            bool leftWasHit = intersectAABB(r, &(nodes[ni + 1].box), &lnear, &lfar, hit->t);
+            bool leftWasHit = intersectAABB(r, &(nodes[n.leftChild].box), &lnear, &lfar, hit->t);
             bool rightWasHit = intersectAABB(r, &(nodes[n.rightChild].box), &rnear, &rfar, hit->t);
 
             if (leftWasHit && rightWasHit)
             {
-                closer = ni + 1;
+                closer = n.leftChild;
                 farther = n.rightChild;
 
                 // Right child was closer -> swap
@@ -298,7 +535,7 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
 
             else if (leftWasHit)
             {
-                stack[++stackptr] = ni + 1;
+                stack[++stackptr] = n.leftChild;
             }
 
             else if (rightWasHit)
@@ -307,17 +544,35 @@ inline void bvh_intersect(Ray *r, Hit *hit, global Triangle *tris, global GPUNod
             }
         }
     }
+
+    if (!found)
+        return;
+
+#ifdef USE_INSTANCING
+    // Object space distances equal world space ones
+    closestHit(&world, hit, uv, entry, leafTris, tris, vertices);
+    hit->N = normalToWorld(hit->N, &instances[hitInst]);
+#else
+    closestHit(r, hit, uv, entry, leafTris, tris, vertices);
+#endif
 }
 
-inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global GPUNode *nodes, global uint *indices)
+inline bool bvh_occluded(Ray *r, float *maxDist, global GPUNode *nodes, global LeafTriangle *leafTris, global GPUInstance *instances)
 {
     float lnear, lfar, rnear, rfar; // AABB limits
     uint closer, farther;
 
     // Stack state
-    uint stack[64]; // causes large stack frames (NVIDIA build log)
+    uint stack[BVH_STACK_SIZE]; // causes large stack frames (NVIDIA build log)
     int stackptr = 0;
 
+#ifdef USE_INSTANCING
+    const Ray world = *r;
+    Ray ray = world;
+    r = &ray;
+    int inst = -1; // instance being traversed
+#endif
+
     // Root node
     stack[stackptr] = 0;
 
@@ -326,27 +581,34 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
         // Next node
         int ni = stack[stackptr];
         stackptr--;
+#ifdef USE_INSTANCING
+        if (instanceEntry((uint)ni, &world, &ray, &inst, stack, &stackptr, instances))
+            continue;
+#endif
         const GPUNode n = nodes[ni];
 
         if (n.nPrims != 0) // Leaf node
         {
-            for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
+#ifdef USE_INSTANCING
+            // Top-level leaf: entries refer to instances
+            if (inst == -1)
             {
-                float t, u, v;
-                if (intersectTriangle(r, &(tris[indices[i]]), &t, &u, &v) && t > 0.0f && t < *maxDist)
-                {
-                    return true;
-                }
+                for (uint i = n.iStart; i < n.iStart + n.nPrims; i++)
+                    stack[++stackptr] = INSTANCE_BIT | leafTris[i].tri;
+                continue;
             }
+#endif
+            if (occludedLeaf(r, *maxDist, leafTris, n.iStart, n.nPrims))
+                return true;
         }
         else // Internal node
         {
-            bool leftWasHit = intersectAABB(r, &(nodes[ni + 1].box), &lnear, &lfar, *maxDist);
+            bool leftWasHit = intersectAABB(r, &(nodes[n.leftChild].box), &lnear, &lfar, *maxDist);
             bool rightWasHit = intersectAABB(r, &(nodes[n.rightChild].box), &rnear, &rfar, *maxDist);
 
             if (leftWasHit && rightWasHit)
             {
-                closer = ni + 1;
+                closer = n.leftChild;
                 farther = n.rightChild;
 
                 // Right child was closer -> swap
@@ -359,7 +621,7 @@ inline bool bvh_occluded(Ray *r, float *maxDist, global Triangle *tris, global G
 
             else if (leftWasHit)
             {
-                stack[++stackptr] = ni + 1;
+                stack[++stackptr] = n.leftChild;
             }
 
             else if (rightWasHit)
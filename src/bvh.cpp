@@ -1,30 +1,64 @@
 #include <iostream>
 #include <cfloat>
+#include <cmath>
 #include <cassert>
+#include <chrono>
 #include "bvh.hpp"
+#include "threadpool.hpp"
+#include "settings.hpp"
+#include "treelet.hpp"
+#include "nodelayout.hpp"
+#include "cachefile.hpp"
 
-BVH::BVH(std::vector<RTTriangle>* tris, SplitMode mode)
+BVH::BVH(void)
+{
+	U32 bins = Settings::getInstance().getBvhSahBins();
+	m_sahBins = std::max(2U, std::min((U32)MaxSahBins, bins));
+	U32 leafElems = Settings::getInstance().getBvhMaxLeafElems();
+	m_maxLeafElems = std::max(1U, std::min((U32)MaxLeafElems, leafElems));
+	sahParams.costBox = std::max(1e-3f, Settings::getInstance().getBvhCostBox());
+	sahParams.costTri = std::max(1e-3f, Settings::getInstance().getBvhCostTri());
+}
+
+BVH::BVH(TriangleMesh *tris, SplitMode mode) : BVH()
 {
     m_triangles = tris;
     m_mode = mode;
+	recordBuildInfo(HierarchyBuilder_BVH, 0);
 
 	// Setup references for building
 	m_refs.resize(m_triangles->size());
 	for (int i = 0; i < m_triangles->size(); i++)
 	{
-		m_refs[i] = TriRef(i, (*m_triangles)[i]);
+		m_refs[i] = TriRef(i, *m_triangles);
 	}
 
-	// Shared vector to avoid reallocations
-	rightBoxes.resize(m_triangles->size());
+	// Shared vector to avoid reallocations, SAH sweep only (binned SAH may fall back to it).
+	// Concurrently built nodes span disjoint ranges => no overlap
+	if (mode == SplitMode_Sah || mode == SplitMode_SahBinned)
+		rightAreas.resize(m_triangles->size());
+	allocBuildMemory(vectorBytes(m_refs) + vectorBytes(rightAreas));
 
-	BuildNode root(0, (U32)m_triangles->size() - 1, -1);
-	m_build_nodes.push_back(root);
-	nodes++;
-    
-	build(0, 0, 0.0f, 1.0f); // root, depth 0
-	printf("\rBVH builder: progress 100%%\n");
-	assert(m_build_nodes[0].rightChild != -1);
+	{
+		// Large subtrees are built concurrently into separate fragments
+		BuildFragment root(BuildNode(0, (U32)m_triangles->size() - 1, -1));
+		ThreadPool &pool = ThreadPool::getInstance();
+		TaskGroup tasks;
+		pool.submit(tasks, [this, &root, &tasks]() { build(root, 0, 0, tasks); }); // root, depth 0
+		pool.wait(tasks);
+		printf("\rBVH builder: progress 100%% (%u threads)\n", pool.getNumThreads());
+
+		// Build nodes only grow during building
+		size_t fragmentBytes = root.bytes();
+		allocBuildMemory(fragmentBytes);
+		freeBuildMemory(vectorBytes(rightAreas));
+		std::vector<F32>().swap(rightAreas);
+
+		// Stitch fragments together in depth-first order
+		mergeFragment(root, -1);
+		allocBuildMemory(vectorBytes(m_build_nodes));
+		freeBuildMemory(fragmentBytes);
+	}
 	assert(metrics.depth <= MaxDepth);
 	assert(m_indices.size() == 0);
 
@@ -36,19 +70,48 @@ BVH::BVH(std::vector<RTTriangle>* tris, SplitMode mode)
 
 	std::cout
 		<< "======================" << std::endl
-		<< ((m_mode == SplitMode_Sah) ? "SAH" : (m_mode == SplitMode_ObjectMedian) ? "Object Median" : (m_mode == SplitMode_SpatialMedian) ? "Spatial Median" : "Unknown") << std::endl
+		<< splitModeName(m_mode) << std::endl
 		<< "Splits: " << metrics.splits << " (" << int(metrics.bad_splits / float(metrics.splits) * 100.0f) << "% bad)" << std::endl
 		<< "Depth: " << metrics.depth << std::endl
 		<< "Leaves: " << metrics.splits + 1 << std::endl
+		<< "Peak build memory: " << buildMemoryMiB() << " MiB" << std::endl
 		<< "======================" << std::endl;
 }
 
-BVH::BVH(std::vector<RTTriangle>* tris, const std::string filename)
+void BVH::allocBuildMemory(size_t bytes)
+{
+	size_t current = (buildMemory.current += bytes);
+	atomicMax(buildMemory.peak, current);
+}
+
+void BVH::freeBuildMemory(size_t bytes)
+{
+	buildMemory.current -= bytes;
+}
+
+// Rounded to two decimals for printing
+F32 BVH::buildMemoryMiB(void) const
+{
+	return std::round(buildMemory.peak * 100.0f / (1024.0f * 1024.0f)) / 100.0f;
+}
+
+BVH::BVH(TriangleMesh *tris, const std::string filename) : BVH()
 {
     m_triangles = tris;
     importFrom(filename);
 }
 
+BVH::BVH(TriangleMesh *tris, const CacheReader &reader) : BVH()
+{
+    m_triangles = tris;
+    importFrom(reader);
+}
+
+void BVH::recordBuildInfo(HierarchyBuilder builder, U32 optimizePasses)
+{
+	m_buildInfo = HierarchyBuildInfo::fromSettings(builder, m_mode, optimizePasses);
+}
+
 AABB_t BVH::getSceneBounds(void) const
 {
     if (m_nodes.size() == 0)
@@ -57,9 +120,119 @@ AABB_t BVH::getSceneBounds(void) const
     return m_nodes[0].box;
 }
 
+F32 BVH::getSahCost(void) const
+{
+	F32 cost = 0.0f;
+	for (const Node &n : m_nodes)
+	{
+		F32 area = n.box.area();
+		cost += (n.nPrims > 0) ? sahParams.costTri * n.nPrims * area : sahParams.costBox * area;
+	}
+
+	return cost / m_nodes[0].box.area();
+}
+
+void BVH::optimizeTreelets(U32 passes, const std::atomic<bool> *cancel)
+{
+	auto time1 = std::chrono::high_resolution_clock::now();
+	F32 costBefore = getSahCost();
+	size_t nodesBefore = m_nodes.size();
+
+	// Also if restructuring fails, so that the cache entry matches the settings
+	recordBuildInfo((HierarchyBuilder)m_buildInfo.builder, passes);
+
+	TreeletOptimizer optimizer(m_nodes, m_indices, sahParams.costBox, sahParams.costTri, cancel);
+	if (!optimizer.optimize(passes, MaxDepth))
+	{
+		if (cancel && *cancel)
+			std::cout << "Treelet optimization cancelled" << std::endl;
+		else
+			std::cout << "WARN: Treelet optimization exceeds max depth, keeping original hierarchy" << std::endl;
+		return;
+	}
+
+	auto time2 = std::chrono::high_resolution_clock::now();
+	std::cout << "Treelet optimization (" << passes << " passes): SAH cost " << costBefore << " -> " << getSahCost()
+		<< ", nodes " << nodesBefore << " -> " << m_nodes.size() << ", "
+		<< std::chrono::duration<double, std::milli>(time2 - time1).count() << " ms" << std::endl;
+}
+
+void BVH::reorderNodes(NodeLayout layout)
+{
+	auto time1 = std::chrono::high_resolution_clock::now();
+	std::vector<U32> newIndex = ::reorderNodes(m_nodes, layout);
+	for (GPUInstance &inst : m_instances)
+		inst.root = newIndex[inst.root];
+
+	auto time2 = std::chrono::high_resolution_clock::now();
+	std::cout << "Node layout: " << nodeLayoutName(layout) << ", "
+		<< std::chrono::duration<double, std::milli>(time2 - time1).count() << " ms" << std::endl;
+}
+
+// Bottom-up by level, nodes of the same depth are independent
+void BVH::refit(void)
+{
+	assert(m_instances.empty());
+	auto time1 = std::chrono::high_resolution_clock::now();
+	const U32 N = (U32)m_nodes.size();
+
+	// Parents precede children in every layout => depths in a single sweep
+	std::vector<U32> depth(N, 0);
+	U32 maxDepth = 0;
+	for (U32 i = 1; i < N; i++)
+	{
+		depth[i] = depth[m_nodes[i].parent] + 1;
+		maxDepth = std::max(maxDepth, depth[i]);
+	}
+
+	// Node indices grouped by depth
+	std::vector<U32> levelStart(maxDepth + 2, 0);
+	for (U32 i = 0; i < N; i++)
+		levelStart[depth[i] + 1]++;
+	for (U32 d = 0; d <= maxDepth; d++)
+		levelStart[d + 1] += levelStart[d];
+
+	std::vector<U32> levels(N);
+	std::vector<U32> offsets(levelStart.begin(), levelStart.end() - 1);
+	for (U32 i = 0; i < N; i++)
+		levels[offsets[depth[i]]++] = i;
+
+	ThreadPool &pool = ThreadPool::getInstance();
+	for (U32 d = maxDepth + 1; d-- > 0;)
+	{
+		const U32 start = levelStart[d];
+		const U32 end = levelStart[d + 1];
+		const U32 numChunks = (end - start + RefitChunkSize - 1) / RefitChunkSize;
+		pool.parallelFor(numChunks, [&](U32 c)
+		{
+			for (U32 i = start + c * RefitChunkSize; i < std::min(end, start + (c + 1) * RefitChunkSize); i++)
+			{
+				Node &n = m_nodes[levels[i]];
+				if (n.nPrims > 0)
+				{
+					n.box = AABB_t();
+					for (U32 k = n.iStart; k < n.iStart + n.nPrims; k++)
+						n.box.expand(*m_triangles, m_indices[k]);
+				}
+				else
+				{
+					n.box = m_nodes[n.leftChild].box;
+					n.box.expand(m_nodes[n.rightChild].box);
+				}
+			}
+		});
+	}
+
+	auto time2 = std::chrono::high_resolution_clock::now();
+	std::cout << "BVH refit: " << N << " nodes, " << maxDepth + 1 << " levels, "
+		<< std::chrono::duration<double, std::milli>(time2 - time1).count() << " ms" << std::endl;
+}
+
 void BVH::createSmallNodes()
 {
 	m_nodes.clear();
+	m_nodes.reserve(m_build_nodes.size());
+	allocBuildMemory(vectorBytes(m_nodes));
 
 	for (BuildNode bn : m_build_nodes)
 	{
@@ -75,6 +248,7 @@ void BVH::createSmallNodes()
 		}
 		else // interior node
 		{ 
+			n.leftChild = (U32)m_nodes.size() + 1; // depth-first
 			n.rightChild = (U32)(bn.rightChild);
 		}
 		m_nodes.push_back(n);
@@ -82,156 +256,148 @@ void BVH::createSmallNodes()
 	std::cout << "Small node vector created" << std::endl;
 
 	// Deallocate build node memory
+	freeBuildMemory(vectorBytes(m_build_nodes));
 	m_build_nodes.clear();
 	m_build_nodes.shrink_to_fit();
 }
 
 void BVH::createIndexList() {
 	m_indices.resize(m_refs.size());
+	allocBuildMemory(vectorBytes(m_indices));
 	for (int i = 0; i < m_refs.size(); i++)
 	{
 		m_indices[i] = m_refs[i].ind;
 	}
 
 	// No longer needed
+	freeBuildMemory(vectorBytes(m_refs));
 	m_refs.clear();
 	m_refs.shrink_to_fit();
 }
 
-std::vector<U32> importIndices(std::ifstream &in)
-{
-    U32 size;
-    read(in, size);
-    std::vector<U32> vec(size);
-    
-    for (U32 i = 0; i < size; i++)
-	{
-        U32 ind;
-        read(in, ind);
-        vec[i] = ind;
-    }
-
-    // Return value optimization!
-    return vec;
-}
-
-std::vector<Node> importNodes(std::ifstream &in)
+// Nodes and indices are stored in their in-memory layout => bulk copies only
+void BVH::importFrom(const std::string filename)
 {
-	U32 size;
-	read(in, size);
-	std::vector<Node> vec(size);
+	auto time1 = std::chrono::high_resolution_clock::now();
+	CacheReader reader;
+	if (!reader.open(filename, CacheKind_Hierarchy))
+		throw std::runtime_error("Hierarchy cache " + filename + " is missing, outdated or corrupt");
 
-	for (U32 i = 0; i < size; i++)
-	{
-		Node n;
-		float3 bmin, bmax;
-		read(in, bmin.x);
-		read(in, bmin.y);
-		read(in, bmin.z);
-		read(in, bmax.x);
-		read(in, bmax.y);
-		read(in, bmax.z);
-		n.box = AABB_t(bmin, bmax);
-		read(in, n.iStart);
-        read(in, n.parent);
-		read(in, n.nPrims);
-		vec[i] = n;
-	}
+	importFrom(reader);
 
-	// Return value optimization!
-	return vec;
+	auto time2 = std::chrono::high_resolution_clock::now();
+	std::cout << "Hierarchy import: " << m_nodes.size() << " nodes, " << reader.bytes() / (1024 * 1024) << " MiB, "
+		<< std::chrono::duration<double, std::milli>(time2 - time1).count() << " ms" << std::endl;
 }
 
-
-void BVH::importFrom(const std::string filename)
+void BVH::importFrom(const CacheReader &reader)
 {
-    std::ifstream infile(filename, std::ios::binary);
-    m_indices = importIndices(infile);
-    m_nodes = importNodes(infile);
-}
+	size_t count;
+	const HierarchyBuildInfo *info = reader.section<HierarchyBuildInfo>(CacheSection_BuildInfo, count);
+	if (!info || count != 1)
+		throw std::runtime_error("Cached hierarchy has no build info");
 
+	if (!reader.read(CacheSection_Indices, m_indices) || !reader.read(CacheSection_Nodes, m_nodes) || m_nodes.empty())
+		throw std::runtime_error("Cached hierarchy has no valid node or index data");
 
-void exportNode(std::ofstream &out, const Node &n)
-{
-	// AABB
-	float3 bmin = n.box.min;
-	float3 bmax = n.box.max;
-	write(out, bmin.x);
-	write(out, bmin.y);
-	write(out, bmin.z);
-	write(out, bmax.x);
-	write(out, bmax.y);
-	write(out, bmax.z);
-
-	// Parameters
-	write(out, n.iStart);
-    write(out, n.parent);
-	write(out, n.nPrims);
+	m_buildInfo = *info;
+	m_mode = (SplitMode)info->splitMode;
 }
 
 /** Write BVH to file for later importing **/
 void BVH::exportTo(const std::string filename) const
 {
-    std::ofstream out(filename, std::ios::binary);
+	CacheWriter writer(CacheKind_Hierarchy);
+	exportTo(writer);
 
-    if (out.good())
-    {
-		// Index list
-		write(out, (U32)m_indices.size());
-		for_each(m_indices.begin(), m_indices.end(), [&out](U32 index) { write(out, index); });
+	if (!writer.write(filename))
+		std::cout << "Could not create create file for BVH export!" << std::endl;
+}
 
-		// Node list
-		write(out, (U32)m_indices.size());
-		for_each(m_nodes.begin(), m_nodes.end(), [&out](const Node &n) { exportNode(out, n); });
-    }
-    else
-    {
-        std::cout << "Could not create create file for BVH export!" << std::endl;
-    }
+void BVH::exportTo(CacheWriter &writer) const
+{
+	writer.add(CacheSection_BuildInfo, &m_buildInfo, sizeof(HierarchyBuildInfo), 1);
+	writer.add(CacheSection_Indices, m_indices);
+	writer.add(CacheSection_Nodes, m_nodes);
 }
 
 // Too frequent printing is actually a bottleneck!
 void BVH::lazyPrintBuildStatus(F32 progress)
 {
 	S32 percentage = S32(ceil(progress * 100.0f));
-	if (percentage > buildPercentage)
+	S32 prev = buildPercentage;
+	if (percentage > prev && buildPercentage.compare_exchange_strong(prev, percentage))
 	{
-		buildPercentage = percentage;
 		printf("\rBVH builder: progress %d%%", percentage);
 	}
 }
 
-void BVH::build(U32 nInd, U32 depth, F32 progressStart = 0.0f, F32 progressEnd = 1.0f)
+// Builds the subtree rooted at frag.nodes[nInd]
+void BVH::build(BuildFragment &frag, U32 nInd, U32 depth, TaskGroup &tasks)
 {
-	lazyPrintBuildStatus(progressStart);
+	frag.nodes[nInd].computeBB(m_refs);
+	atomicMax(metrics.depth, depth);
+	U32 elems = frag.nodes[nInd].spannedTris();
 
-	m_build_nodes[nInd].computeBB(m_refs);
-	metrics.depth = std::max(metrics.depth, depth);
-	U32 elems = m_build_nodes[nInd].spannedTris();
-	if (elems > MaxLeafElems)
+	SplitInfo info;
+	if (elems <= m_maxLeafElems || !partition(frag.nodes[nInd], info)) // parent is cheaper (SAH)
 	{
-		SplitInfo info;
-		bool shouldSplit = partition(m_build_nodes[nInd], info);
+		assert(elems <= std::numeric_limits<U8>::max());
+		U32 done = (metrics.trisInLeaves += elems);
+		lazyPrintBuildStatus((F32)done / (F32)m_refs.size());
+		return;
+	}
 
-		if (!shouldSplit) { // parent is cheaper (SAH)
-			assert(elems <= std::numeric_limits<U8>::max());
-			return;
-		}
+	metrics.splits++;
 
-		metrics.splits++;
+	BuildNode left(frag.nodes[nInd].iStart, info.i, nInd);
+	BuildNode right(info.i + 1, frag.nodes[nInd].iEnd, nInd);
 
-		// Statistics for progress bar
-		F32 progressMid = lerp(progressStart, progressEnd, (F32)(info.i - m_build_nodes[nInd].iStart) / (F32)(elems));
+	// Large subtrees: build children as separate tasks (only ever the case for the fragment root).
+	// Child ranges are disjoint, so tasks never touch the same references.
+	if (elems > ParallelBuildThreshold)
+	{
+		assert(nInd == 0);
+		left.parent = right.parent = -1; // fixed when merging
+		frag.nodes[nInd].rightChild = 0; // interior node, fixed when merging
+		frag.left.reset(new BuildFragment(left));
+		frag.right.reset(new BuildFragment(right));
+
+		ThreadPool &pool = ThreadPool::getInstance();
+		BuildFragment *lfrag = frag.left.get();
+		BuildFragment *rfrag = frag.right.get();
+		pool.submit(tasks, [this, rfrag, depth, &tasks]() { build(*rfrag, 0, depth + 1, tasks); });
+		pool.submit(tasks, [this, lfrag, depth, &tasks]() { build(*lfrag, 0, depth + 1, tasks); });
+		return;
+	}
 
-		// Left child
-		m_build_nodes.push_back(BuildNode(m_build_nodes[nInd].iStart, info.i, nInd));
-		nodes++;
-		build(nodes - 1, depth + 1, progressStart, progressMid); // last pushed
+	// Left child
+	frag.nodes.push_back(left);
+	build(frag, (U32)frag.nodes.size() - 1, depth + 1, tasks); // last pushed
 
-		// Right child
-		m_build_nodes.push_back(BuildNode(info.i + 1, m_build_nodes[nInd].iEnd, nInd));
-		m_build_nodes[nInd].rightChild = nodes++;
-		build(nodes - 1, depth + 1, progressMid, progressEnd);
+	// Right child
+	frag.nodes.push_back(right);
+	frag.nodes[nInd].rightChild = (S32)frag.nodes.size() - 1;
+	build(frag, (U32)frag.nodes.size() - 1, depth + 1, tasks);
+}
+
+// Append fragment to build node vector, producing the same layout as a serial build
+void BVH::mergeFragment(const BuildFragment &frag, S32 parent)
+{
+	S32 offset = (S32)m_build_nodes.size();
+	for (BuildNode n : frag.nodes)
+	{
+		n.parent = (n.parent == -1) ? parent : n.parent + offset;
+		if (n.rightChild != -1)
+			n.rightChild += offset;
+		m_build_nodes.push_back(n);
+	}
+
+	if (frag.left)
+	{
+		mergeFragment(*frag.left, offset);
+		m_build_nodes[offset].rightChild = (S32)m_build_nodes.size();
+		mergeFragment(*frag.right, offset);
 	}
 }
 
@@ -241,6 +407,9 @@ bool BVH::partition(BuildNode &n, SplitInfo &split)
 	case SplitMode_Sah:
 		return sahSplit(n, split);
 		break;
+	case SplitMode_SahBinned:
+		return binnedSahSplit(n, split);
+		break;
 	case SplitMode_SpatialMedian:
 		return spatialMedianSplit(n, split);
 		break;
@@ -256,18 +425,19 @@ bool BVH::partition(BuildNode &n, SplitInfo &split)
 
 void BVH::sortReferences(U32 s, U32 e, U32 dim)
 {
-	auto start = m_refs.begin() + s;
-	auto end = m_refs.begin() + e + 1;
+	sortReferences(m_refs, s, e, dim);
+}
+
+void BVH::sortReferences(std::vector<TriRef> &refs, U32 s, U32 e, U32 dim)
+{
+	auto start = refs.begin() + s;
+	auto end = refs.begin() + e + 1;
 
 	// Sort the range [s, e[ by triangle centroid
 
 	//std::sort(start, end, [dim](TriRef &r1, TriRef &r2) { return r1.pos[dim] < r2.pos[dim]; });
 
-	std::sort(start, end, [dim](TriRef &r1, TriRef &r2) {
-		F32 ca = r1.box.min[dim] + r1.box.max[dim];
-		F32 cb = r2.box.min[dim] + r2.box.max[dim];
-		return (ca < cb || (ca == cb && r1.ind < r2.ind));
-	});
+	std::sort(start, end, [dim](const TriRef &r1, const TriRef &r2) { return centroidLess(r1, r2, dim); });
 }
 
 bool BVH::objectMedianSplit(BuildNode &n, SplitInfo &split)
@@ -287,8 +457,7 @@ AABB_t BVH::centroudBounds(std::vector<TriRef>::const_iterator begin, std::vecto
 {
 	AABB_t bounds;
 	for (auto i = begin; i != end; i++) {
-		bounds.min = vmin(bounds.min, i->pos);
-		bounds.max = vmax(bounds.max, i->pos);
+		bounds.expand(i->pos());
 	}
 
 	return bounds;
@@ -304,7 +473,7 @@ bool BVH::spatialMedianSplit(BuildNode &n, SplitInfo &info)
 	F32 splitCoord = centroidBox.centroid()[dim];
 
 	// Partition the range [s, e[
-	auto it = std::partition(s, e, [dim, splitCoord](TriRef &r) { return r.pos[dim] < splitCoord; });
+	auto it = std::partition(s, e, [dim, splitCoord](TriRef &r) { return r.pos()[dim] < splitCoord; });
 	info.i = (U32)(it - m_refs.begin()); // Index of split point in index list (first elem. of second group)
 
 	// Fix bad splits (use midpoint)
@@ -324,14 +493,14 @@ F32 BVH::sahCost(U32 N1, F32 area1, U32 N2, F32 area2, F32 area_root) const
 	return 2 * sahParams.costBox + sahParams.costTri * (lcost + rcost);
 }
 
-// lookup[n] = AABB with last n + 1 triangles
+// lookup[iStart + n] = area of AABB with last n + 1 triangles
 void BVH::buildBoxLookup(BuildNode &n)
 {
 	AABB_t box;
 	for (U32 i = 0; i < n.spannedTris(); i++)
 	{
-		box.expand(m_refs[n.iEnd - i].box);
-		rightBoxes[i] = box;
+		box.expand(m_refs[n.iEnd - i].box());
+		rightAreas[n.iStart + i] = box.area();
 	}
 }
 
@@ -357,11 +526,10 @@ bool BVH::sahSplit(BuildNode &n, SplitInfo &info)
 		// Try different split points along axis
 		for (U32 s = n.iStart; s < n.iEnd; s++) // exclude last (all on left side)
 		{
-			leftBox.expand(m_refs[s].box);
+			leftBox.expand(m_refs[s].box());
 			leftCount++;
 
-			AABB_t &rightBox = rightBoxes[n.iEnd - s - 1];
-			F32 areaRight = rightBox.area();
+			F32 areaRight = rightAreas[n.iStart + n.iEnd - s - 1];
 			F32 areaLeft = leftBox.area();
 
 			// New best split?
@@ -372,8 +540,7 @@ bool BVH::sahSplit(BuildNode &n, SplitInfo &info)
 			{
 				info.cost = cost;
 				info.i = s;
-				info.leftBounds = leftBox;
-				info.rightBounds = rightBox;
+				info.leftBounds = leftBox; // right bounds not needed, child boxes are recomputed
 				info.dim = dim;
 			}
 		} // END LOOP SPLIT POINTS
@@ -383,7 +550,7 @@ bool BVH::sahSplit(BuildNode &n, SplitInfo &info)
 	assert(info.i > -1);
 
 	// Worse than parent?
-	if (info.cost > parentCost && n.spannedTris() < MaxLeafElems)
+	if (info.cost > parentCost && n.spannedTris() < m_maxLeafElems)
 		return false;
 
 	// Re-sort along best axis, if necessary
@@ -403,4 +570,125 @@ bool BVH::sahSplit(BuildNode &n, SplitInfo &info)
 	}
 
 	return true;
-}
\ No newline at end of file
+}
+
+// Centroid binning of refs [s, e] along all three axes.
+// Linear in the number of refs, nothing is reordered.
+BVH::SplitInfo BVH::findBinnedSplit(const std::vector<TriRef> &refs, U32 s, U32 e) const
+{
+	struct Bin
+	{
+		AABB_t box;
+		U32 count;
+	};
+
+	// Bounds of box centroids (same measure as sortReferences)
+	AABB_t cbounds;
+	for (U32 i = s; i <= e; i++)
+	{
+		cbounds.expand(float3(refs[i].center2(0), refs[i].center2(1), refs[i].center2(2)));
+	}
+
+	SplitInfo info;
+	Bin bins[MaxSahBins];
+	AABB_t rightBins[MaxSahBins];
+	const U32 N = m_sahBins;
+
+	for (U32 dim = 0; dim < 3; dim++)
+	{
+		F32 extent = cbounds.max[dim] - cbounds.min[dim];
+		if (extent <= 0.0f)
+			continue; // all centroids on the same plane
+
+		F32 origin = cbounds.min[dim];
+		F32 scale = N / extent;
+
+		for (U32 b = 0; b < N; b++)
+		{
+			bins[b].box = AABB_t();
+			bins[b].count = 0;
+		}
+
+		for (U32 i = s; i <= e; i++)
+		{
+			const TriRef &r = refs[i];
+			U32 b = centroidBin(r, dim, origin, scale, N);
+			bins[b].box.expand(r.box());
+			bins[b].count++;
+		}
+
+		// rightBins[b] = bounds of bins [b, N[
+		AABB_t rightBox;
+		for (U32 b = N - 1; b > 0; b--)
+		{
+			rightBox.expand(bins[b].box);
+			rightBins[b] = rightBox;
+		}
+
+		// Sweep bin boundaries left to right
+		AABB_t leftBox;
+		U32 leftCount = 0;
+		U32 total = e - s + 1;
+		for (U32 b = 1; b < N; b++)
+		{
+			leftBox.expand(bins[b - 1].box);
+			leftCount += bins[b - 1].count;
+			if (leftCount == 0 || leftCount == total)
+				continue;
+
+			// Unscaled SAH, callers convert to their own cost model
+			F32 cost = leftBox.area() * leftCount + rightBins[b].area() * (total - leftCount);
+			if (cost < info.cost)
+			{
+				info.cost = cost;
+				info.i = leftCount;
+				info.dim = dim;
+				info.bin = b;
+				info.binOrigin = origin;
+				info.binScale = scale;
+				info.leftBounds = leftBox;
+				info.rightBounds = rightBins[b];
+			}
+		}
+	}
+
+	return info;
+}
+
+// Partition refs [s, e] in place according to binned split
+U32 BVH::partitionBinned(std::vector<TriRef> &refs, U32 s, U32 e, const SplitInfo &split) const
+{
+	assert(split.bin > 0);
+	const U32 N = m_sahBins;
+	const U32 dim = split.dim;
+	auto it = std::partition(refs.begin() + s, refs.begin() + e + 1, [&](const TriRef &r) {
+		return centroidBin(r, dim, split.binOrigin, split.binScale, N) < (U32)split.bin;
+	});
+
+	return (U32)(it - refs.begin());
+}
+
+bool BVH::binnedSahSplit(BuildNode &n, SplitInfo &info)
+{
+	F32 parentArea = n.box.area();
+	assert(parentArea > 0.0f);
+
+	// Degenerate centroid distribution => fall back to full sweep
+	SplitInfo binned = findBinnedSplit(m_refs, n.iStart, n.iEnd);
+	if (binned.bin < 0)
+		return sahSplit(n, info);
+
+	F32 parentCost = sahParams.costBox + n.spannedTris() * sahParams.costTri;
+	info = binned;
+	info.cost = 2 * sahParams.costBox + sahParams.costTri * binned.cost / parentArea;
+
+	// Worse than parent?
+	if (info.cost > parentCost && n.spannedTris() < m_maxLeafElems)
+		return false;
+
+	// Last element of left group
+	info.i = partitionBinned(m_refs, n.iStart, n.iEnd, binned) - 1;
+	assert(info.i == n.iStart + binned.i - 1);
+
+	return true;
+}
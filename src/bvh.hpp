@@ -3,36 +3,83 @@
 #include <vector>
 #include <numeric>
 #include <fstream>
+#include <atomic>
+#include <memory>
 #include "triangle.hpp"
 #include "bvhnode.hpp"
 #include "rtutil.hpp"
+#include "hierarchycache.hpp"
+#include "geom.h"
 
 template <class A, class B> A lerp(const A& a, const A& b, const B& t) { return (A)(a * ((B)1 - t) + b * t); }
 
+class TaskGroup;
+class CacheReader;
+class CacheWriter;
+
 class BVH
 {
 
 friend class CLContext;
+friend class TwoLevelBVH;
+friend class BVHStats;
 
 public:
-    BVH(std::vector<RTTriangle> *tris, SplitMode mode);
-    BVH(std::vector<RTTriangle> *tris, const std::string filename);
-	BVH(void) {}
-	~BVH() {}
+    BVH(TriangleMesh *tris, SplitMode mode);
+    BVH(TriangleMesh *tris, const std::string filename);
+    BVH(TriangleMesh *tris, const CacheReader &reader); // hierarchy embedded in a scene package
+	BVH(void);
+	virtual ~BVH() {}
 
     void exportTo(const std::string filename) const;
+    void exportTo(CacheWriter &writer) const; // adds node and index sections
+
+	// Treelet restructuring of the finished hierarchy, see treelet.hpp.
+	// Raising the cancel flag stops it early, the hierarchy is then unchanged.
+	void optimizeTreelets(U32 passes, const std::atomic<bool> *cancel = nullptr);
+	F32 getSahCost(void) const; // normalized by root area
+
+	// Storage order of m_nodes for traversal, see nodelayout.hpp
+	void reorderNodes(NodeLayout layout);
+
+	// Recompute bounds from current triangle positions, topology is kept.
+	// For deforming geometry: quality degrades with large deformations.
+	// Single-level hierarchies only.
+	void refit(void);
 
     AABB_t getSceneBounds(void) const;
+	const HierarchyBuildInfo &getBuildInfo(void) const { return m_buildInfo; }
+
+protected:
+	struct SplitInfo;
+
+	// Subtree built by a single task, node indices relative to fragment.
+	// If the root was split in parallel, its children are separate fragments.
+	struct BuildFragment
+	{
+		std::vector<BuildNode> nodes;
+		std::unique_ptr<BuildFragment> left;
+		std::unique_ptr<BuildFragment> right;
+
+		BuildFragment(const BuildNode &root) : nodes(1, root) {}
+		size_t bytes() const { return nodes.capacity() * sizeof(BuildNode) + (left ? left->bytes() + right->bytes() : 0); }
+	};
+
+	void mergeFragment(const BuildFragment &frag, S32 parent);
 
 private:
-	void build(U32 nInd, U32 depth, F32 progressStart, F32 progressEnd);
+	void build(BuildFragment &frag, U32 nInd, U32 depth, TaskGroup &tasks);
 
 protected:
-	struct SplitInfo;
-	
-	
     void importFrom(const std::string filename);
+    void importFrom(const CacheReader &reader);
 	void lazyPrintBuildStatus(F32 percentage);
+	void recordBuildInfo(HierarchyBuilder builder, U32 optimizePasses); // from current settings
+
+	// Host memory held by build structures, peak printed in build summary
+	void allocBuildMemory(size_t bytes);
+	void freeBuildMemory(size_t bytes);
+	F32 buildMemoryMiB(void) const;
 
     // Convert build nodes to small nodes
     void createSmallNodes();
@@ -46,40 +93,62 @@ protected:
 	bool objectMedianSplit(BuildNode &n, SplitInfo &split);
 	bool objectMedianSplit(BuildNode &n, U32 dim, SplitInfo &split);
 	bool sahSplit(BuildNode &n, SplitInfo &split);
+	bool binnedSahSplit(BuildNode &n, SplitInfo &split);
 	void sortReferences(U32 s, U32 e, U32 dim);
+	static void sortReferences(std::vector<TriRef> &refs, U32 s, U32 e, U32 dim);
+
+	// Binned SAH object split over refs [s, e], shared with SBVH
+	SplitInfo findBinnedSplit(const std::vector<TriRef> &refs, U32 s, U32 e) const;
+	U32 partitionBinned(std::vector<TriRef> &refs, U32 s, U32 e, const SplitInfo &split) const; // returns index of first right ref
 
 	F32 sahCost(U32 N1, F32 area1, U32 N2, F32 area2, F32 area_root) const;
 	void buildBoxLookup(BuildNode &n);
 	AABB_t centroudBounds(std::vector<TriRef>::const_iterator begin, std::vector<TriRef>::const_iterator end) const;
 
-	std::vector<RTTriangle>* m_triangles;
+	TriangleMesh *m_triangles;
 	std::vector<U32> m_indices;
 	std::vector<TriRef> m_refs;
 	std::vector<BuildNode> m_build_nodes;
 	std::vector<Node> m_nodes;
-	std::vector<AABB_t> rightBoxes; // SAH builder optimization
-	U32 nodes = 0;
+	std::vector<GPUInstance> m_instances; // two-level hierarchies only, see twolevelbvh.hpp
+	U32 m_instanceEntries = 0;            // two-level hierarchies: leading index list entries that reference instances
+	std::vector<F32> rightAreas; // SAH builder optimization
 	SplitMode m_mode;
+	HierarchyBuildInfo m_buildInfo; // stored with cached hierarchies
+	U32 m_sahBins; // binned SAH resolution, from settings
+	U32 m_maxLeafElems; // larger nodes are always split, from settings
 
 	enum
 	{
-		MaxLeafElems = 8,
-		MaxDepth = 64
+		MaxLeafElems = 255, // nPrims is 8-bit
+		MaxDepth = 64,
+		MaxSahBins = 128,
+		ParallelBuildThreshold = 4096, // larger subtrees are built as separate tasks
+		RefitChunkSize = 1024          // nodes per parallel task in refitting
 	};
 
+	// From settings, tuned per device by Tracer::autotuneHierarchy
 	struct
 	{
-		const F32 costBox = 1.0f;
-		const F32 costTri = 1.0f;
+		F32 costBox = 1.0f;
+		F32 costTri = 1.0f;
 	} sahParams;
 
+	// Updated concurrently by build tasks
 	struct
 	{
-		U32 depth = 0;
-		U32 bad_splits = 0;
-		U32 splits = 0;
+		std::atomic<U32> depth { 0 };
+		std::atomic<U32> bad_splits { 0 };
+		std::atomic<U32> splits { 0 };
+		std::atomic<U32> trisInLeaves { 0 }; // for progress reporting
 	} metrics;
 
+	struct
+	{
+		std::atomic<size_t> current { 0 };
+		std::atomic<size_t> peak { 0 };
+	} buildMemory;
+
 	struct SplitInfo
 	{
 		S32 i;
@@ -89,12 +158,32 @@ protected:
 		AABB_t leftBounds;
 		AABB_t rightBounds;
 
-		SplitInfo(void) : i(-1), dim(-1), cost(FLT_MAX) {}
+		// Binned object split: refs with centroid bin < bin go left
+		S32 bin;
+		F32 binOrigin;
+		F32 binScale;
+
+		SplitInfo(void) : i(-1), dim(-1), cost(FLT_MAX), bin(-1) {}
 	};
 
-	S32 buildPercentage = -1; // for printing sparingly
+	std::atomic<S32> buildPercentage { -1 }; // for printing sparingly
 };
 
+// Lock-free maximum for concurrently updated metrics
+template<class T>
+inline void atomicMax(std::atomic<T> &target, T value)
+{
+	T prev = target;
+	while (prev < value && !target.compare_exchange_weak(prev, value)) {}
+}
+
+// Allocated size of a vector
+template<class T>
+inline size_t vectorBytes(const std::vector<T> &vec)
+{
+	return vec.capacity() * sizeof(T);
+}
+
 // Write a simple data type to a stream.
 template<class T>
 std::ostream &write(std::ostream &stream, const T &x)
@@ -4,15 +4,6 @@
 void BuildNode::computeBB(std::vector<TriRef> &refs) {
 	assert(iStart <= iEnd); // range must be non-empty
 	for (U32 i = iStart; i <= iEnd; i++) {
-		box.expand(refs[i].box);
+		box.expand(refs[i].box());
 	}
-}
-
-void SBVHNode::deleteTree() {
-	if (!this->isLeaf()) {
-		leftChild->deleteTree();
-		rightChild->deleteTree();
-	}
-
-	delete this;
 }
\ No newline at end of file
@@ -1,19 +1,49 @@
 #pragma once
 
+#include <algorithm>
 #include "rtutil.hpp"
 #include "math/float3.hpp"
 
+/* Triangle reference used in construction. Bounds stored without padding (28B), centroid derived from them. */
 struct TriRef
 {
-	U32 ind;	// index of tri
-	AABB_t box;	// bounding box
-	float3 pos;	// triangle centroid
+	U32 ind;		// index of tri
+	F32 lo[3];		// bounding box
+	F32 hi[3];
 
 	TriRef(void) {}
-	TriRef(const TriRef &other) : ind(other.ind), box(other.box), pos(other.pos) {}
-	TriRef(U32 i, RTTriangle &tri) : ind(i), box(tri.min(), tri.max()), pos(tri.centroid()) {}
+	TriRef(U32 i, const TriangleMesh &mesh) : ind(i) { setBox(AABB_t(mesh.min(i), mesh.max(i))); }
+
+	inline AABB_t box() const { return AABB_t(float3(lo[0], lo[1], lo[2]), float3(hi[0], hi[1], hi[2])); }
+	inline float3 pos() const { return 0.5f * float3(lo[0] + hi[0], lo[1] + hi[1], lo[2] + hi[2]); }
+	inline F32 center2(U32 dim) const { return lo[dim] + hi[dim]; } // doubled centroid
+
+	inline void setBox(const AABB_t &box)
+	{
+		for (U32 dim = 0; dim < 3; dim++)
+		{
+			lo[dim] = box.min[dim];
+			hi[dim] = box.max[dim];
+		}
+	}
 };
 
+static_assert(sizeof(TriRef) == 28, "TriRef must stay compact");
+
+// Reference order along an axis: box centroid, ties broken by triangle index
+inline bool centroidLess(const TriRef &r1, const TriRef &r2, U32 dim)
+{
+	F32 ca = r1.center2(dim);
+	F32 cb = r2.center2(dim);
+	return (ca < cb || (ca == cb && r1.ind < r2.ind));
+}
+
+// Bin of reference centroid (doubled, like in centroidLess)
+inline U32 centroidBin(const TriRef &r, U32 dim, F32 origin, F32 scale, U32 numBins)
+{
+	return std::min(numBins - 1, (U32)((r.center2(dim) - origin) * scale));
+}
+
 /* Fat node used in BVH construction */
 struct BuildNode
 {
@@ -29,7 +59,7 @@ struct BuildNode
 	BuildNode(U32 s, U32 e, S32 p) : iStart(s), iEnd(e), parent(p) {}
 };
 
-/* Pointer-based node used in SBVH construction */
+/* Pointer-based node used in SBVH construction, allocated from an Arena */
 struct SBVHNode
 {
 	AABB_t box;
@@ -38,7 +68,6 @@ struct SBVHNode
 	SBVHNode *rightChild = nullptr;
 	inline U32 spannedTris() const { return hi - lo; }
 	inline bool isLeaf() const { return !leftChild && !rightChild; }
-	void deleteTree();
 
 	SBVHNode(const AABB_t &b, SBVHNode* l, SBVHNode* r) : box(b), leftChild(l), rightChild(r) {} // inner node
 	SBVHNode(const AABB_t &b, int l, int h) : box(b), lo(l), hi(h) {} // leaf node
@@ -51,7 +80,8 @@ struct Node
 	S32 parent;
 	union {
 		U32 iStart;		// leaf node, indiex into index list
-		U32 rightChild; // internal node, index into node vector (left child always current + 1)
+		U32 rightChild; // internal node, index into node vector
 	};
+	U32 leftChild;		// internal node, current + 1 unless reordered (see nodelayout.hpp)
 	U8 nPrims = 0;		// 0 for interior nodes
 };
\ No newline at end of file
@@ -0,0 +1,157 @@
+#include "scene.hpp"
+#include "sbvh.hpp"
+#include "lbvh.hpp"
+#include "bvhstats.hpp"
+#include "settings.hpp"
+#include "IL/il.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <tclap/CmdLine.h>
+
+// Hierarchy statistics without window or OpenCL device, for comparing builder settings
+int main(int argc, char* argv[])
+{
+    Settings &s = Settings::getInstance();
+
+    std::string sceneFile;
+    std::string importFile;
+    std::string exportFile;
+    HierarchyBuilder builder;
+    unsigned int numRays;
+    unsigned int seed;
+    RaySet raySet;
+    bool epo;
+
+    try
+    {
+        TCLAP::CmdLine cmd("~ Fluctus - BVH statistics ~", ' ', "0.1");
+
+        TCLAP::ValueArg<std::string> aMode("m", "mode", "Split mode: sah, sah_binned, object_median, spatial_median, lbvh", false, s.getBvhSplitMode(), "string");
+        cmd.add(aMode);
+
+        TCLAP::ValueArg<std::string> aBuilder("b", "builder", "Builder of SAH modes: sbvh (default, as in the renderer) or bvh. Median modes use bvh", false, "", "string");
+        cmd.add(aBuilder);
+
+        TCLAP::ValueArg<unsigned int> aLeaf("l", "leaf", "Max leaf size of SAH builders", false, s.getBvhMaxLeafElems(), "int");
+        cmd.add(aLeaf);
+
+        TCLAP::ValueArg<float> aAlpha("a", "alpha", "SBVH spatial split threshold", false, s.getBvhSplitAlpha(), "float");
+        cmd.add(aAlpha);
+
+        TCLAP::ValueArg<unsigned int> aPasses("p", "passes", "Treelet optimization passes", false, s.getBvhOptimizePasses(), "int");
+        cmd.add(aPasses);
+
+        TCLAP::ValueArg<std::string> aImport("i", "import", "Analyze exported hierarchy instead of building", false, "", "file");
+        cmd.add(aImport);
+
+        TCLAP::ValueArg<std::string> aExport("e", "export", "Export built hierarchy", false, "", "file");
+        cmd.add(aExport);
+
+        TCLAP::ValueArg<unsigned int> aRays("r", "rays", "Number of CPU rays traced, 0 = none", false, 100000, "int");
+        cmd.add(aRays);
+
+        TCLAP::ValueArg<std::string> aRaySet("t", "ray-set", "Ray origins: surface (bounces) or uniform (scene bounds)", false, "surface", "string");
+        cmd.add(aRaySet);
+
+        TCLAP::ValueArg<unsigned int> aSeed("", "seed", "Random seed of the rays", false, 1, "int");
+        cmd.add(aSeed);
+
+        TCLAP::SwitchArg aNoEpo("", "no-epo", "Skip EPO computation (slow on large scenes)", cmd, false);
+
+        TCLAP::UnlabeledValueArg<std::string> aScene("Scene", "Scene file (.obj or .ply)", true, "", "string");
+        cmd.add(aScene);
+
+        cmd.parse(argc, argv);
+        sceneFile = aScene.getValue();
+        importFile = aImport.getValue();
+        exportFile = aExport.getValue();
+        numRays = aRays.getValue();
+        seed = aSeed.getValue();
+        epo = !aNoEpo.getValue();
+
+        if (aRaySet.getValue() != "surface" && aRaySet.getValue() != "uniform")
+            throw TCLAP::ArgException("Invalid value", "ray-set");
+        raySet = (aRaySet.getValue() == "uniform") ? RaySet_Uniform : RaySet_Surface;
+
+        const std::string &mode = aMode.getValue();
+        if (mode != "sah" && mode != "sah_binned" && mode != "object_median" && mode != "spatial_median" && mode != "lbvh")
+            throw TCLAP::ArgException("Invalid value", "mode");
+        s.setBvhSplitMode(mode);
+
+        builder = builderForSplitMode(parseSplitMode(mode));
+        if (aBuilder.getValue() == "bvh" && builder != HierarchyBuilder_LBVH)
+            builder = HierarchyBuilder_BVH;
+        else if (aBuilder.getValue() == "sbvh" && builder == HierarchyBuilder_SBVH)
+            builder = HierarchyBuilder_SBVH;
+        else if (aBuilder.getValue() != "")
+            throw TCLAP::ArgException("Invalid value for split mode " + mode, "builder");
+        s.setBvhMaxLeafElems(aLeaf.getValue());
+        s.setBvhSplitAlpha(aAlpha.getValue());
+        s.setBvhOptimizePasses(aPasses.getValue());
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cout << "Error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    ilInit(); // material textures
+
+    Scene scene;
+    scene.loadModel(sceneFile, nullptr);
+    TriangleMesh &triangles = scene.getTriangles();
+    if (triangles.empty())
+    {
+        std::cout << "Scene has no triangles" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<BVH> bvh;
+    SplitMode mode = parseSplitMode(s.getBvhSplitMode());
+    auto time1 = std::chrono::high_resolution_clock::now();
+    if (!importFile.empty())
+    {
+        std::cout << "Importing " << importFile << std::endl;
+        try
+        {
+            bvh.reset(new SBVH(&triangles, importFile));
+        }
+        catch (std::runtime_error &e)
+        {
+            std::cout << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        if (builder == HierarchyBuilder_LBVH)
+            bvh.reset(new LBVH(&triangles));
+        else if (builder == HierarchyBuilder_BVH)
+            bvh.reset(new BVH(&triangles, mode));
+        else
+            bvh.reset(new SBVH(&triangles, mode, nullptr));
+
+        if (s.getBvhOptimizePasses() > 0)
+            bvh->optimizeTreelets(s.getBvhOptimizePasses());
+    }
+    auto time2 = std::chrono::high_resolution_clock::now();
+
+    if (!exportFile.empty())
+        bvh->exportTo(exportFile);
+
+    std::cout << "Hierarchy: ";
+    if (importFile.empty())
+        std::cout << bvh->getBuildInfo().describe();
+    else
+        std::cout << importFile;
+    std::cout << ", " << std::chrono::duration<double, std::milli>(time2 - time1).count() << " ms" << std::endl;
+
+    BVHStats stats(*bvh);
+    if (epo)
+        stats.computeEPO();
+    stats.traceRays(raySet, numRays, seed);
+    stats.print(std::cout);
+
+    return 0;
+}
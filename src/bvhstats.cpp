@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <random>
+#include "bvhstats.hpp"
+#include "threadpool.hpp"
+
+enum
+{
+	EpoChunkSize = 256,   // nodes per parallel task in EPO
+	TraceChunkSize = 4096 // rays per parallel task in tracing
+};
+
+BVHStats::BVHStats(const BVH &bvh) : bvh(bvh), nodes(bvh.m_nodes), indices(bvh.m_indices), tris(*bvh.m_triangles)
+{
+	assert(bvh.m_instances.empty() && "Two-level hierarchies not supported");
+	computeStructure();
+}
+
+void BVHStats::computeStructure(void)
+{
+	sahCost = bvh.getSahCost();
+
+	// Parents precede children in all layouts => depths in a single sweep
+	std::vector<U32> depth(nodes.size(), 0);
+	std::vector<bool> referenced(tris.size(), false);
+	U64 depthSum = 0;
+	for (U32 i = 0; i < nodes.size(); i++)
+	{
+		const Node &n = nodes[i];
+		if (n.parent != -1)
+			depth[i] = depth[n.parent] + 1;
+		maxDepth = std::max(maxDepth, depth[i]);
+
+		if (n.nPrims == 0)
+			continue;
+
+		leaves++;
+		references += n.nPrims;
+		depthSum += depth[i];
+
+		if (leafSizes.size() <= n.nPrims)
+			leafSizes.resize(n.nPrims + 1, 0);
+		leafSizes[n.nPrims]++;
+
+		if (leafDepths.size() <= depth[i])
+			leafDepths.resize(depth[i] + 1, 0);
+		leafDepths[depth[i]]++;
+
+		for (U32 j = n.iStart; j < n.iStart + n.nPrims; j++)
+			referenced[indices[j]] = true;
+	}
+
+	unreferenced = (U32)std::count(referenced.begin(), referenced.end(), false);
+	avgLeafDepth = (leaves > 0) ? (double)depthSum / leaves : 0.0;
+	nodeBytes = nodes.size() * sizeof(Node);
+	leafBytes = indices.size() * sizeof(LeafTriangle);
+	triangleBytes = tris.bytes();
+	peakBuildMiB = bvh.buildMemoryMiB();
+}
+
+static inline bool overlaps(const AABB_t &a, const AABB_t &b)
+{
+	return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+		a.min.y <= b.max.y && b.min.y <= a.max.y &&
+		a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+// Area of the part of the triangle inside the box, Sutherland-Hodgman clipping
+static F32 clippedArea(const TriangleMesh &mesh, U32 tri, const AABB_t &box)
+{
+	float3 poly[9] = { mesh.position(tri, 0), mesh.position(tri, 1), mesh.position(tri, 2) };
+	float3 clipped[9];
+	U32 count = 3;
+
+	for (U32 plane = 0; plane < 6 && count > 0; plane++)
+	{
+		const U32 dim = plane % 3;
+		const bool isMax = plane >= 3;
+		const F32 coord = isMax ? box.max[dim] : box.min[dim];
+		auto inside = [&](const float3 &p) { return isMax ? p[dim] <= coord : p[dim] >= coord; };
+
+		U32 out = 0;
+		for (U32 i = 0; i < count; i++)
+		{
+			const float3 &a = poly[i];
+			const float3 &b = poly[(i + 1) % count];
+			if (inside(a))
+				clipped[out++] = a;
+			if (inside(a) != inside(b))
+				clipped[out++] = lerp(a, b, (coord - a[dim]) / (b[dim] - a[dim]));
+		}
+
+		count = out;
+		std::copy(clipped, clipped + count, poly);
+	}
+
+	if (count < 3)
+		return 0.0f;
+
+	float3 sum(0.0f);
+	for (U32 i = 1; i + 1 < count; i++)
+		sum += cross(poly[i] - poly[0], poly[i + 1] - poly[0]);
+	return 0.5f * length(sum);
+}
+
+// Surface area of triangles outside the subtree of node 'ni' that lies inside its box.
+// 'enter' and 'exit' bound the preorder numbers of each subtree, triangle t is referenced by the
+// leaves with preorder numbers triLeaves[leafOffsets[t]] to triLeaves[leafOffsets[t + 1] - 1].
+F32 BVHStats::overlapArea(U32 ni, const std::vector<U32> &enter, const std::vector<U32> &exit,
+	const std::vector<U32> &leafOffsets, const std::vector<U32> &triLeaves, std::vector<U32> &candidates) const
+{
+	const AABB_t &box = nodes[ni].box;
+	auto inSubtree = [&](U32 t)
+	{
+		for (U32 i = leafOffsets[t]; i < leafOffsets[t + 1]; i++)
+		{
+			if (triLeaves[i] >= enter[ni] && triLeaves[i] < exit[ni])
+				return true;
+		}
+		return false;
+	};
+
+	candidates.clear();
+	std::vector<U32> stack(1, 0);
+	while (!stack.empty())
+	{
+		U32 mi = stack.back();
+		stack.pop_back();
+
+		const Node &m = nodes[mi];
+		if (mi == ni || !overlaps(m.box, box))
+			continue;
+
+		if (m.nPrims == 0)
+		{
+			stack.push_back(m.leftChild);
+			stack.push_back(m.rightChild);
+			continue;
+		}
+
+		for (U32 i = m.iStart; i < m.iStart + m.nPrims; i++)
+		{
+			if (!inSubtree(indices[i]))
+				candidates.push_back(indices[i]);
+		}
+	}
+
+	// Duplicated references overlapping the box are counted once
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+	F32 area = 0.0f;
+	for (U32 t : candidates)
+		area += clippedArea(tris, t, box);
+	return area;
+}
+
+void BVHStats::computeEPO(void)
+{
+	auto time1 = std::chrono::high_resolution_clock::now();
+	const U32 N = (U32)nodes.size();
+
+	// Preorder numbering: subtree of node i is [enter[i], exit[i])
+	std::vector<U32> size(N, 1);
+	for (U32 i = N; i-- > 0;)
+	{
+		if (nodes[i].nPrims == 0)
+			size[i] += size[nodes[i].leftChild] + size[nodes[i].rightChild];
+	}
+
+	std::vector<U32> enter(N, 0), exit(N);
+	for (U32 i = 0; i < N; i++)
+	{
+		const Node &n = nodes[i];
+		if (n.nPrims == 0)
+		{
+			enter[n.leftChild] = enter[i] + 1;
+			enter[n.rightChild] = enter[i] + 1 + size[n.leftChild];
+		}
+		exit[i] = enter[i] + size[i];
+	}
+
+	// Leaves referencing each triangle
+	std::vector<U32> leafOffsets(tris.size() + 1, 0);
+	for (U32 ind : indices)
+		leafOffsets[ind + 1]++;
+	for (size_t t = 0; t < tris.size(); t++)
+		leafOffsets[t + 1] += leafOffsets[t];
+
+	std::vector<U32> triLeaves(indices.size());
+	std::vector<U32> fill(leafOffsets.begin(), leafOffsets.end() - 1);
+	for (U32 i = 0; i < N; i++)
+	{
+		const Node &n = nodes[i];
+		for (U32 j = n.iStart; j < n.iStart + n.nPrims; j++)
+			triLeaves[fill[indices[j]]++] = enter[i];
+	}
+
+	// Chunks summed in order => deterministic result
+	const U32 numChunks = (N + EpoChunkSize - 1) / EpoChunkSize;
+	std::vector<double> chunkSums(numChunks, 0.0);
+	ThreadPool::getInstance().parallelFor(numChunks, [&](U32 c)
+	{
+		std::vector<U32> candidates;
+		const U32 end = std::min(N, (c + 1) * EpoChunkSize);
+		for (U32 i = c * EpoChunkSize; i < end; i++)
+		{
+			const Node &n = nodes[i];
+			F32 cost = (n.nPrims > 0) ? bvh.sahParams.costTri * n.nPrims : bvh.sahParams.costBox;
+			chunkSums[c] += cost * overlapArea(i, enter, exit, leafOffsets, triLeaves, candidates);
+		}
+	});
+
+	double totalArea = 0.0;
+	for (size_t i = 0; i < tris.size(); i++)
+		totalArea += tris.area(i);
+
+	double sum = 0.0;
+	for (double s : chunkSums)
+		sum += s;
+	epo = (totalArea > 0.0) ? (F32)(sum / totalArea) : 0.0f;
+
+	auto time2 = std::chrono::high_resolution_clock::now();
+	epoMs = std::chrono::duration<double, std::milli>(time2 - time1).count();
+}
+
+// Möller-Trumbore, as in intersect.cl
+static inline bool intersectTriangle(const float3 &orig, const float3 &dir, const TriangleMesh &mesh, U32 tri, F32 &t)
+{
+	const float3 &p0 = mesh.position(tri, 0);
+	float3 s1 = mesh.position(tri, 1) - p0;
+	float3 s2 = mesh.position(tri, 2) - p0;
+	float3 pvec = cross(dir, s2);
+	F32 det = dot(s1, pvec);
+	if (std::abs(det) < 1e-12f)
+		return false;
+	F32 iDet = 1.0f / det;
+
+	float3 tvec = orig - p0;
+	F32 u = dot(tvec, pvec) * iDet;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+
+	float3 qvec = cross(tvec, s1);
+	F32 v = dot(dir, qvec) * iDet;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+
+	t = dot(s2, qvec) * iDet;
+	return t >= 0.0f;
+}
+
+static inline bool intersectBox(const float3 &orig, const float3 &dinv, const AABB_t &box, F32 tMaxPrev, F32 &tmin)
+{
+	float3 t0 = (box.min - orig) * dinv;
+	float3 t1 = (box.max - orig) * dinv;
+	float3 tminv = vmin(t0, t1);
+	float3 tmaxv = vmax(t0, t1);
+	tmin = std::max(std::max(tminv.x, tminv.y), tminv.z);
+	F32 tmax = std::min(std::min(tmaxv.x, tmaxv.y), tmaxv.z);
+	return tmax >= 0.0f && tmin <= tmax && tmin < tMaxPrev;
+}
+
+// Closest hit, same visiting order as the stack traversal kernel
+bool BVHStats::intersect(const TestRay &ray, TraceCounts &counts) const
+{
+	const float3 dinv = float3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+	F32 tHit = FLT_MAX;
+
+	U32 stack[2 * BVH::MaxDepth];
+	S32 stackptr = 0;
+	stack[0] = 0;
+
+	while (stackptr >= 0)
+	{
+		const Node &n = nodes[stack[stackptr--]];
+		counts.nodeVisits++;
+
+		if (n.nPrims != 0)
+		{
+			for (U32 i = n.iStart; i < n.iStart + n.nPrims; i++)
+			{
+				F32 t;
+				counts.triTests++;
+				if (intersectTriangle(ray.orig, ray.dir, tris, indices[i], t) && t > 0.0f && t < tHit)
+					tHit = t;
+			}
+			continue;
+		}
+
+		F32 lnear, rnear;
+		counts.boxTests += 2;
+		bool leftWasHit = intersectBox(ray.orig, dinv, nodes[n.leftChild].box, tHit, lnear);
+		bool rightWasHit = intersectBox(ray.orig, dinv, nodes[n.rightChild].box, tHit, rnear);
+
+		if (leftWasHit && rightWasHit)
+		{
+			U32 closer = n.leftChild;
+			U32 farther = n.rightChild;
+			if (rnear < lnear)
+				std::swap(closer, farther);
+
+			assert(stackptr + 2 < 2 * BVH::MaxDepth);
+			stack[++stackptr] = farther;
+			stack[++stackptr] = closer;
+		}
+		else if (leftWasHit)
+		{
+			stack[++stackptr] = n.leftChild;
+		}
+		else if (rightWasHit)
+		{
+			stack[++stackptr] = n.rightChild;
+		}
+	}
+
+	return tHit < FLT_MAX;
+}
+
+void BVHStats::traceRays(RaySet set, U32 count, U32 seed)
+{
+	raySet = set;
+	rays = count;
+	counts = TraceCounts();
+	if (count == 0 || tris.empty())
+		return;
+
+	// Generated up front => same rays regardless of thread count
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<F32> uniform(0.0f, 1.0f);
+	const AABB_t bounds = nodes[0].box;
+	const F32 offset = 1e-4f * length(bounds.max - bounds.min);
+
+	std::vector<double> areaCdf;
+	if (set == RaySet_Surface)
+	{
+		areaCdf.resize(tris.size());
+		double sum = 0.0;
+		for (size_t i = 0; i < tris.size(); i++)
+			areaCdf[i] = (sum += tris.area(i));
+	}
+
+	std::vector<TestRay> testRays(count);
+	for (TestRay &ray : testRays)
+	{
+		const F32 z = 1.0f - 2.0f * uniform(rng);
+		const F32 r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		const F32 phi = M_2PI_F * uniform(rng);
+		ray.dir = float3(r * std::cos(phi), r * std::sin(phi), z);
+
+		if (set == RaySet_Surface)
+		{
+			double a = uniform(rng) * areaCdf.back();
+			size_t ti = std::min(tris.size() - 1, (size_t)(std::upper_bound(areaCdf.begin(), areaCdf.end(), a) - areaCdf.begin()));
+			const F32 su = std::sqrt(uniform(rng));
+			const F32 b0 = 1.0f - su;
+			const F32 b1 = uniform(rng) * su;
+			ray.orig = tris.position(ti, 0) * b0 + tris.position(ti, 1) * b1 + tris.position(ti, 2) * (1.0f - b0 - b1) + ray.dir * offset;
+		}
+		else
+		{
+			ray.orig = bounds.min + (bounds.max - bounds.min) * float3(uniform(rng), uniform(rng), uniform(rng));
+		}
+	}
+
+	auto time1 = std::chrono::high_resolution_clock::now();
+	const U32 numChunks = (count + TraceChunkSize - 1) / TraceChunkSize;
+	std::vector<TraceCounts> chunkCounts(numChunks);
+	ThreadPool::getInstance().parallelFor(numChunks, [&](U32 c)
+	{
+		const U32 end = std::min(count, (c + 1) * TraceChunkSize);
+		for (U32 i = c * TraceChunkSize; i < end; i++)
+		{
+			if (intersect(testRays[i], chunkCounts[c]))
+				chunkCounts[c].hits++;
+		}
+	});
+	auto time2 = std::chrono::high_resolution_clock::now();
+	traceMs = std::chrono::duration<double, std::milli>(time2 - time1).count();
+
+	for (const TraceCounts &c : chunkCounts)
+	{
+		counts.nodeVisits += c.nodeVisits;
+		counts.boxTests += c.boxTests;
+		counts.triTests += c.triTests;
+		counts.hits += c.hits;
+	}
+}
+
+void BVHStats::print(std::ostream &out) const
+{
+	const U32 inner = (U32)nodes.size() - leaves;
+	const F32 MiB = 1.0f / (1024.0f * 1024.0f);
+	const U32 unique = (U32)tris.size() - unreferenced;
+
+	out << std::fixed << std::setprecision(2)
+		<< "======================" << std::endl
+		<< "Triangles: " << tris.size() << std::endl
+		<< "Nodes: " << nodes.size() << " (" << inner << " inner, " << leaves << " leaves)" << std::endl
+		<< "SAH cost: " << sahCost << std::endl;
+
+	if (epo >= 0.0f)
+		out << "EPO: " << epo << " (" << epoMs << " ms)" << std::endl;
+
+	out << "References: " << references << ", duplicates " << references - unique
+		<< " (" << (unique > 0 ? 100.0 * (references - unique) / unique : 0.0) << "%)" << std::endl;
+	if (unreferenced > 0)
+		out << "WARN: " << unreferenced << " triangles not referenced by any leaf" << std::endl;
+
+	out << "Leaf depth: avg " << avgLeafDepth << ", max " << maxDepth << std::endl
+		<< "Memory: nodes " << nodeBytes * MiB << " MiB, leaf triangles " << leafBytes * MiB
+		<< " MiB, triangles " << triangleBytes * MiB << " MiB" << std::endl;
+	if (peakBuildMiB > 0.0f)
+		out << "Peak build memory: " << peakBuildMiB << " MiB" << std::endl;
+
+	out << "Leaf sizes:" << std::endl;
+	for (U32 s = 1; s < leafSizes.size(); s++)
+	{
+		if (leafSizes[s] > 0)
+			out << "  " << std::setw(3) << s << ": " << std::setw(8) << leafSizes[s] << " (" << 100.0 * leafSizes[s] / leaves << "%)" << std::endl;
+	}
+
+	out << "Leaf depths:" << std::endl;
+	for (U32 d = 0; d < leafDepths.size(); d++)
+	{
+		if (leafDepths[d] > 0)
+			out << "  " << std::setw(3) << d << ": " << std::setw(8) << leafDepths[d] << " (" << 100.0 * leafDepths[d] / leaves << "%)" << std::endl;
+	}
+
+	if (rays > 0)
+	{
+		out << "Rays: " << rays << " " << raySetName(raySet) << ", " << 100.0 * counts.hits / rays << "% hit" << std::endl
+			<< "  Node visits per ray: " << (double)counts.nodeVisits / rays << std::endl
+			<< "  Box tests per ray: " << (double)counts.boxTests / rays << std::endl
+			<< "  Triangle tests per ray: " << (double)counts.triTests / rays << std::endl
+			<< "  CPU traversal: " << rays / (traceMs * 1000.0) << " Mrays/s" << std::endl;
+	}
+
+	out << "======================" << std::endl;
+	out.unsetf(std::ios::fixed);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <iostream>
+#include "bvh.hpp"
+
+// Rays traced by BVHStats::traceRays
+enum RaySet
+{
+	RaySet_Uniform, // origins uniform in scene bounds, uniform directions
+	RaySet_Surface  // origins on triangles (area weighted), uniform directions, like path tracing bounces
+};
+
+inline std::string raySetName(RaySet set) {
+	return (set == RaySet_Surface) ? "surface" : "uniform";
+}
+
+/*
+	Quality metrics of a finished single-level hierarchy, used by fluctus_bvhstat (bvhstat.cpp).
+	EPO: effective primitive overlap, "On Quality Metrics of Bounding Volume Hierarchies" by Aila et al. 13.
+	Node costs of SAH and EPO are the ones used by the builders.
+	Traversal counts come from a CPU port of the stack traversal in bvh.cl.
+*/
+class BVHStats
+{
+public:
+	BVHStats(const BVH &bvh);
+
+	void computeEPO(void);
+	void traceRays(RaySet set, U32 count, U32 seed);
+	void print(std::ostream &out) const;
+
+private:
+	struct TestRay
+	{
+		float3 orig;
+		float3 dir;
+	};
+
+	// Per-task counters of traceRays
+	struct TraceCounts
+	{
+		U64 nodeVisits = 0;
+		U64 boxTests = 0;
+		U64 triTests = 0;
+		U64 hits = 0;
+	};
+
+	void computeStructure(void);
+	F32 overlapArea(U32 ni, const std::vector<U32> &enter, const std::vector<U32> &exit,
+		const std::vector<U32> &leafOffsets, const std::vector<U32> &triLeaves, std::vector<U32> &candidates) const;
+	bool intersect(const TestRay &ray, TraceCounts &counts) const;
+
+	const BVH &bvh;
+	const std::vector<Node> &nodes;
+	const std::vector<U32> &indices;
+	const TriangleMesh &tris;
+
+	// Structure
+	F32 sahCost = 0.0f;
+	U32 leaves = 0;
+	U32 references = 0;
+	U32 unreferenced = 0;        // triangles in no leaf
+	U32 maxDepth = 0;
+	double avgLeafDepth = 0.0;
+	std::vector<U32> leafSizes;  // leaf count per triangle count
+	std::vector<U32> leafDepths; // leaf count per depth
+	size_t nodeBytes = 0;
+	size_t leafBytes = 0;  // LeafTriangle per index list entry, see CLContext
+	size_t triangleBytes = 0;
+	F32 peakBuildMiB = 0.0f;
+
+	// EPO, negative if not computed
+	F32 epo = -1.0f;
+	double epoMs = 0.0;
+
+	// Traversal
+	RaySet raySet = RaySet_Uniform;
+	U32 rays = 0;
+	TraceCounts counts;
+	double traceMs = 0.0;
+};
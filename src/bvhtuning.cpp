@@ -0,0 +1,158 @@
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include "bvhtuning.hpp"
+#include "settings.hpp"
+
+using json = nlohmann::json;
+
+static const std::string tuningFile = "data/kernel_binaries/bvh_tuning.json"; // with the kernel binary cache
+
+BVHTuning BVHTuning::fromSettings()
+{
+    Settings &s = Settings::getInstance();
+
+    BVHTuning t;
+    t.costBox = s.getBvhCostBox();
+    t.costTri = s.getBvhCostTri();
+    t.maxLeafElems = s.getBvhMaxLeafElems();
+    t.splitAlpha = s.getBvhSplitAlpha();
+    t.spatialBins = s.getBvhSpatialBins();
+    return t;
+}
+
+void BVHTuning::apply() const
+{
+    Settings &s = Settings::getInstance();
+    s.setBvhCostBox(costBox);
+    s.setBvhCostTri(costTri);
+    s.setBvhMaxLeafElems(maxLeafElems);
+    s.setBvhSplitAlpha(splitAlpha);
+    s.setBvhSpatialBins(spatialBins);
+}
+
+std::string BVHTuning::describe() const
+{
+    std::stringstream ss;
+    ss << "costBox " << costBox << ", costTri " << costTri << ", leaf " << maxLeafElems
+       << ", alpha " << splitAlpha << ", bins " << spatialBins;
+    return ss.str();
+}
+
+bool hasTuningParameters(SplitMode mode, U32 optimizePasses)
+{
+    return mode != SplitMode_LBVH || optimizePasses > 0;
+}
+
+std::vector<BVHTuning> tuningCandidates(const BVHTuning &base, SplitMode mode, U32 optimizePasses)
+{
+    std::vector<BVHTuning> candidates(1, base);
+    auto add = [&](BVHTuning t) { candidates.push_back(t); };
+    BVHTuning t = base;
+
+    const HierarchyBuilder builder = builderForSplitMode(mode);
+
+    // Leaf size, LBVH leaves are fixed
+    if (builder != HierarchyBuilder_LBVH)
+    {
+        t.maxLeafElems = std::max(1u, base.maxLeafElems / 2);
+        if (t.maxLeafElems != base.maxLeafElems) add(t);
+        t.maxLeafElems = std::min(255u, base.maxLeafElems * 2);
+        if (t.maxLeafElems != base.maxLeafElems) add(t);
+    }
+
+    // Relative cost of box and triangle tests, used by median splits and LBVH only in treelet passes
+    if (mode == SplitMode_Sah || mode == SplitMode_SahBinned || optimizePasses > 0)
+    {
+        t = base;
+        t.costTri = base.costTri * 2.0f;
+        add(t);
+        t = base;
+        t.costBox = base.costBox * 2.0f;
+        add(t);
+    }
+
+    // Spatial splits of the SBVH builder
+    if (builder == HierarchyBuilder_SBVH)
+    {
+        // Fewer spatial splits, coarser binning
+        t = base;
+        t.splitAlpha = base.splitAlpha * 10.0f;
+        t.spatialBins = std::max(2u, base.spatialBins / 2);
+        add(t);
+
+        // More spatial splits
+        t = base;
+        t.splitAlpha = base.splitAlpha * 0.1f;
+        add(t);
+    }
+
+    return candidates;
+}
+
+static json readTuningFile()
+{
+    std::ifstream in(tuningFile);
+    if (!in.good())
+        return json::object();
+
+    try
+    {
+        json j;
+        in >> j;
+        return j.is_object() ? j : json::object();
+    }
+    catch (std::exception &e)
+    {
+        std::cout << "Ignoring invalid tuning file " << tuningFile << ": " << e.what() << std::endl;
+        return json::object();
+    }
+}
+
+// Parameters tuned for one builder don't carry over to another
+static std::string tuningKey(const std::string &deviceName, SplitMode mode, U32 optimizePasses)
+{
+    std::stringstream ss;
+    ss << deviceName << " / " << splitModeName(mode) << " / treelet passes " << optimizePasses;
+    return ss.str();
+}
+
+bool loadTuning(const std::string &deviceName, SplitMode mode, U32 optimizePasses, BVHTuning &tuning)
+{
+    const std::string key = tuningKey(deviceName, mode, optimizePasses);
+    json j = readTuningFile();
+    if (j.find(key) == j.end())
+        return false;
+
+    json entry = j[key];
+    tuning.costBox = entry.value("costBox", tuning.costBox);
+    tuning.costTri = entry.value("costTri", tuning.costTri);
+    tuning.maxLeafElems = entry.value("maxLeafElems", tuning.maxLeafElems);
+    tuning.splitAlpha = entry.value("splitAlpha", tuning.splitAlpha);
+    tuning.spatialBins = entry.value("spatialBins", tuning.spatialBins);
+    tuning.traceMs = entry.value("traceMs", tuning.traceMs);
+    return true;
+}
+
+// Entries of other devices and builders are kept
+void saveTuning(const std::string &deviceName, SplitMode mode, U32 optimizePasses, const BVHTuning &tuning)
+{
+    json j = readTuningFile();
+    j[tuningKey(deviceName, mode, optimizePasses)] = {
+        { "costBox", tuning.costBox },
+        { "costTri", tuning.costTri },
+        { "maxLeafElems", tuning.maxLeafElems },
+        { "splitAlpha", tuning.splitAlpha },
+        { "spatialBins", tuning.spatialBins },
+        { "traceMs", tuning.traceMs }
+    };
+
+    std::ofstream out(tuningFile);
+    if (!out.good())
+    {
+        std::cout << "Could not write " << tuningFile << std::endl;
+        return;
+    }
+    out << j.dump(4) << std::endl;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "hierarchycache.hpp"
+
+// Hierarchy build parameters selected per OpenCL device by Tracer::autotuneHierarchy.
+// Stored next to the kernel binary cache, keyed by device name, split mode and treelet passes.
+struct BVHTuning
+{
+    float costBox = 1.0f;
+    float costTri = 1.0f;
+    unsigned int maxLeafElems = 8;
+    float splitAlpha = 1e-5f;
+    unsigned int spatialBins = 128;
+    float traceMs = 0.0f; // extension + shadow kernel time of the tuning ray batch
+
+    static BVHTuning fromSettings();
+    void apply() const; // overrides settings
+    std::string describe() const;
+};
+
+// False if the builder reads none of the tuned parameters (LBVH without treelet passes)
+bool hasTuningParameters(SplitMode mode, U32 optimizePasses);
+
+// Variants built by the autotuner, the first one is 'base'.
+// Only parameters read by the builder are varied, see HierarchyBuildInfo.
+std::vector<BVHTuning> tuningCandidates(const BVHTuning &base, SplitMode mode, U32 optimizePasses);
+
+bool loadTuning(const std::string &deviceName, SplitMode mode, U32 optimizePasses, BVHTuning &tuning);
+void saveTuning(const std::string &deviceName, SplitMode mode, U32 optimizePasses, const BVHTuning &tuning);
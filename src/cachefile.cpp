@@ -0,0 +1,138 @@
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include "cachefile.hpp"
+#include "xxhash/xxhash.h"
+
+static const char cacheMagic[8] = "FLUCTUS";
+
+inline U64 alignCache(U64 offset)
+{
+    return (offset + CacheAlignment - 1) & ~(U64)(CacheAlignment - 1);
+}
+
+void CacheWriter::add(U32 id, const void *data, size_t elemBytes, size_t count)
+{
+    CacheSection sec = {};
+    sec.id = id;
+    sec.elemBytes = (U32)elemBytes;
+    sec.count = count;
+    sections.push_back(sec);
+    payloads.push_back(data);
+}
+
+bool CacheWriter::write(const std::string &filename) const
+{
+    std::vector<CacheSection> table = sections;
+    U64 offset = alignCache(sizeof(CacheHeader) + table.size() * sizeof(CacheSection));
+    for (CacheSection &sec : table)
+    {
+        sec.offset = offset;
+        offset = alignCache(offset + sec.count * sec.elemBytes);
+    }
+
+    CacheHeader header = {};
+    std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = CacheFormatVersion;
+    header.kind = kind;
+    header.numSections = (U32)table.size();
+    header.fileBytes = offset;
+
+    // Checksum covers the table, payloads and zero padding in file order
+    static const char zeros[CacheAlignment] = {};
+    XXH64_state_t *state = XXH64_createState();
+    XXH64_reset(state, 0);
+    U64 pos = sizeof(CacheHeader);
+    auto hash = [&](const void *data, size_t len) { XXH64_update(state, data, len); pos += len; };
+    hash(table.data(), table.size() * sizeof(CacheSection));
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        hash(zeros, (size_t)(table[i].offset - pos));
+        hash(payloads[i], (size_t)(table[i].count * table[i].elemBytes));
+    }
+    hash(zeros, (size_t)(header.fileBytes - pos));
+    header.checksum = XXH64_digest(state);
+    XXH64_freeState(state);
+
+    std::string tmpName = filename + ".tmp";
+    {
+        std::ofstream out(tmpName, std::ios::binary | std::ios::trunc);
+        if (!out.good())
+            return false;
+
+        pos = 0;
+        auto put = [&](const void *data, size_t len) { out.write((const char*)data, len); pos += len; };
+        put(&header, sizeof(header));
+        put(table.data(), table.size() * sizeof(CacheSection));
+        for (size_t i = 0; i < table.size(); i++)
+        {
+            put(zeros, (size_t)(table[i].offset - pos));
+            put(payloads[i], (size_t)(table[i].count * table[i].elemBytes));
+        }
+        put(zeros, (size_t)(header.fileBytes - pos));
+
+        if (!out.good())
+        {
+            out.close();
+            std::remove(tmpName.c_str());
+            return false;
+        }
+    }
+
+    std::remove(filename.c_str()); // rename doesn't overwrite on Windows
+    return std::rename(tmpName.c_str(), filename.c_str()) == 0;
+}
+
+bool CacheReader::open(const std::string &filename, CacheKind kind)
+{
+    sections = nullptr;
+    numSections = 0;
+    if (!file.open(filename) || file.size() < sizeof(CacheHeader))
+        return false;
+
+    const CacheHeader *header = (const CacheHeader*)file.data();
+    if (std::memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) != 0 || header->version != CacheFormatVersion ||
+        header->kind != (U32)kind || header->fileBytes != file.size())
+    {
+        file.close();
+        return false;
+    }
+
+    U64 tableEnd = sizeof(CacheHeader) + (U64)header->numSections * sizeof(CacheSection);
+    const unsigned char *payload = file.data() + sizeof(CacheHeader);
+    if (tableEnd > file.size() || XXH64(payload, file.size() - sizeof(CacheHeader), 0) != header->checksum)
+    {
+        file.close();
+        return false;
+    }
+
+    sections = (const CacheSection*)payload;
+    numSections = header->numSections;
+    for (U32 i = 0; i < numSections; i++)
+    {
+        if (sections[i].offset + sections[i].count * sections[i].elemBytes > file.size())
+        {
+            file.close();
+            sections = nullptr;
+            numSections = 0;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const void *CacheReader::section(U32 id, size_t elemBytes, size_t &count) const
+{
+    for (U32 i = 0; i < numSections; i++)
+    {
+        if (sections[i].id == id && sections[i].elemBytes == elemBytes)
+        {
+            count = (size_t)sections[i].count;
+            return file.data() + sections[i].offset;
+        }
+    }
+
+    count = 0;
+    return nullptr;
+}
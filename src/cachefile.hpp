@@ -0,0 +1,128 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "mappedfile.hpp"
+#include "rtutil.hpp"
+
+/*
+    Binary cache container used for hierarchies and scene packages.
+    Layout: 64-byte header, section table, then sections aligned to 64 bytes.
+    Sections hold arrays in their in-memory layout, so a mapped file can be copied
+    or uploaded in bulk without per-element parsing.
+    Files with another version, element size or payload checksum (XXH64) are rejected.
+*/
+
+enum CacheKind
+{
+    CacheKind_Hierarchy = 1,
+    CacheKind_Scene = 2
+};
+
+// Section ids, unique across kinds so that a scene package can embed a hierarchy
+enum CacheSectionId
+{
+    CacheSection_Indices = 1,       // BVH index list
+    CacheSection_Nodes = 2,         // BVH nodes
+    CacheSection_BuildInfo = 3,     // HierarchyBuildInfo of the BVH
+    CacheSection_Triangles = 16,    // scene geometry, IndexedTriangle
+    CacheSection_Meshes = 17,
+    CacheSection_Materials = 18,
+    CacheSection_TexDescriptors = 19,
+    CacheSection_TexData = 20,      // RGBA8 pixels of all textures, see TexDescriptor::offset
+    CacheSection_Vertices = 21,     // shared vertices of the scene triangles
+    CacheSection_SourcePaths = 22,  // material libraries and textures of the scene, '\0'-terminated
+    CacheSection_SourceHashes = 23  // content hash per source path, 0 if it could not be read
+};
+
+enum
+{
+    CacheFormatVersion = 2, // bump when a cached struct changes layout
+    CacheAlignment = 64
+};
+
+struct CacheHeader
+{
+    char magic[8];      // "FLUCTUS"
+    U32 version;
+    U32 kind;           // CacheKind
+    U32 numSections;
+    U32 reserved;
+    U64 fileBytes;
+    U64 checksum;       // of everything after the header
+    U8 pad[24];
+};
+
+struct CacheSection
+{
+    U32 id;
+    U32 elemBytes;      // sizeof of the stored struct
+    U64 count;
+    U64 offset;         // from start of file, multiple of CacheAlignment
+    U64 reserved;
+};
+
+static_assert(sizeof(CacheHeader) == CacheAlignment, "Cache header must fill one alignment unit");
+static_assert(sizeof(CacheSection) == 32, "Cache section table entries must stay packed");
+
+class CacheWriter
+{
+public:
+    CacheWriter(CacheKind kind) : kind(kind) {}
+
+    // Data must stay valid until write()
+    void add(U32 id, const void *data, size_t elemBytes, size_t count);
+
+    template<class T>
+    void add(U32 id, const std::vector<T> &vec) { add(id, vec.data(), sizeof(T), vec.size()); }
+
+    // Kept alive by the writer, for arrays packed only for writing
+    template<class T>
+    void add(U32 id, std::vector<T> &&vec)
+    {
+        auto data = std::make_shared<std::vector<T>>(std::move(vec));
+        owned.push_back(data);
+        add(id, data->data(), sizeof(T), data->size());
+    }
+
+    // Written to a temporary file first, so readers never see a partial file
+    bool write(const std::string &filename) const;
+
+private:
+    CacheKind kind;
+    std::vector<CacheSection> sections;
+    std::vector<const void*> payloads;
+    std::vector<std::shared_ptr<void>> owned;
+};
+
+class CacheReader
+{
+public:
+    // False if missing, of another kind or version, truncated or corrupt
+    bool open(const std::string &filename, CacheKind kind);
+
+    // Null if the section is missing or was written with another element size
+    const void *section(U32 id, size_t elemBytes, size_t &count) const;
+
+    template<class T>
+    const T *section(U32 id, size_t &count) const { return (const T*)section(id, sizeof(T), count); }
+
+    template<class T>
+    bool read(U32 id, std::vector<T> &vec) const
+    {
+        size_t count;
+        const T *data = section<T>(id, count);
+        if (!data)
+            return false;
+        vec.assign(data, data + count);
+        return true;
+    }
+
+    size_t bytes() const { return file.size(); }
+
+private:
+    MappedFile file;
+    const CacheSection *sections = nullptr;
+    U32 numSections = 0;
+};
@@ -5,15 +5,19 @@
 #include "bvhnode.hpp"
 #include "settings.hpp"
 #include "bvh.hpp"
+#include "widebvh.hpp"
 #include "scene.hpp"
 #include "texture.hpp"
 #include "window.hpp"
 #include "kernel_impl.hpp"
+#include "threadpool.hpp"
 #include "IL/ilu.h"
 #include <glad/glad.h>
 #include <GLFW/glfw3.h> // texture conversion stuff
 #include <string>
 #include <vector>
+#include <cstring>
+#include <cmath>
 
 CLContext::CLContext()
 {
@@ -146,6 +150,9 @@ void CLContext::setKernelBuildSettings()
     Settings &s = Settings::getInstance();
     if (s.getUseBitstack()) buildOpts += " -DUSE_BITSTACK";
     if (s.getUseSoA()) buildOpts += " -DUSE_SOA";
+    if (s.getBvhWidth() > 2) buildOpts += " -DBVH_WIDTH=" + std::to_string(s.getBvhWidth());
+    if (s.getBvhQuantized()) buildOpts += " -DBVH_QUANTIZED";
+    if (s.getBvhInstancing()) buildOpts += " -DUSE_INSTANCING";
     if (platformIsNvidia(platform)) buildOpts += " -DNVIDIA -cl-nv-verbose";
 
     // Static, shared by all kernels
@@ -518,25 +525,196 @@ void CLContext::setupScene()
     verify("Dummy env map creation failed");
 }
 
+// Convert binary nodes to wide layout, returns pointer to node data
+template<typename WideNode>
+static const void *collapseNodes(const std::vector<Node> &nodes, std::vector<WideNode> &wide, size_t &bytes)
+{
+    U32 stack = WideBVH<WideNode>(nodes, wide).getMaxStack();
+    if (stack > WIDE_STACK_SIZE)
+        std::cout << "WARN: Wide BVH might not fit traversal stack! (" << stack << " > " << WIDE_STACK_SIZE << ")" << std::endl;
+
+    bytes = wide.size() * sizeof(WideNode);
+    return wide.data();
+}
+
+// Traversal nodes in the format of the kernels
+struct PackedNodes
+{
+    std::vector<GPUNode4> nodes4;
+    std::vector<GPUNode8> nodes8;
+    std::vector<GPUQNode4> qnodes4;
+    std::vector<GPUQNode8> qnodes8;
+    const void *data;
+    size_t bytes;
+};
+
+// Node layout must match BVH_WIDTH and BVH_QUANTIZED of the kernels
+static void packNodes(const std::vector<Node> &nodes, PackedNodes &packed)
+{
+    Settings &s = Settings::getInstance();
+    packed.data = nodes.data();
+    packed.bytes = nodes.size() * sizeof(Node);
+    if (s.getBvhWidth() == 4 && s.getBvhQuantized())
+        packed.data = collapseNodes(nodes, packed.qnodes4, packed.bytes);
+    else if (s.getBvhWidth() == 4)
+        packed.data = collapseNodes(nodes, packed.nodes4, packed.bytes);
+    else if (s.getBvhWidth() == 8 && s.getBvhQuantized())
+        packed.data = collapseNodes(nodes, packed.qnodes8, packed.bytes);
+    else if (s.getBvhWidth() == 8)
+        packed.data = collapseNodes(nodes, packed.nodes8, packed.bytes);
+}
+
+// Vertex and edges of each index list entry, so that traversal reads one contiguous array.
+// The first instanceEntries entries (top level of two-level hierarchies) index instances, only their index is stored.
+static void packLeafTriangles(const TriangleMesh &mesh, const std::vector<cl_uint> &indices, cl_uint instanceEntries, std::vector<LeafTriangle> &packed)
+{
+    const size_t count = indices.size();
+    const size_t batch = 1 << 16;
+
+    packed.resize(count);
+    ThreadPool::getInstance().parallelFor((unsigned int)((count + batch - 1) / batch), [&](unsigned int b)
+    {
+        for (size_t i = b * batch; i < std::min(count, (b + 1) * batch); i++)
+        {
+            LeafTriangle &leaf = packed[i];
+            leaf = LeafTriangle();
+            leaf.tri = indices[i];
+            if (i < instanceEntries)
+                continue;
+
+            const float3 &p0 = mesh.position(leaf.tri, 0);
+            const float3 e1 = mesh.position(leaf.tri, 1) - p0;
+            const float3 e2 = mesh.position(leaf.tri, 2) - p0;
+            const float3 *src[3] = { &p0, &e1, &e2 };
+            cl_float *dst[3] = { leaf.v0, leaf.e1, leaf.e2 };
+            for (int k = 0; k < 3; k++)
+            {
+                dst[k][0] = src[k]->x;
+                dst[k][1] = src[k]->y;
+                dst[k][2] = src[k]->z;
+            }
+        }
+    });
+}
+
+// Octahedral mapping, two snorm16. Zero normals are kept as OCT_NORMAL_NONE, which
+// no normal encodes to since components are clamped to [-32767, 32767].
+static cl_uint encodeNormal(const float3 &n)
+{
+    const float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+    if (!(l1 > 0.0f))
+        return OCT_NORMAL_NONE;
+
+    float x = n.x / l1, y = n.y / l1;
+    if (n.z < 0.0f)
+    {
+        const float ox = x;
+        x = (1.0f - std::fabs(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+        y = (1.0f - std::fabs(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+    }
+
+    auto snorm16 = [](float f) { return (cl_uint)(uint16_t)(int16_t)std::lround(std::max(-1.0f, std::min(1.0f, f)) * 32767.0f); };
+    return snorm16(x) | (snorm16(y) << 16);
+}
+
+// IEEE half, round to nearest even (see F. Giesen, "float->half variants")
+static uint16_t encodeHalf(float value)
+{
+    const U32 f32infty = 255u << 23;
+    const U32 f16max = (127u + 16u) << 23;
+    const U32 denormMagic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+    U32 f;
+    std::memcpy(&f, &value, sizeof(f));
+    const U32 sign = f & 0x80000000u;
+    f ^= sign;
+
+    uint16_t h;
+    if (f >= f16max)
+    {
+        h = (f > f32infty) ? 0x7E00 : 0x7C00; // NaN or Inf
+    }
+    else if (f < (113u << 23))
+    {
+        // Subnormal: let the FPU align and round the mantissa
+        float v, magic;
+        std::memcpy(&v, &f, sizeof(v));
+        std::memcpy(&magic, &denormMagic, sizeof(magic));
+        v += magic;
+        std::memcpy(&f, &v, sizeof(f));
+        h = (uint16_t)(f - denormMagic);
+    }
+    else
+    {
+        const U32 mantOdd = (f >> 13) & 1;
+        f += ((U32)(15 - 127) << 23) + 0xFFF;
+        f += mantOdd;
+        h = (uint16_t)(f >> 13);
+    }
+
+    return h | (uint16_t)(sign >> 16);
+}
+
+// Shading attributes in the compact GPU layout, see PackedVertex
+static void packVertices(const std::vector<VertexPNT> &vertices, std::vector<PackedVertex> &packed)
+{
+    const size_t count = vertices.size();
+    const size_t batch = 1 << 16;
+
+    packed.resize(count);
+    ThreadPool::getInstance().parallelFor((unsigned int)((count + batch - 1) / batch), [&](unsigned int b)
+    {
+        for (size_t i = b * batch; i < std::min(count, (b + 1) * batch); i++)
+        {
+            const VertexPNT &v = vertices[i];
+            PackedVertex &pv = packed[i];
+            pv.p[0] = v.p.x;
+            pv.p[1] = v.p.y;
+            pv.p[2] = v.p.z;
+            pv.n = encodeNormal(v.n);
+            pv.t = (cl_uint)encodeHalf(v.t.x) | ((cl_uint)encodeHalf(v.t.y) << 16);
+        }
+    });
+}
+
 // Upload BVH data, geometry and materials to GPU
 void CLContext::uploadSceneData(BVH *bvh, Scene *scene)
 {
-    std::vector<RTTriangle> *tris = bvh->m_triangles;
-    std::vector<cl_uint> *indices = &bvh->m_indices; 
-    std::vector<Node> *nodes = &bvh->m_nodes;
+    TriangleMesh *tris = bvh->m_triangles;
     std::vector<Material> *materials = &scene->getMaterials();
 
-    size_t t_bytes = tris->size() * sizeof(RTTriangle);
-    size_t i_bytes = indices->size() * sizeof(cl_uint);
-    size_t n_bytes = nodes->size() * sizeof(Node);
+    PackedNodes packed;
+    packNodes(bvh->m_nodes, packed);
+    const void *nodeData = packed.data;
+    size_t n_bytes = packed.bytes;
+
+    std::vector<LeafTriangle> leafTris;
+    packLeafTriangles(*bvh->m_triangles, bvh->m_indices, bvh->m_instanceEntries, leafTris);
+
+    std::vector<PackedVertex> vertices;
+    packVertices(tris->vertices, vertices);
+
+    Settings &s = Settings::getInstance();
+    const size_t binaryBytes = bvh->m_nodes.size() * sizeof(Node);
+    printf("BVH nodes: %.2f MiB (%u-wide%s), binary format: %.2f MiB (%.2fx)\n", n_bytes / (1024.0 * 1024.0), s.getBvhWidth(),
+        s.getBvhQuantized() ? ", quantized" : "", binaryBytes / (1024.0 * 1024.0), (double)binaryBytes / n_bytes);
+
+    size_t t_bytes = tris->triangles.size() * sizeof(IndexedTriangle);
+    size_t v_bytes = vertices.size() * sizeof(PackedVertex);
+    size_t l_bytes = leafTris.size() * sizeof(LeafTriangle);
+    printf("Geometry: %.2f MiB (%zu vertices, %zu triangles), unindexed: %.2f MiB, leaf triangles: %.2f MiB\n", (t_bytes + v_bytes) / (1024.0 * 1024.0),
+        tris->vertices.size(), tris->size(), tris->size() * sizeof(RTTriangle) / (1024.0 * 1024.0), l_bytes / (1024.0 * 1024.0));
     size_t m_bytes = materials->size() * sizeof(Material);
 
     // Allocate memory for buffers
     deviceBuffers.triangleBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, t_bytes, NULL, &err);
     verify("Triangle buffer creation failed!");
 
-    deviceBuffers.indexBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, i_bytes, NULL, &err);
-    verify("Index buffer creation failed!");
+    deviceBuffers.vertexBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, v_bytes, NULL, &err);
+    verify("Vertex buffer creation failed!");
+
+    deviceBuffers.leafTriangleBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, l_bytes, NULL, &err);
+    verify("Leaf triangle buffer creation failed!");
 
     deviceBuffers.nodeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, n_bytes, NULL, &err);
     verify("Node buffer creation failed!");
@@ -544,15 +722,25 @@ void CLContext::uploadSceneData(BVH *bvh, Scene *scene)
     if(m_bytes > 0) deviceBuffers.materialBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, m_bytes, NULL, &err);
     verify("Material buffer creation failed!");
 
+    // Single-level hierarchies get a dummy element
+    GPUInstance dummyInstance = {};
+    const void *instanceData = bvh->m_instances.empty() ? &dummyInstance : (const void*)bvh->m_instances.data();
+    size_t in_bytes = std::max((size_t)1, bvh->m_instances.size()) * sizeof(GPUInstance);
+    deviceBuffers.instanceBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, in_bytes, (void*)instanceData, &err);
+    verify("Instance buffer creation failed!");
+
 
     // Write data to buffers
-    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.triangleBuffer, CL_TRUE, 0, t_bytes, tris->data());
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.triangleBuffer, CL_TRUE, 0, t_bytes, tris->triangles.data());
     verify("Triangle buffer writing failed!");
 
-    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.indexBuffer, CL_TRUE, 0, i_bytes, indices->data());
-    verify("Index buffer writing failed!");
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.vertexBuffer, CL_TRUE, 0, v_bytes, vertices.data());
+    verify("Vertex buffer writing failed!");
+
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.leafTriangleBuffer, CL_TRUE, 0, l_bytes, leafTris.data());
+    verify("Leaf triangle buffer writing failed!");
 
-    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.nodeBuffer, CL_TRUE, 0, n_bytes, nodes->data());
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.nodeBuffer, CL_TRUE, 0, n_bytes, nodeData);
     verify("Node buffer writing failed!");
 
     if(m_bytes > 0) err = cmdQueue.enqueueWriteBuffer(deviceBuffers.materialBuffer, CL_TRUE, 0, m_bytes, materials->data());
@@ -565,6 +753,56 @@ void CLContext::uploadSceneData(BVH *bvh, Scene *scene)
     setupKernels();
 }
 
+// Re-upload vertices, leaf triangles and nodes after BVH::refit.
+// Topology is unchanged => existing buffers and kernel arguments are reused.
+void CLContext::uploadRefitData(BVH *bvh)
+{
+    PackedNodes packed;
+    packNodes(bvh->m_nodes, packed);
+
+    std::vector<LeafTriangle> leafTris;
+    packLeafTriangles(*bvh->m_triangles, bvh->m_indices, bvh->m_instanceEntries, leafTris);
+
+    std::vector<PackedVertex> vertices;
+    packVertices(bvh->m_triangles->vertices, vertices);
+    size_t v_bytes = vertices.size() * sizeof(PackedVertex);
+
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.vertexBuffer, CL_TRUE, 0, v_bytes, vertices.data());
+    verify("Vertex buffer writing failed!");
+
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.leafTriangleBuffer, CL_TRUE, 0, leafTris.size() * sizeof(LeafTriangle), leafTris.data());
+    verify("Leaf triangle buffer writing failed!");
+
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.nodeBuffer, CL_TRUE, 0, packed.bytes, packed.data);
+    verify("Node buffer writing failed!");
+}
+
+// Replace hierarchy of the same triangles, e.g. when comparing build parameters
+void CLContext::uploadHierarchy(BVH *bvh)
+{
+    PackedNodes packed;
+    packNodes(bvh->m_nodes, packed);
+
+    std::vector<LeafTriangle> leafTris;
+    packLeafTriangles(*bvh->m_triangles, bvh->m_indices, bvh->m_instanceEntries, leafTris);
+    size_t l_bytes = leafTris.size() * sizeof(LeafTriangle);
+
+    deviceBuffers.leafTriangleBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, l_bytes, NULL, &err);
+    verify("Leaf triangle buffer creation failed!");
+
+    deviceBuffers.nodeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, packed.bytes, NULL, &err);
+    verify("Node buffer creation failed!");
+
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.leafTriangleBuffer, CL_TRUE, 0, l_bytes, leafTris.data());
+    verify("Leaf triangle buffer writing failed!");
+
+    err = cmdQueue.enqueueWriteBuffer(deviceBuffers.nodeBuffer, CL_TRUE, 0, packed.bytes, packed.data);
+    verify("Node buffer writing failed!");
+
+    // New buffers => kernel arguments must be set again
+    setupKernels();
+}
+
 // Upload texture data to GPU
 // Avoids intermediate buffers to keep RAM usage low
 void CLContext::packTextures(Scene *scene)
@@ -700,6 +938,68 @@ void CLContext::checkTracingPerf()
     printf("Shadow ray time: %0.3f milliseconds, speed: %.2f MRays/s \n", timeMs, MRaysShadow);
 }
 
+// Snapshot of the state produced by the last material kernels: paths with pending extension and shadow rays
+void CLContext::saveRayBatch()
+{
+    const size_t t_bytes = NUM_TASKS * sizeof(GPUTaskState);
+    const size_t q_bytes = NUM_TASKS * sizeof(cl_uint);
+
+    deviceBuffers.batchTasks = cl::Buffer(context, CL_MEM_READ_WRITE, t_bytes, NULL, &err);
+    deviceBuffers.batchCounters = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(QueueCounters), NULL, &err);
+    deviceBuffers.batchExtensionQueue = cl::Buffer(context, CL_MEM_READ_WRITE, q_bytes, NULL, &err);
+    deviceBuffers.batchShadowQueue = cl::Buffer(context, CL_MEM_READ_WRITE, q_bytes, NULL, &err);
+    verify("Ray batch buffer creation failed!");
+
+    err = 0;
+    err |= cmdQueue.enqueueCopyBuffer(deviceBuffers.tasksBuffer, deviceBuffers.batchTasks, 0, 0, t_bytes);
+    err |= cmdQueue.enqueueCopyBuffer(deviceBuffers.queueCounters, deviceBuffers.batchCounters, 0, 0, sizeof(QueueCounters));
+    err |= cmdQueue.enqueueCopyBuffer(deviceBuffers.extensionQueue, deviceBuffers.batchExtensionQueue, 0, 0, q_bytes);
+    err |= cmdQueue.enqueueCopyBuffer(deviceBuffers.shadowQueue, deviceBuffers.batchShadowQueue, 0, 0, q_bytes);
+    verify("Ray batch saving failed!");
+    finishQueue();
+}
+
+// Trace the saved batch with the current hierarchy.
+// Uses the same kernels and events as rendering, so results include all traversal options.
+double CLContext::timeRayBatch(int repetitions)
+{
+    const size_t t_bytes = NUM_TASKS * sizeof(GPUTaskState);
+    const size_t q_bytes = NUM_TASKS * sizeof(cl_uint);
+    double best = -1.0;
+
+    for (int i = 0; i < repetitions; i++)
+    {
+        err = 0;
+        err |= cmdQueue.enqueueCopyBuffer(deviceBuffers.batchTasks, deviceBuffers.tasksBuffer, 0, 0, t_bytes);
+        err |= cmdQueue.enqueueCopyBuffer(deviceBuffers.batchCounters, deviceBuffers.queueCounters, 0, 0, sizeof(QueueCounters));
+        err |= cmdQueue.enqueueCopyBuffer(deviceBuffers.batchExtensionQueue, deviceBuffers.extensionQueue, 0, 0, q_bytes);
+        err |= cmdQueue.enqueueCopyBuffer(deviceBuffers.batchShadowQueue, deviceBuffers.shadowQueue, 0, 0, q_bytes);
+        verify("Ray batch restoring failed!");
+
+        err = cmdQueue.enqueueNDRangeKernel(*wf_extension, cl::NullRange, cl::NDRange(NUM_TASKS), cl::NullRange, 0, &extRayEvent);
+        verify("Failed to enqueue extension kernel!");
+        err = cmdQueue.enqueueNDRangeKernel(*wf_shadow, cl::NullRange, cl::NDRange(NUM_TASKS), cl::NullRange, 0, &shdwRayEvent);
+        verify("Failed to enqueue shadow kernel!");
+        finishQueue();
+
+        cl_ulong t0Ext, t1Ext, t0Shadow, t1Shadow;
+        clGetEventProfilingInfo(extRayEvent(), CL_PROFILING_COMMAND_START, sizeof(t0Ext), &t0Ext, NULL);
+        clGetEventProfilingInfo(extRayEvent(), CL_PROFILING_COMMAND_END, sizeof(t1Ext), &t1Ext, NULL);
+        clGetEventProfilingInfo(shdwRayEvent(), CL_PROFILING_COMMAND_START, sizeof(t0Shadow), &t0Shadow, NULL);
+        clGetEventProfilingInfo(shdwRayEvent(), CL_PROFILING_COMMAND_END, sizeof(t1Shadow), &t1Shadow, NULL);
+
+        double timeMs = ((t1Ext - t0Ext) + (t1Shadow - t0Shadow)) / 1000000.0;
+        best = (best < 0.0) ? timeMs : std::min(best, timeMs);
+    }
+
+    return best;
+}
+
+std::string CLContext::getDeviceName() const
+{
+    return device.getInfo<CL_DEVICE_NAME>();
+}
+
 void CLContext::updateParams(const RenderParams &params)
 {
     err = cmdQueue.enqueueWriteBuffer(deviceBuffers.renderParams, CL_FALSE, 0, sizeof(RenderParams), &params);
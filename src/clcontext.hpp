@@ -71,8 +71,15 @@ public:
 
     void checkTracingPerf();
 
+    // Fixed wavefront state for timing hierarchies, see Tracer::autotuneHierarchy
+    void saveRayBatch();
+    double timeRayBatch(int repetitions); // min extension + shadow kernel time (ms)
+    std::string getDeviceName() const;
+
     void updateParams(const RenderParams &params);
     void uploadSceneData(BVH *bvh, Scene *scene);
+    void uploadRefitData(BVH *bvh);
+    void uploadHierarchy(BVH *bvh); // nodes and indices only, triangles are unchanged
     void setupPixelStorage(PTWindow *window);
     void saveImage(std::string filename, const RenderParams &params);
     void createEnvMap(EnvironmentMap *map);
@@ -180,8 +187,10 @@ public:
 
         // Variables from BVH
         cl::Buffer triangleBuffer;
+        cl::Buffer vertexBuffer;
         cl::Buffer nodeBuffer;
-        cl::Buffer indexBuffer;
+        cl::Buffer instanceBuffer; // two-level hierarchies only
+        cl::Buffer leafTriangleBuffer; // index list order, replaces the index list in traversal
         cl::Buffer materialBuffer;
         cl::Buffer texDescriptorBuffer;
         cl::Buffer texDataBuffer;
@@ -195,6 +204,12 @@ public:
         // Statistics
         cl::Buffer renderStats;  // ray + sample counts
 
+        // Copies of wavefront state, restored before each timing run
+        cl::Buffer batchTasks;
+        cl::Buffer batchCounters;
+        cl::Buffer batchExtensionQueue;
+        cl::Buffer batchShadowQueue;
+
         // Pixel storage
         cl::Buffer pixelBuffer;     // raw (linear) pixel data, not used by OpenGL
         cl::Buffer denoiserAlbedoBuffer;
@@ -5,6 +5,7 @@ typedef float cl_float;
 typedef int cl_int;
 typedef unsigned int cl_uint;
 typedef char cl_uchar;
+typedef char cl_char;
 typedef bool cl_bool;
 #else
 #include "cl2.hpp"
@@ -72,11 +73,70 @@ typedef struct
     cl_int parent;
     union {
         cl_uint iStart;     // leaf node, index into index list
-        cl_uint rightChild; // internal node, index into node vector (left child always current + 1)
+        cl_uint rightChild; // internal node, index into node vector
     };
+    cl_uint leftChild;      // internal node, index into node vector
     cl_uchar nPrims;        // 0 for interior nodes
 } GPUNode;
 
+// Wide nodes used with BVH_WIDTH, see widebvh.hpp
+// Child bounds in SoA form, leaves are stored inline in their parent
+#define WIDE_STACK_SIZE 64
+typedef struct
+{
+    cl_float minx[4], miny[4], minz[4];
+    cl_float maxx[4], maxy[4], maxz[4];
+    cl_uint child[4];       // inner child: wide node index, leaf child: index into index list
+    cl_uchar nPrims[4];     // 0 for inner children
+    cl_uint numChildren;    // valid children, packed to the front
+    cl_uint pad[2];
+} GPUNode4; // 128B
+
+typedef struct
+{
+    cl_float minx[8], miny[8], minz[8];
+    cl_float maxx[8], maxy[8], maxz[8];
+    cl_uint child[8];
+    cl_uchar nPrims[8];
+    cl_uint numChildren;
+    cl_uint pad[5];
+} GPUNode8; // 256B
+
+// Quantized wide nodes used with BVH_QUANTIZED
+// Child bound = origin + q * 2^exp, rounded outwards
+typedef struct
+{
+    cl_float origin[3];     // parent frame
+    cl_char exp[3];         // per-axis power-of-two scale
+    cl_uchar numChildren;
+    cl_uchar qminx[4], qminy[4], qminz[4];
+    cl_uchar qmaxx[4], qmaxy[4], qmaxz[4];
+    cl_uint child[4];
+    cl_uchar nPrims[4];
+    cl_uint pad;
+} GPUQNode4; // 64B
+
+typedef struct
+{
+    cl_float origin[3];
+    cl_char exp[3];
+    cl_uchar numChildren;
+    cl_uchar qminx[8], qminy[8], qminz[8];
+    cl_uchar qmaxx[8], qmaxy[8], qmaxz[8];
+    cl_uint child[8];
+    cl_uchar nPrims[8];
+    cl_uint pad[2];
+} GPUQNode8; // 112B
+
+// Placement of a bottom-level BVH with USE_INSTANCING, see twolevelbvh.hpp
+typedef struct
+{
+    float3 rows[3];  // world to object transform: linear part (rows)
+    float3 offset;   // world to object transform: translation
+    cl_uint root;    // root node of the bottom-level BVH
+    cl_uint pad[3];
+} GPUInstance; // 80B
+
 typedef struct
 {
     float3 p; // 16B
@@ -90,7 +150,36 @@ typedef struct
     Vertex v1;
     Vertex v2;
     cl_int matId;
-} Triangle; // this struct is used interchangeably with RTTriangle...sizes must match!
+} Triangle; // device-side only, area light quads in intersect.cl
+
+// Vertex buffer layout, see CLContext::packVertices.
+// Normal: octahedral mapping, two snorm16 (x in the low bits), OCT_NORMAL_NONE for flat shading.
+// Texture coordinate: two halfs (u in the low bits).
+#define OCT_NORMAL_NONE 0x80008000u
+typedef struct
+{
+    cl_float p[3];
+    cl_uint n;
+    cl_uint t;
+} PackedVertex; // 20B
+
+// Scene geometry is indexed, see TriangleMesh in triangle.hpp
+// Vertices are shared, a zero normal (OCT_NORMAL_NONE on the GPU) means flat shading
+typedef struct
+{
+    cl_uint v[3]; // indices into vertex buffer
+    cl_int matId;
+} IndexedTriangle; // 16B
+
+// Intersection data of one index list entry, uploaded in index list order (leaf order).
+// Traversal reads only these, shading attributes are fetched for the closest hit.
+typedef struct
+{
+    cl_float v0[3];
+    cl_uint tri;     // index list entry: triangle, or instance in top-level leaves
+    cl_float e1[4];  // v1 - v0, w unused
+    cl_float e2[4];  // v2 - v0, w unused
+} LeafTriangle; // 48B
 
 typedef struct
 {
@@ -0,0 +1,207 @@
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "hierarchycache.hpp"
+#include "settings.hpp"
+#include "utils.h"
+
+using json = nlohmann::json;
+
+HierarchyBuildInfo HierarchyBuildInfo::fromSettings(SplitMode mode)
+{
+	return fromSettings(builderForSplitMode(mode), mode, Settings::getInstance().getBvhOptimizePasses());
+}
+
+HierarchyBuildInfo HierarchyBuildInfo::fromSettings(HierarchyBuilder builder, SplitMode mode, U32 optimizePasses)
+{
+	Settings &s = Settings::getInstance();
+
+	HierarchyBuildInfo info;
+	info.builder = builder;
+	info.splitMode = mode;
+	info.optimizePasses = optimizePasses;
+
+	// LBVH has a fixed leaf size, median splits and LBVH have no cost model, treelets use the SAH costs
+	if (builder != HierarchyBuilder_LBVH)
+		info.maxLeafElems = s.getBvhMaxLeafElems();
+	if (mode == SplitMode_Sah || mode == SplitMode_SahBinned || optimizePasses > 0)
+	{
+		info.costBox = s.getBvhCostBox();
+		info.costTri = s.getBvhCostTri();
+	}
+	if (mode == SplitMode_SahBinned)
+		info.sahBins = s.getBvhSahBins();
+	if (builder == HierarchyBuilder_SBVH)
+	{
+		info.splitAlpha = s.getBvhSplitAlpha();
+		info.spatialBins = s.getBvhSpatialBins();
+	}
+
+	return info;
+}
+
+bool HierarchyBuildInfo::operator==(const HierarchyBuildInfo &other) const
+{
+	return std::memcmp(this, &other, sizeof(HierarchyBuildInfo)) == 0;
+}
+
+std::string HierarchyBuildInfo::describe() const
+{
+	static const char *builders[] = { "BVH", "SBVH", "LBVH" };
+
+	std::stringstream ss;
+	ss << builders[std::min(builder, (U32)HierarchyBuilder_LBVH)] << " (" << splitModeName((SplitMode)splitMode) << ")"
+	   << ", leaf " << maxLeafElems << ", costBox " << costBox << ", costTri " << costTri;
+	if (sahBins > 0)
+		ss << ", sah bins " << sahBins;
+	if (builder == HierarchyBuilder_SBVH)
+		ss << ", alpha " << splitAlpha << ", spatial bins " << spatialBins;
+	if (optimizePasses > 0)
+		ss << ", treelet passes " << optimizePasses;
+	return ss.str();
+}
+
+std::string HierarchyBuildInfo::key() const
+{
+	static_assert(sizeof(HierarchyBuildInfo) == 9 * 4, "Build info must not contain padding");
+	std::stringstream ss;
+	ss << std::hex << (computeHash(this, sizeof(HierarchyBuildInfo)) & 0xFFFFFFFFu);
+	return ss.str();
+}
+
+static std::string baseName(const std::string &file)
+{
+	return file.substr(file.find_last_of("/\\") + 1);
+}
+
+static size_t fileBytes(const std::string &file)
+{
+	std::ifstream f(file, std::ios::binary | std::ios::ate);
+	return f.good() ? (size_t)f.tellg() : 0;
+}
+
+static json readIndex(const std::string &file)
+{
+	std::ifstream in(file);
+	if (!in.good())
+		return json::object();
+
+	try
+	{
+		json j;
+		in >> j;
+		return j.is_object() ? j : json::object();
+	}
+	catch (std::exception &e)
+	{
+		std::cout << "Ignoring invalid cache index " << file << ": " << e.what() << std::endl;
+		return json::object();
+	}
+}
+
+static void writeIndex(const std::string &file, const json &j)
+{
+	std::ofstream out(file);
+	if (!out.good())
+	{
+		std::cout << "Could not write " << file << std::endl;
+		return;
+	}
+	out << j.dump(4) << std::endl;
+}
+
+// Monotonic use counter, independent of file system timestamps
+static U64 nextUse(json &index)
+{
+	U64 clock = index.value("clock", (U64)0) + 1;
+	index["clock"] = clock;
+	return clock;
+}
+
+HierarchyCache::HierarchyCache(const std::string &dir, size_t budgetBytes) : dir(dir), budget(budgetBytes) {}
+
+std::string HierarchyCache::indexFile() const
+{
+	return dir + "/index.json";
+}
+
+std::string HierarchyCache::fileName(const std::string &sceneHash, const HierarchyBuildInfo &info) const
+{
+	return dir + "/hierarchy_" + sceneHash + "_" + info.key() + ".bin";
+}
+
+void HierarchyCache::touch(const std::string &file)
+{
+	json index = readIndex(indexFile());
+	json &files = index["files"];
+	std::string name = baseName(file);
+	if (files.find(name) == files.end())
+		return; // not managed
+
+	files[name]["lastUse"] = nextUse(index);
+	writeIndex(indexFile(), index);
+}
+
+void HierarchyCache::insert(const std::string &file, const std::string &sceneHash, const HierarchyBuildInfo &info)
+{
+	json index = readIndex(indexFile());
+	U64 use = nextUse(index);
+	index["files"][baseName(file)] = {
+		{ "bytes", fileBytes(file) },
+		{ "lastUse", use },
+		{ "scene", sceneHash },
+		{ "builder", info.describe() }
+	};
+	writeIndex(indexFile(), index);
+
+	evict(file);
+}
+
+// Least recently used first, the given file is always kept
+void HierarchyCache::evict(const std::string &keep)
+{
+	if (budget == 0)
+		return;
+
+	json index = readIndex(indexFile());
+	json &files = index["files"];
+
+	struct Entry
+	{
+		std::string name;
+		U64 lastUse;
+		size_t bytes;
+	};
+
+	std::vector<Entry> entries;
+	size_t total = 0;
+	for (auto it = files.begin(); it != files.end(); ++it)
+	{
+		Entry e = { it.key(), it.value().value("lastUse", (U64)0), it.value().value("bytes", (size_t)0) };
+		entries.push_back(e);
+		total += e.bytes;
+	}
+
+	if (total <= budget)
+		return;
+
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.lastUse < b.lastUse; });
+	std::string keepName = baseName(keep);
+	for (const Entry &e : entries)
+	{
+		if (total <= budget)
+			break;
+		if (e.name == keepName)
+			continue;
+
+		std::cout << "Evicting cached hierarchy " << e.name << " (" << e.bytes / (1024 * 1024) << " MiB)" << std::endl;
+		std::remove((dir + "/" + e.name).c_str());
+		files.erase(e.name);
+		total -= e.bytes;
+	}
+
+	writeIndex(indexFile(), index);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include "rtutil.hpp"
+
+enum HierarchyBuilder
+{
+	HierarchyBuilder_BVH,
+	HierarchyBuilder_SBVH,
+	HierarchyBuilder_LBVH
+};
+
+// SBVH implements only the SAH splits, median splits are built by the plain BVH builder
+inline HierarchyBuilder builderForSplitMode(SplitMode mode)
+{
+	switch (mode) {
+	case SplitMode_LBVH: return HierarchyBuilder_LBVH;
+	case SplitMode_SpatialMedian:
+	case SplitMode_ObjectMedian: return HierarchyBuilder_BVH;
+	default: return HierarchyBuilder_SBVH;
+	}
+}
+
+// Builder and parameters that produced a hierarchy, stored with it in the cache.
+// Parameters a builder ignores are left zero, so that they don't split cache entries.
+struct HierarchyBuildInfo
+{
+	U32 builder = 0;        // HierarchyBuilder
+	U32 splitMode = 0;      // SplitMode
+	U32 maxLeafElems = 0;
+	U32 sahBins = 0;        // binned SAH only
+	U32 spatialBins = 0;    // SBVH only
+	U32 optimizePasses = 0; // treelet restructuring after the build
+	F32 splitAlpha = 0.0f;  // SBVH only
+	F32 costBox = 0.0f;
+	F32 costTri = 0.0f;
+
+	// Current settings for the builder used in Tracer::constructHierarchy
+	static HierarchyBuildInfo fromSettings(SplitMode mode);
+	static HierarchyBuildInfo fromSettings(HierarchyBuilder builder, SplitMode mode, U32 optimizePasses);
+
+	bool operator==(const HierarchyBuildInfo &other) const;
+	bool operator!=(const HierarchyBuildInfo &other) const { return !(*this == other); }
+	std::string describe() const;
+	std::string key() const; // short hash for file names
+};
+
+/*
+	Hierarchies cached in data/hierarchies, one file per scene and build parameter set.
+	index.json records the size, build parameters and last use of every file.
+	When the files exceed the disk budget, the least recently used ones are removed.
+	Files not in the index (older cache versions, other directories) are left alone.
+*/
+class HierarchyCache
+{
+public:
+	HierarchyCache(const std::string &dir, size_t budgetBytes); // 0 = unlimited
+
+	std::string fileName(const std::string &sceneHash, const HierarchyBuildInfo &info) const;
+
+	void touch(const std::string &file); // mark as used
+	void insert(const std::string &file, const std::string &sceneHash, const HierarchyBuildInfo &info); // after writing, evicts others if needed
+
+private:
+	void evict(const std::string &keep);
+	std::string indexFile() const;
+
+	std::string dir;
+	size_t budget;
+};
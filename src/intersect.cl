@@ -59,12 +59,13 @@ inline bool intersectAABB(Ray *r, global AABB *box, float *tminRet, float *tMaxR
     return tmin < tMaxPrev; // not behind current best hit
 }
 
-// Möller-Trumbore
+// Möller-Trumbore, edges precomputed
 #define EPSILON 1e-12f
-inline bool intersectTriangle(Ray *r, global Triangle *tri, float *tret, float *uret, float *vret)
+inline bool intersectTriangle(Ray *r, global LeafTriangle *tri, float *tret, float *uret, float *vret)
 {
-    float3 s1 = tri->v1.p - tri->v0.p;
-    float3 s2 = tri->v2.p - tri->v0.p;
+    const float3 p0 = vload3(0, tri->v0);
+    float3 s1 = vload4(0, tri->e1).xyz;
+    float3 s2 = vload4(0, tri->e2).xyz;
     float3 pvec = cross(r->dir, s2); // order matters!
     float det = dot(s1, pvec);
 
@@ -72,7 +73,7 @@ inline bool intersectTriangle(Ray *r, global Triangle *tri, float *tret, float *
     if (fabs(det) < EPSILON) return false;
     float iDet = 1.0f / det;
 
-    float3 tvec = r->orig - tri->v0.p;
+    float3 tvec = r->orig - p0;
     float u = dot(tvec, pvec) * iDet;
     if (u < 0.0f || u > 1.0f) return false;
 
@@ -92,6 +93,30 @@ inline bool intersectTriangle(Ray *r, global Triangle *tri, float *tret, float *
     return true;
 }
 
+// Material, shading normal and texture coordinates of the closest hit
+inline void setHitAttributes(Hit *hit, uint i, float u, float v, global IndexedTriangle *tris, global PackedVertex *vertices)
+{
+    const IndexedTriangle tri = tris[i];
+    global PackedVertex *v0 = &vertices[tri.v[0]];
+    global PackedVertex *v1 = &vertices[tri.v[1]];
+    global PackedVertex *v2 = &vertices[tri.v[2]];
+
+    hit->i = i;
+    hit->matId = tri.matId;
+    hit->uvTex = lerp2(u, v, decodeTexCoord(v0), decodeTexCoord(v1), decodeTexCoord(v2));
+
+    // Missing vertex normals: flat shading
+    if (v0->n == OCT_NORMAL_NONE || v1->n == OCT_NORMAL_NONE || v2->n == OCT_NORMAL_NONE)
+    {
+        const float3 p0 = vload3(0, v0->p);
+        hit->N = normalize(cross(vload3(0, v1->p) - p0, vload3(0, v2->p) - p0));
+    }
+    else
+    {
+        hit->N = normalize(lerp(u, v, decodeNormal(v0->n), decodeNormal(v1->n), decodeNormal(v2->n)));
+    }
+}
+
 // For drawing the test area light
 inline bool intersectTriangleLocal(Ray *r, Triangle *tri, float *tres)
 {
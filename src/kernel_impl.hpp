@@ -32,8 +32,10 @@ public:
         err |= setArg("ggxRefrQueue",   ctx->deviceBuffers.ggxRefrMatQueue);
         err |= setArg("deltaQueue",     ctx->deviceBuffers.deltaMatQueue);
         err |= setArg("tris",           ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("vertices",       ctx->deviceBuffers.vertexBuffer);
         err |= setArg("nodes",          ctx->deviceBuffers.nodeBuffer);
-        err |= setArg("indices",        ctx->deviceBuffers.indexBuffer);
+        err |= setArg("instances",      ctx->deviceBuffers.instanceBuffer);
+        err |= setArg("leafTris",       ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("envMap",         ctx->deviceBuffers.environmentMap);
         err |= setArg("probTable",      ctx->deviceBuffers.probTable);
         err |= setArg("aliasTable",     ctx->deviceBuffers.aliasTable);
@@ -69,8 +71,10 @@ public:
         int err = 0;
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("vertices", ctx->deviceBuffers.vertexBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
-        err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
+        err |= setArg("instances", ctx->deviceBuffers.instanceBuffer);
+        err |= setArg("leafTris", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("pickResult", ctx->deviceBuffers.pickResult);
         clt::check(err, "Failed to set kernel_pick arguments!");
     }
@@ -87,8 +91,10 @@ public:
         err |= setArg("queueLens", ctx->deviceBuffers.queueCounters);
         err |= setArg("extensionQueue", ctx->deviceBuffers.extensionQueue);
         err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("vertices", ctx->deviceBuffers.vertexBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
-        err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
+        err |= setArg("instances", ctx->deviceBuffers.instanceBuffer);
+        err |= setArg("leafTris", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_extension arguments!");
@@ -105,9 +111,9 @@ public:
         err |= setArg("tasks", ctx->deviceBuffers.tasksBuffer);
         err |= setArg("queueLens", ctx->deviceBuffers.queueCounters);
         err |= setArg("shadowQueue", ctx->deviceBuffers.shadowQueue);
-        err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
-        err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
+        err |= setArg("instances", ctx->deviceBuffers.instanceBuffer);
+        err |= setArg("leafTris", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("numTasks", ctx->getNumTasks());
         clt::check(err, "Failed to set wf_shadow arguments!");
@@ -322,8 +328,10 @@ public:
         err |= setArg("textures", ctx->deviceBuffers.texDescriptorBuffer);
         err |= setArg("denoiserNormal", ctx->deviceBuffers.denoiserNormalBuffer);
         err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("vertices", ctx->deviceBuffers.vertexBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
-        err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
+        err |= setArg("instances", ctx->deviceBuffers.instanceBuffer);
+        err |= setArg("leafTris", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("stats", ctx->deviceBuffers.renderStats);
         err |= setArg("envMap", ctx->deviceBuffers.environmentMap);
@@ -358,8 +366,10 @@ public:
         err |= setArg("aliasTable", ctx->deviceBuffers.aliasTable);
         err |= setArg("pdfTable", ctx->deviceBuffers.pdfTable);
         err |= setArg("tris", ctx->deviceBuffers.triangleBuffer);
+        err |= setArg("vertices", ctx->deviceBuffers.vertexBuffer);
         err |= setArg("nodes", ctx->deviceBuffers.nodeBuffer);
-        err |= setArg("indices", ctx->deviceBuffers.indexBuffer);
+        err |= setArg("instances", ctx->deviceBuffers.instanceBuffer);
+        err |= setArg("leafTris", ctx->deviceBuffers.leafTriangleBuffer);
         err |= setArg("params", ctx->deviceBuffers.renderParams);
         err |= setArg("stats", ctx->deviceBuffers.renderStats);
         err |= setArg("numTasks", ctx->getNumTasks());
@@ -3,7 +3,7 @@
 #include "utils.cl"
 #include "intersect.cl"
 
-kernel void pick(global RenderParams *params, global Triangle *tris, global GPUNode *nodes, global uint *indices, global Hit *pickResult, float NDCx, float NDCy)
+kernel void pick(global RenderParams *params, global IndexedTriangle *tris, global PackedVertex *vertices, global GPUNode *nodes, global LeafTriangle *leafTris, global GPUInstance *instances, global Hit *pickResult, float NDCx, float NDCy)
 {
     // Uses one single thread
     if (get_global_id(0) != 0 || get_global_id(1) != 0)
@@ -30,7 +30,7 @@ kernel void pick(global RenderParams *params, global Triangle *tris, global GPUN
 
     // Trace ray
     Hit hit = EMPTY_HIT(FLT_MAX);
-    bvh_intersect(&r, &hit, tris, nodes, indices);
+    bvh_intersect(&r, &hit, tris, vertices, nodes, leafTris, instances);
     if (params->sampleImpl && params->useAreaLight) intersectLight(&hit, &r, params);
 
     // Write result
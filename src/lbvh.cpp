@@ -0,0 +1,279 @@
+#include <iostream>
+#include <cassert>
+#include <algorithm>
+#include "lbvh.hpp"
+#include "threadpool.hpp"
+
+// Insert two zeros after each of the lowest 10 bits
+inline U32 expandBits(U32 v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// Insert two zeros after each of the lowest 21 bits
+inline U64 expandBits(U64 v)
+{
+	v &= 0x1fffffull;
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
+
+// 30-bit (U32) or 63-bit (U64) code of a point in the unit cube
+template<typename Code>
+inline Code mortonCode(const float3 &p)
+{
+	const F32 scale = (F32)((1u << (sizeof(Code) * 8 / 3)) - 1);
+	Code x = (Code)std::min(std::max(p.x * scale, 0.0f), scale);
+	Code y = (Code)std::min(std::max(p.y * scale, 0.0f), scale);
+	Code z = (Code)std::min(std::max(p.z * scale, 0.0f), scale);
+	return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+template<typename T>
+inline T highestBit(T v)
+{
+	for (U32 s = 1; s < sizeof(T) * 8; s <<= 1)
+		v |= v >> s;
+	return v - (v >> 1);
+}
+
+// Stable LSD radix sort of (key, value) pairs, chunks processed in parallel
+template<typename Code>
+void radixSort(std::vector<Code> &keys, std::vector<U32> &values, U32 chunkSize)
+{
+	const U32 RadixBits = 8;
+	const U32 Buckets = 1 << RadixBits;
+	const U32 N = (U32)keys.size();
+	const U32 numChunks = std::max(1U, (N + chunkSize - 1) / chunkSize);
+
+	std::vector<Code> keysTmp(N);
+	std::vector<U32> valuesTmp(N);
+	std::vector<U32> offsets(numChunks * Buckets);
+	ThreadPool &pool = ThreadPool::getInstance();
+
+	for (U32 shift = 0; shift < sizeof(Code) * 8; shift += RadixBits)
+	{
+		// Digit histogram per chunk
+		std::fill(offsets.begin(), offsets.end(), 0);
+		pool.parallelFor(numChunks, [&](U32 c)
+		{
+			U32 *hist = &offsets[c * Buckets];
+			for (U32 i = c * chunkSize; i < std::min(N, (c + 1) * chunkSize); i++)
+				hist[(keys[i] >> shift) & (Buckets - 1)]++;
+		});
+
+		// Scatter offsets: digit-major, chunks in order => stable
+		U32 sum = 0;
+		bool sameDigit = false;
+		for (U32 d = 0; d < Buckets; d++)
+		{
+			U32 digitStart = sum;
+			for (U32 c = 0; c < numChunks; c++)
+			{
+				U32 count = offsets[c * Buckets + d];
+				offsets[c * Buckets + d] = sum;
+				sum += count;
+			}
+			sameDigit |= (sum - digitStart == N);
+		}
+
+		// Pass would not change the order (common for high bits)
+		if (sameDigit)
+			continue;
+
+		pool.parallelFor(numChunks, [&](U32 c)
+		{
+			U32 *offs = &offsets[c * Buckets];
+			for (U32 i = c * chunkSize; i < std::min(N, (c + 1) * chunkSize); i++)
+			{
+				U32 dst = offs[(keys[i] >> shift) & (Buckets - 1)]++;
+				keysTmp[dst] = keys[i];
+				valuesTmp[dst] = values[i];
+			}
+		});
+
+		keys.swap(keysTmp);
+		values.swap(valuesTmp);
+	}
+}
+
+LBVH::LBVH(TriangleMesh *tris)
+{
+	m_triangles = tris;
+	m_mode = SplitMode_LBVH;
+	recordBuildInfo(HierarchyBuilder_LBVH, 0);
+
+	const U32 N = (U32)m_triangles->size();
+	const U32 numChunks = std::max(1U, (N + ChunkSize - 1) / ChunkSize);
+	ThreadPool &pool = ThreadPool::getInstance();
+
+	// Setup references for building
+	m_refs.resize(N);
+	pool.parallelFor(numChunks, [this, N](U32 c)
+	{
+		for (U32 i = c * ChunkSize; i < std::min(N, (c + 1) * ChunkSize); i++)
+			m_refs[i] = TriRef(i, *m_triangles);
+	});
+
+	// Short codes sort faster, but collide in large scenes
+	bool shortCodes = (N <= MaxTris30BitCodes);
+	if (shortCodes)
+		buildHierarchy<U32>();
+	else
+		buildHierarchy<U64>();
+
+	assert(metrics.depth <= MaxDepth);
+	if (metrics.depth > MaxDepth)
+		std::cout << "WARN: LBVH might not fit traversal stack! (" << metrics.depth << " > " << MaxDepth << ")" << std::endl;
+
+	computeBounds();
+	createIndexList();
+	createSmallNodes();
+
+	std::cout
+		<< "======================" << std::endl
+		<< "LBVH (" << (shortCodes ? 30 : 63) << "-bit Morton codes, " << pool.getNumThreads() << " threads)" << std::endl
+		<< "Splits: " << metrics.splits << std::endl
+		<< "Depth: " << metrics.depth << std::endl
+		<< "Leaves: " << metrics.splits + 1 << std::endl
+		<< "======================" << std::endl;
+}
+
+template<typename Code>
+void LBVH::buildHierarchy()
+{
+	std::vector<Code> codes;
+	sortMorton(codes);
+
+	// Large subtrees are built concurrently into separate fragments
+	BuildFragment root(BuildNode(0, (U32)m_refs.size() - 1, -1));
+	ThreadPool &pool = ThreadPool::getInstance();
+	TaskGroup tasks;
+	pool.submit(tasks, [this, &root, &codes, &tasks]() { build(root, codes, 0, 0, tasks); });
+	pool.wait(tasks);
+
+	mergeFragment(root, -1);
+}
+
+// Sort references along the Morton curve through the centroid bounds
+template<typename Code>
+void LBVH::sortMorton(std::vector<Code> &codes)
+{
+	const U32 N = (U32)m_refs.size();
+	const U32 numChunks = std::max(1U, (N + ChunkSize - 1) / ChunkSize);
+	ThreadPool &pool = ThreadPool::getInstance();
+
+	AABB_t bounds = centroudBounds(m_refs.begin(), m_refs.end());
+	float3 extent = bounds.max - bounds.min;
+	float3 invExtent(
+		(extent.x > 0.0f) ? 1.0f / extent.x : 0.0f,
+		(extent.y > 0.0f) ? 1.0f / extent.y : 0.0f,
+		(extent.z > 0.0f) ? 1.0f / extent.z : 0.0f);
+
+	codes.resize(N);
+	std::vector<U32> order(N);
+	pool.parallelFor(numChunks, [&](U32 c)
+	{
+		for (U32 i = c * ChunkSize; i < std::min(N, (c + 1) * ChunkSize); i++)
+		{
+			codes[i] = mortonCode<Code>((m_refs[i].pos() - bounds.min) * invExtent);
+			order[i] = i;
+		}
+	});
+
+	radixSort(codes, order, ChunkSize);
+
+	std::vector<TriRef> sorted(N);
+	pool.parallelFor(numChunks, [&](U32 c)
+	{
+		for (U32 i = c * ChunkSize; i < std::min(N, (c + 1) * ChunkSize); i++)
+			sorted[i] = m_refs[order[i]];
+	});
+	m_refs.swap(sorted);
+}
+
+// Split at the highest differing code bit, refs with identical codes are split at the median.
+// Equivalent to Karras' bottom-up construction, but emits nodes directly in depth-first order.
+template<typename Code>
+void LBVH::build(BuildFragment &frag, const std::vector<Code> &codes, U32 nInd, U32 depth, TaskGroup &tasks)
+{
+	atomicMax(metrics.depth, depth);
+
+	const U32 s = frag.nodes[nInd].iStart;
+	const U32 e = frag.nodes[nInd].iEnd;
+	const U32 elems = e - s + 1;
+	if (elems <= LeafElems)
+		return;
+
+	// Index of first element of second group
+	U32 split;
+	Code diff = codes[s] ^ codes[e];
+	if (diff == 0)
+	{
+		split = s + elems / 2;
+	}
+	else
+	{
+		Code bit = highestBit(diff);
+		auto it = std::partition_point(codes.begin() + s, codes.begin() + e + 1, [bit](Code c) { return (c & bit) == 0; });
+		split = (U32)(it - codes.begin());
+	}
+
+	assert(split > s && split <= e);
+	metrics.splits++;
+
+	BuildNode left(s, split - 1, nInd);
+	BuildNode right(split, e, nInd);
+
+	// Large subtrees: build children as separate tasks (only ever the case for the fragment root)
+	if (elems > ParallelBuildThreshold)
+	{
+		assert(nInd == 0);
+		left.parent = right.parent = -1; // fixed when merging
+		frag.nodes[nInd].rightChild = 0; // interior node, fixed when merging
+		frag.left.reset(new BuildFragment(left));
+		frag.right.reset(new BuildFragment(right));
+
+		ThreadPool &pool = ThreadPool::getInstance();
+		BuildFragment *lfrag = frag.left.get();
+		BuildFragment *rfrag = frag.right.get();
+		pool.submit(tasks, [this, rfrag, &codes, depth, &tasks]() { build(*rfrag, codes, 0, depth + 1, tasks); });
+		pool.submit(tasks, [this, lfrag, &codes, depth, &tasks]() { build(*lfrag, codes, 0, depth + 1, tasks); });
+		return;
+	}
+
+	// Left child
+	frag.nodes.push_back(left);
+	build(frag, codes, (U32)frag.nodes.size() - 1, depth + 1, tasks); // last pushed
+
+	// Right child
+	frag.nodes.push_back(right);
+	frag.nodes[nInd].rightChild = (S32)frag.nodes.size() - 1;
+	build(frag, codes, (U32)frag.nodes.size() - 1, depth + 1, tasks);
+}
+
+// Bottom-up in a single sweep, children are always stored after their parent
+void LBVH::computeBounds()
+{
+	for (size_t i = m_build_nodes.size(); i-- > 0;)
+	{
+		BuildNode &n = m_build_nodes[i];
+		if (n.rightChild == -1)
+		{
+			n.computeBB(m_refs);
+		}
+		else
+		{
+			n.box = m_build_nodes[i + 1].box;
+			n.box.expand(m_build_nodes[n.rightChild].box);
+		}
+	}
+}
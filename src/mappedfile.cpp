@@ -0,0 +1,105 @@
+#include "mappedfile.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &filename)
+{
+    close();
+
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER len;
+    if (!GetFileSizeEx(file, &len) || len.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    fileHandle = file;
+    mappingHandle = mapping;
+    ptr = (const unsigned char*)view;
+    bytes = (size_t)len.QuadPart;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (ptr)
+        UnmapViewOfFile(ptr);
+    if (mappingHandle)
+        CloseHandle((HANDLE)mappingHandle);
+    if (fileHandle)
+        CloseHandle((HANDLE)fileHandle);
+
+    ptr = nullptr;
+    bytes = 0;
+    fileHandle = mappingHandle = nullptr;
+}
+
+#else
+
+bool MappedFile::open(const std::string &filename)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // mapping keeps the file referenced
+    if (view == MAP_FAILED)
+        return false;
+
+    // Read front to back in large chunks
+    madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    ptr = (const unsigned char*)view;
+    bytes = (size_t)st.st_size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (ptr)
+        munmap((void*)ptr, bytes);
+
+    ptr = nullptr;
+    bytes = 0;
+}
+
+#endif
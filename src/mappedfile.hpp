@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+/*
+    Read-only memory mapping of a whole file.
+    Pages are loaded by the OS on first access, so mapped data can be handed to
+    bulk copies or OpenCL uploads without reading it into an intermediate buffer.
+*/
+class MappedFile
+{
+public:
+    MappedFile(void) {}
+    MappedFile(const std::string &filename) { open(filename); }
+    ~MappedFile() { close(); }
+    MappedFile(MappedFile const&) = delete;
+    void operator=(MappedFile const&) = delete;
+
+    bool open(const std::string &filename); // false if missing or empty
+    void close();
+
+    bool valid() const { return ptr != nullptr; }
+    const unsigned char *data() const { return ptr; }
+    size_t size() const { return bytes; }
+
+private:
+    const unsigned char *ptr = nullptr;
+    size_t bytes = 0;
+#ifdef _WIN32
+    void *fileHandle = nullptr;
+    void *mappingHandle = nullptr;
+#endif
+};
@@ -10,9 +10,11 @@ kernel void nextVertex(
     global uchar *texData,
     global TexDescriptor *textures,
     global float *denoiserNormal, // for Optix denoiser
-    global Triangle *tris,
+    global IndexedTriangle *tris,
+    global PackedVertex *vertices,
     global GPUNode *nodes,
-    global uint *indices,
+    global LeafTriangle *leafTris,
+    global GPUInstance *instances,
     global RenderParams *params,
     global RenderStats *stats,
 	read_only image2d_t envMap,
@@ -36,7 +38,7 @@ kernel void nextVertex(
 
     // Trace ray
     Hit hit = EMPTY_HIT(FLT_MAX); // TODO: Max distance?
-    bvh_intersect(&r, &hit, tris, nodes, indices);
+    bvh_intersect(&r, &hit, tris, vertices, nodes, leafTris, instances);
     if (params->sampleImpl && params->useAreaLight) intersectLight(&hit, &r, params);
 
     // Write hit to path state
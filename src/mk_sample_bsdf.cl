@@ -18,9 +18,11 @@ kernel void sampleBsdf(
     global float *probTable,
     global int *aliasTable,
     global float *pdfTable,
-    global Triangle *tris,
+    global IndexedTriangle *tris,
+    global PackedVertex *vertices,
     global GPUNode *nodes,
-    global uint *indices,
+    global LeafTriangle *leafTris,
+    global GPUInstance *instances,
     global RenderParams *params,
     global RenderStats *stats,
     uint numTasks)
@@ -46,7 +48,7 @@ kernel void sampleBsdf(
     Material mat = materials[hit.matId];
 
     // Apply potential normal map
-    hit.N = tangentSpaceNormal(hit, tris, mat, textures, texData);
+    hit.N = tangentSpaceNormal(hit, tris, vertices, mat, textures, texData);
 
     // Fix backside hits
     bool backface = dot(hit.N, r.dir) > 0.0f;
@@ -89,7 +91,7 @@ kernel void sampleBsdf(
             // TODO: BAD! Collect all shadow ray casts together (in queue, i.e. buffer of gids + atomic counter)!
             Hit hitL = EMPTY_HIT(lenL);
             if (params->useAreaLight) intersectLight(&hitL, &rLight, params);
-            bool occluded = (hitL.i > -1) || bvh_occluded(&rLight, &lenL, tris, nodes, indices);
+            bool occluded = (hitL.i > -1) || bvh_occluded(&rLight, &lenL, nodes, leafTris, instances);
             atomic_inc(&stats->shadowRays);
 
             // Compute contribution
@@ -128,7 +130,7 @@ kernel void sampleBsdf(
             Ray rLight = { orig, L };
 
             // TODO: BAD! Collect all shadow ray casts together (in queue, i.e. buffer of gids + atomic counter)!
-            bool occluded = bvh_occluded(&rLight, &lenL, tris, nodes, indices);
+            bool occluded = bvh_occluded(&rLight, &lenL, nodes, leafTris, instances);
             atomic_inc(&stats->shadowRays);
 
             // Calculate direct lighting
@@ -0,0 +1,157 @@
+#include <cassert>
+#include <algorithm>
+#include "nodelayout.hpp"
+
+enum
+{
+	BreadthFirstLevels = 10 // ~1K nodes stored level by level
+};
+
+static void depthFirst(const std::vector<Node> &nodes, U32 root, bool largerFirst, std::vector<U32> &order)
+{
+	std::vector<U32> stack(1, root);
+	while (!stack.empty())
+	{
+		U32 ni = stack.back();
+		stack.pop_back();
+		order.push_back(ni);
+
+		const Node &n = nodes[ni];
+		if (n.nPrims > 0)
+			continue;
+
+		U32 first = n.leftChild;
+		U32 second = n.rightChild;
+		if (largerFirst && nodes[second].box.area() > nodes[first].box.area())
+			std::swap(first, second);
+
+		stack.push_back(second);
+		stack.push_back(first);
+	}
+}
+
+static void breadthFirst(const std::vector<Node> &nodes, U32 root, std::vector<U32> &order)
+{
+	std::vector<U32> level(1, root);
+	for (U32 d = 0; d < BreadthFirstLevels && !level.empty(); d++)
+	{
+		std::vector<U32> next;
+		for (U32 ni : level)
+		{
+			order.push_back(ni);
+			if (nodes[ni].nPrims == 0)
+			{
+				next.push_back(nodes[ni].leftChild);
+				next.push_back(nodes[ni].rightChild);
+			}
+		}
+		level.swap(next);
+	}
+
+	for (U32 ni : level)
+		depthFirst(nodes, ni, false, order);
+}
+
+// Emits 'levels' levels of subtree 'ni', the roots of the subtrees below are appended to 'frontier'
+static void vanEmdeBoas(const std::vector<Node> &nodes, U32 ni, U32 levels, std::vector<U32> &order, std::vector<U32> &frontier)
+{
+	if (levels == 1)
+	{
+		order.push_back(ni);
+		if (nodes[ni].nPrims == 0)
+		{
+			frontier.push_back(nodes[ni].leftChild);
+			frontier.push_back(nodes[ni].rightChild);
+		}
+		return;
+	}
+
+	U32 top = (levels + 1) / 2;
+	std::vector<U32> bottom;
+	vanEmdeBoas(nodes, ni, top, order, bottom);
+	for (U32 bi : bottom)
+		vanEmdeBoas(nodes, bi, levels - top, order, frontier);
+}
+
+// Number of levels of every tree, indexed by root
+static std::vector<U32> treeHeights(const std::vector<Node> &nodes)
+{
+	// Parents precede children => depths in a single sweep
+	std::vector<U32> depth(nodes.size(), 0);
+	std::vector<U32> rootOf(nodes.size());
+	std::vector<U32> heights(nodes.size(), 0);
+	for (U32 i = 0; i < nodes.size(); i++)
+	{
+		S32 p = nodes[i].parent;
+		depth[i] = (p == -1) ? 0 : depth[p] + 1;
+		rootOf[i] = (p == -1) ? i : rootOf[p];
+		heights[rootOf[i]] = std::max(heights[rootOf[i]], depth[i] + 1);
+	}
+	return heights;
+}
+
+std::vector<U32> nodeOrder(const std::vector<Node> &nodes, NodeLayout layout)
+{
+	std::vector<U32> order;
+	order.reserve(nodes.size());
+	if (nodes.empty())
+		return order;
+
+	std::vector<U32> heights;
+	if (layout == NodeLayout_VanEmdeBoas)
+		heights = treeHeights(nodes);
+
+	for (U32 root = 0; root < nodes.size(); root++)
+	{
+		if (nodes[root].parent != -1)
+			continue;
+
+		switch (layout)
+		{
+		case NodeLayout_BreadthFirst:
+			breadthFirst(nodes, root, order);
+			break;
+		case NodeLayout_VanEmdeBoas:
+		{
+			std::vector<U32> frontier;
+			vanEmdeBoas(nodes, root, heights[root], order, frontier);
+			assert(frontier.empty());
+			break;
+		}
+		case NodeLayout_Probability:
+			depthFirst(nodes, root, true, order);
+			break;
+		default:
+			depthFirst(nodes, root, false, order);
+			break;
+		}
+	}
+
+	assert(order.size() == nodes.size() && order[0] == 0);
+	return order;
+}
+
+std::vector<U32> reorderNodes(std::vector<Node> &nodes, NodeLayout layout)
+{
+	std::vector<U32> order = nodeOrder(nodes, layout);
+	std::vector<U32> newIndex(nodes.size());
+	for (U32 i = 0; i < order.size(); i++)
+		newIndex[order[i]] = i;
+
+	std::vector<Node> reordered(nodes.size());
+	for (U32 i = 0; i < order.size(); i++)
+	{
+		Node n = nodes[order[i]];
+		if (n.parent != -1)
+			n.parent = (S32)newIndex[n.parent];
+		if (n.nPrims == 0)
+		{
+			n.leftChild = newIndex[n.leftChild];
+			n.rightChild = newIndex[n.rightChild];
+		}
+		reordered[i] = n;
+	}
+
+	nodes.swap(reordered);
+	return newIndex;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <vector>
+#include "bvhnode.hpp"
+
+/*
+	Storage orders for traversal nodes, children are referenced explicitly through leftChild and rightChild.
+	DepthFirst:  builder output, left child directly after its parent.
+	BreadthFirst: top levels stored level by level, subtrees below them depth-first.
+	VanEmdeBoas: cache-oblivious, top half of the levels first, then each bottom subtree recursively.
+	Probability: depth-first, the child with the larger surface area (more likely to be visited) stored first.
+	Several trees may share the vector (two-level hierarchies), each one is laid out separately.
+	Roots keep their relative order, the first one stays at index 0.
+	Parents precede their children in all layouts.
+*/
+
+// Node indices in storage order of the given layout
+std::vector<U32> nodeOrder(const std::vector<Node> &nodes, NodeLayout layout);
+
+// Moves nodes into the given layout, child and parent links are remapped.
+// Returns the new index of every node.
+std::vector<U32> reorderNodes(std::vector<Node> &nodes, NodeLayout layout);
@@ -0,0 +1,430 @@
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include "objloader.hpp"
+#include "mappedfile.hpp"
+#include "threadpool.hpp"
+#include "rtutil.hpp"
+#include "textparse.hpp"
+
+using FireRays::float2;
+
+namespace
+{
+    enum
+    {
+        ChunkBytes = 4 << 20 // parallel granularity
+    };
+
+    // Fan-triangulated face, indices are zero-based.
+    // -1: attribute missing. Relative indices are stored against the chunk start
+    // and flagged in 'relative', they may point into earlier chunks.
+    struct ObjFace
+    {
+        S32 p[3];
+        S32 t[3];
+        S32 n[3];
+        S32 material; // chunk-local slot, -1: set before the chunk
+        U32 relative; // bits 0-2: p, 3-5: t, 6-8: n
+    };
+
+    struct ObjChunk
+    {
+        std::vector<float3> positions;
+        std::vector<float3> normals;
+        std::vector<float2> texcoords;
+        std::vector<ObjFace> faces;
+        std::vector<U32> groups;            // local face index where a new shape starts
+        std::vector<std::string> materials; // usemtl names by local slot
+        std::vector<std::string> libs;
+        S32 lastMaterial = -1;              // slot in use at chunk end
+        size_t skippedLines = 0;            // malformed lines of supported statements
+    };
+
+    // Rest of the line without surrounding blanks
+    std::string lineString(const char *p, const char *end)
+    {
+        skipBlank(p, end);
+        const char *e = p;
+        while (e < end && !isLineEnd(*e)) e++;
+        while (e > p && isBlank(e[-1])) e--;
+        return std::string(p, e);
+    }
+
+    // OBJ index to zero-based, relative indices against the chunk-local count
+    inline bool resolveIndex(S32 raw, size_t localCount, S32 &index, bool &relative)
+    {
+        relative = raw < 0;
+        if (raw > 0)
+            index = raw - 1;
+        else if (raw < 0)
+            index = (S32)localCount + raw;
+        return raw != 0;
+    }
+
+    // Vertex of a face: p, p/t, p//n or p/t/n
+    struct FaceVertex { S32 p, t, n; U32 relative; };
+
+    bool parseFaceVertex(const char *&p, const char *end, const ObjChunk &c, FaceVertex &v)
+    {
+        S32 raw;
+        bool rel;
+        v.t = v.n = -1;
+        v.relative = 0;
+
+        if (!parseInt(p, end, raw) || !resolveIndex(raw, c.positions.size(), v.p, rel))
+            return false;
+        v.relative |= rel ? 1u : 0u;
+
+        if (p < end && *p == '/')
+        {
+            p++;
+            if (parseInt(p, end, raw))
+            {
+                if (!resolveIndex(raw, c.texcoords.size(), v.t, rel)) return false;
+                v.relative |= rel ? 2u : 0u;
+            }
+            if (p < end && *p == '/')
+            {
+                p++;
+                if (!parseInt(p, end, raw) || !resolveIndex(raw, c.normals.size(), v.n, rel))
+                    return false;
+                v.relative |= rel ? 4u : 0u;
+            }
+        }
+
+        return p == end || isBlank(*p) || isLineEnd(*p);
+    }
+
+    void parseChunk(const char *p, const char *end, ObjChunk &c)
+    {
+        std::vector<FaceVertex> poly;
+        std::string currentMaterial;
+        bool hasMaterial = false;
+
+        while (p < end)
+        {
+            skipBlank(p, end);
+            if (p == end)
+                break;
+
+            bool ok = true;
+            char c0 = *p;
+            char c1 = (p + 1 < end) ? p[1] : '\n';
+
+            if (c0 == 'v' && isBlank(c1))
+            {
+                p += 2;
+                float3 v;
+                ok = parseFloat(p, end, v.x) && parseFloat(p, end, v.y) && parseFloat(p, end, v.z); // w and colors ignored
+                if (ok) c.positions.push_back(v);
+            }
+            else if (c0 == 'v' && c1 == 'n')
+            {
+                p += 2;
+                float3 n;
+                ok = parseFloat(p, end, n.x) && parseFloat(p, end, n.y) && parseFloat(p, end, n.z);
+                if (ok) c.normals.push_back(n);
+            }
+            else if (c0 == 'v' && c1 == 't')
+            {
+                p += 2;
+                float2 t;
+                ok = parseFloat(p, end, t.x);
+                if (ok && !parseFloat(p, end, t.y))
+                    t.y = 0.0f; // 1D texture coordinate
+                if (ok) c.texcoords.push_back(t);
+            }
+            else if (c0 == 'f' && isBlank(c1))
+            {
+                p += 2;
+                poly.clear();
+                FaceVertex fv;
+                for (skipBlank(p, end); p < end && !isLineEnd(*p); skipBlank(p, end))
+                {
+                    if (!(ok = parseFaceVertex(p, end, c, fv)))
+                        break;
+                    poly.push_back(fv);
+                }
+                ok = ok && poly.size() >= 3;
+
+                for (size_t i = 2; ok && i < poly.size(); i++)
+                {
+                    const FaceVertex *fan[3] = { &poly[0], &poly[i - 1], &poly[i] };
+                    ObjFace f;
+                    f.material = hasMaterial ? (S32)c.materials.size() - 1 : -1;
+                    f.relative = 0;
+                    for (int k = 0; k < 3; k++)
+                    {
+                        f.p[k] = fan[k]->p;
+                        f.t[k] = fan[k]->t;
+                        f.n[k] = fan[k]->n;
+                        U32 r = fan[k]->relative;
+                        f.relative |= ((r & 1) << k) | (((r >> 1) & 1) << (3 + k)) | (((r >> 2) & 1) << (6 + k));
+                    }
+                    c.faces.push_back(f);
+                }
+            }
+            else if ((c0 == 'o' || c0 == 'g') && (isBlank(c1) || isLineEnd(c1)))
+            {
+                c.groups.push_back((U32)c.faces.size());
+            }
+            else if (end - p > 7 && !strncmp(p, "usemtl", 6) && isBlank(p[6]))
+            {
+                std::string name = lineString(p + 7, end);
+                if (!hasMaterial || name != currentMaterial)
+                {
+                    // New slot per change, names are deduplicated when merging
+                    c.materials.push_back(name);
+                    c.groups.push_back((U32)c.faces.size());
+                    currentMaterial = name;
+                    hasMaterial = true;
+                }
+            }
+            else if (end - p > 7 && !strncmp(p, "mtllib", 6) && isBlank(p[6]))
+            {
+                std::string libs = lineString(p + 7, end);
+                size_t start = 0;
+                while (start < libs.size())
+                {
+                    size_t stop = libs.find_first_of(" \t", start);
+                    if (stop == std::string::npos) stop = libs.size();
+                    if (stop > start)
+                        c.libs.push_back(libs.substr(start, stop - start));
+                    start = stop + 1;
+                }
+            }
+            // Comments and other statements (smoothing groups, lines, ...) are ignored
+
+            if (!ok)
+                c.skippedLines++;
+            skipLine(p, end);
+        }
+
+        c.lastMaterial = hasMaterial ? (S32)c.materials.size() - 1 : -1;
+    }
+
+    // Global index of a chunk-local attribute, -1 if missing or out of range
+    inline int64_t globalIndex(S32 index, bool relative, size_t base, size_t count)
+    {
+        int64_t i = relative ? (int64_t)base + index : (int64_t)index;
+        if (!relative && index < 0)
+            return -1;
+        return (i >= 0 && i < (int64_t)count) ? i : -1;
+    }
+}
+
+bool loadObjParallel(const std::string &filename, ObjData &data)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        std::cout << "Could not open file: " << filename << std::endl;
+        return false;
+    }
+
+    const char *begin = (const char*)file.data();
+    const char *end = begin + file.size();
+    ThreadPool &pool = ThreadPool::getInstance();
+
+    // Line-aligned chunk boundaries
+    const size_t numChunks = std::max<size_t>(1, (file.size() + ChunkBytes - 1) / ChunkBytes);
+    std::vector<const char*> bounds(numChunks + 1, end);
+    bounds[0] = begin;
+    for (size_t i = 1; i < numChunks; i++)
+    {
+        const char *p = std::max(begin + i * (file.size() / numChunks), bounds[i - 1]);
+        skipLine(p, end);
+        bounds[i] = p;
+    }
+
+    std::vector<ObjChunk> chunks(numChunks);
+    pool.parallelFor((unsigned int)numChunks, [&](unsigned int i)
+    {
+        parseChunk(bounds[i], bounds[i + 1], chunks[i]);
+    });
+
+    // Element offsets of each chunk, global material names
+    struct ChunkBase { size_t p, n, t, f; S32 inheritedMaterial; std::vector<S32> materials; };
+    std::vector<ChunkBase> bases(numChunks);
+    std::map<std::string, S32> materialIds;
+    size_t numPositions = 0, numNormals = 0, numTexcoords = 0, numFaces = 0, skipped = 0;
+    S32 material = -1;
+    data.materialNames.clear();
+    data.materialLibs.clear();
+    for (size_t i = 0; i < numChunks; i++)
+    {
+        ObjChunk &c = chunks[i];
+        ChunkBase &b = bases[i];
+        b.p = numPositions; numPositions += c.positions.size();
+        b.n = numNormals;   numNormals += c.normals.size();
+        b.t = numTexcoords; numTexcoords += c.texcoords.size();
+        b.f = numFaces;     numFaces += c.faces.size();
+        b.inheritedMaterial = material;
+        skipped += c.skippedLines;
+
+        for (const std::string &name : c.materials)
+        {
+            auto it = materialIds.find(name);
+            if (it == materialIds.end())
+            {
+                it = materialIds.insert(std::make_pair(name, (S32)data.materialNames.size())).first;
+                data.materialNames.push_back(name);
+            }
+            b.materials.push_back(it->second);
+        }
+        if (c.lastMaterial >= 0)
+            material = b.materials[c.lastMaterial];
+
+        for (const std::string &lib : c.libs)
+        {
+            if (std::find(data.materialLibs.begin(), data.materialLibs.end(), lib) == data.materialLibs.end())
+                data.materialLibs.push_back(lib);
+        }
+    }
+
+    if (numFaces == 0)
+    {
+        std::cout << "No faces in " << filename << std::endl;
+        return false;
+    }
+
+    // Concatenate attributes, any face may reference any chunk
+    std::vector<float3> positions(numPositions);
+    std::vector<float3> normals(numNormals);
+    std::vector<float2> texcoords(numTexcoords);
+    pool.parallelFor((unsigned int)numChunks, [&](unsigned int i)
+    {
+        ObjChunk &c = chunks[i];
+        std::copy(c.positions.begin(), c.positions.end(), positions.begin() + bases[i].p);
+        std::copy(c.normals.begin(), c.normals.end(), normals.begin() + bases[i].n);
+        std::copy(c.texcoords.begin(), c.texcoords.end(), texcoords.begin() + bases[i].t);
+        std::vector<float3>().swap(c.positions);
+        std::vector<float3>().swap(c.normals);
+        std::vector<float2>().swap(c.texcoords);
+    });
+
+    // Emit triangles in file order, vertices are shared within a chunk
+    std::vector<size_t> badPositions(numChunks, 0);
+    std::vector<size_t> badAttributes(numChunks, 0);
+    std::vector<std::vector<VertexPNT>> chunkVertices(numChunks);
+    data.mesh.triangles.resize(numFaces);
+    pool.parallelFor((unsigned int)numChunks, [&](unsigned int i)
+    {
+        ObjChunk &c = chunks[i];
+        const ChunkBase &b = bases[i];
+        std::vector<VertexPNT> &verts = chunkVertices[i];
+        ObjVertexMap vertexIds;
+        vertexIds.reserve(c.faces.size());
+        IndexedTriangle *out = data.mesh.triangles.data() + b.f;
+
+        for (const ObjFace &f : c.faces)
+        {
+            ObjVertexKey keys[3];
+            bool allNormals = true;
+            for (int k = 0; k < 3; k++)
+            {
+                ObjVertexKey &key = keys[k];
+                key.p = globalIndex(f.p[k], (f.relative >> k) & 1, b.p, numPositions);
+                key.t = globalIndex(f.t[k], (f.relative >> (3 + k)) & 1, b.t, numTexcoords);
+                key.n = globalIndex(f.n[k], (f.relative >> (6 + k)) & 1, b.n, numNormals);
+                badAttributes[i] += (key.t < 0 && f.t[k] != -1) + (key.n < 0 && f.n[k] != -1);
+                allNormals = allNormals && key.n >= 0;
+
+                if (key.p < 0)
+                {
+                    badPositions[i]++;
+                    key.p = 0;
+                }
+            }
+
+            for (int k = 0; k < 3; k++)
+            {
+                ObjVertexKey &key = keys[k];
+                if (!allNormals)
+                    key.n = -1; // flat shaded, zero normal
+
+                auto ins = vertexIds.insert(std::make_pair(key, (U32)verts.size()));
+                if (ins.second)
+                {
+                    VertexPNT v;
+                    v.p = positions[key.p];
+                    v.n = (key.n < 0) ? float3(0.0f) : normals[key.n];
+                    v.t = (key.t < 0) ? float3(0.0f) : float3(texcoords[key.t].x, texcoords[key.t].y, 0.0f);
+                    verts.push_back(v);
+                }
+                out->v[k] = ins.first->second; // chunk-local until merged
+            }
+
+            S32 slot = (f.material < 0) ? b.inheritedMaterial : b.materials[f.material];
+            out->matId = slot + 1; // -1 becomes 0 (default material)
+            out++;
+        }
+        std::vector<ObjFace>().swap(c.faces);
+    });
+
+    // Concatenate chunk vertices, offset the indices of their triangles
+    std::vector<size_t> vertexBases(numChunks + 1, 0);
+    for (size_t i = 0; i < numChunks; i++)
+        vertexBases[i + 1] = vertexBases[i] + chunkVertices[i].size();
+    if (vertexBases[numChunks] > 0xFFFFFFFFull)
+    {
+        std::cout << "OBJ loading failed: too many vertices" << std::endl;
+        return false;
+    }
+
+    data.mesh.vertices.resize(vertexBases[numChunks]);
+    pool.parallelFor((unsigned int)numChunks, [&](unsigned int i)
+    {
+        std::copy(chunkVertices[i].begin(), chunkVertices[i].end(), data.mesh.vertices.begin() + vertexBases[i]);
+        std::vector<VertexPNT>().swap(chunkVertices[i]);
+
+        const size_t first = bases[i].f;
+        const size_t last = (i + 1 < numChunks) ? bases[i + 1].f : numFaces;
+        const cl_uint offset = (cl_uint)vertexBases[i];
+        for (size_t t = first; t < last; t++)
+        {
+            IndexedTriangle &tri = data.mesh.triangles[t];
+            tri.v[0] += offset;
+            tri.v[1] += offset;
+            tri.v[2] += offset;
+        }
+    });
+
+    size_t numBadPositions = 0, numBadAttributes = 0;
+    for (size_t i = 0; i < numChunks; i++)
+    {
+        numBadPositions += badPositions[i];
+        numBadAttributes += badAttributes[i];
+    }
+    if (numBadPositions > 0)
+    {
+        std::cout << "OBJ loading failed: " << numBadPositions << " vertex indices out of range" << std::endl;
+        return false;
+    }
+    if (numBadAttributes > 0)
+        std::cout << "Warning: ignored " << numBadAttributes << " invalid normal or texcoord indices" << std::endl;
+    if (skipped > 0)
+        std::cout << "Warning: skipped " << skipped << " malformed lines" << std::endl;
+
+    // Shapes start at o/g statements and material changes
+    std::vector<size_t> starts(1, 0);
+    for (size_t i = 0; i < numChunks; i++)
+    {
+        for (U32 g : chunks[i].groups)
+            starts.push_back(bases[i].f + g);
+    }
+    starts.push_back(numFaces);
+
+    data.meshes.clear();
+    for (size_t i = 0; i + 1 < starts.size(); i++)
+    {
+        MeshRange range = { starts[i], starts[i + 1] - starts[i] };
+        if (range.count > 0)
+            data.meshes.push_back(range);
+    }
+
+    return true;
+}
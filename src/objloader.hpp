@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "scene.hpp"
+#include "rtutil.hpp"
+
+/*
+    Parallel OBJ parser for large meshes.
+    The memory mapped file is split into line-aligned chunks that are parsed
+    concurrently. Chunk results are merged with prefix sums over element counts,
+    which resolves relative (negative) indices and materials set in earlier chunks.
+    Polygons are fan-triangulated. Supports v, vt, vn, f, usemtl, mtllib, o and g, other statements are ignored.
+    Each distinct v/vt/vn combination of a chunk becomes one shared vertex.
+*/
+struct ObjData
+{
+    TriangleMesh mesh;                      // matId: index into materialNames + 1, 0 if unset
+    std::vector<MeshRange> meshes;          // one per non-empty o/g group
+    std::vector<std::string> materialNames; // usemtl names in order of first use
+    std::vector<std::string> materialLibs;  // mtllib file names, relative to the OBJ file
+};
+
+// Position, texcoord and normal indices of a face vertex, -1 for missing attributes
+struct ObjVertexKey
+{
+    int64_t p, t, n;
+    bool operator==(const ObjVertexKey &o) const { return p == o.p && t == o.t && n == o.n; }
+};
+
+struct ObjVertexKeyHash
+{
+    size_t operator()(const ObjVertexKey &k) const
+    {
+        U64 h = (U64)k.p * 0x9E3779B97F4A7C15ull;
+        h ^= (U64)k.t * 0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+        h ^= (U64)k.n * 0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+        return (size_t)h;
+    }
+};
+
+// Vertex index of each distinct key
+typedef std::unordered_map<ObjVertexKey, U32, ObjVertexKeyHash> ObjVertexMap;
+
+// Prints the reason and returns false on failure
+bool loadObjParallel(const std::string &filename, ObjData &data);
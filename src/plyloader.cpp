@@ -0,0 +1,563 @@
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include "plyloader.hpp"
+#include "mappedfile.hpp"
+#include "threadpool.hpp"
+#include "textparse.hpp"
+
+namespace
+{
+    enum PlyType { Ply_Int8, Ply_UInt8, Ply_Int16, Ply_UInt16, Ply_Int32, Ply_UInt32, Ply_Float32, Ply_Float64, Ply_None };
+    enum PlyFormat { Ply_Ascii, Ply_BinaryLE, Ply_BinaryBE };
+
+    enum
+    {
+        VertexBatch = 1 << 16 // vertices per parallel task
+    };
+
+    struct PlyProperty
+    {
+        std::string name;
+        PlyType type;      // item type of lists
+        PlyType countType; // Ply_None for scalars
+        size_t offset;     // binary fixed-stride elements only
+    };
+
+    struct PlyElement
+    {
+        std::string name;
+        size_t count;
+        std::vector<PlyProperty> props;
+        size_t stride; // binary size, 0 if the element has list properties
+    };
+
+    PlyType parseType(const std::string &s)
+    {
+        if (s == "char" || s == "int8") return Ply_Int8;
+        if (s == "uchar" || s == "uint8") return Ply_UInt8;
+        if (s == "short" || s == "int16") return Ply_Int16;
+        if (s == "ushort" || s == "uint16") return Ply_UInt16;
+        if (s == "int" || s == "int32") return Ply_Int32;
+        if (s == "uint" || s == "uint32") return Ply_UInt32;
+        if (s == "float" || s == "float32") return Ply_Float32;
+        if (s == "double" || s == "float64") return Ply_Float64;
+        return Ply_None;
+    }
+
+    inline size_t typeSize(PlyType t)
+    {
+        static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+        return sizes[t];
+    }
+
+    inline bool isFloatType(PlyType t)
+    {
+        return t == Ply_Float32 || t == Ply_Float64;
+    }
+
+    template<class T>
+    inline double loadAs(const U8 *b)
+    {
+        T v;
+        memcpy(&v, b, sizeof(T));
+        return (double)v;
+    }
+
+    // Binary scalar, swap: file byte order differs from host
+    inline double readBinary(const U8 *p, PlyType type, bool swap)
+    {
+        U8 b[8];
+        size_t n = typeSize(type);
+        memcpy(b, p, n);
+        if (swap)
+            std::reverse(b, b + n);
+
+        switch (type)
+        {
+        case Ply_Int8:    return loadAs<int8_t>(b);
+        case Ply_UInt8:   return loadAs<uint8_t>(b);
+        case Ply_Int16:   return loadAs<int16_t>(b);
+        case Ply_UInt16:  return loadAs<uint16_t>(b);
+        case Ply_Int32:   return loadAs<int32_t>(b);
+        case Ply_UInt32:  return loadAs<uint32_t>(b);
+        case Ply_Float32: return loadAs<float>(b);
+        case Ply_Float64: return loadAs<double>(b);
+        default:          return 0.0;
+        }
+    }
+
+    bool fail(const std::string &msg)
+    {
+        std::cout << "PLY: " << msg << std::endl;
+        return false;
+    }
+
+    bool parseHeader(const char *begin, const char *end, PlyFormat &format, std::vector<PlyElement> &elements, const char *&body)
+    {
+        const char *p = begin;
+        bool hasFormat = false;
+
+        for (bool first = true; p < end; first = false)
+        {
+            const char *s = p;
+            skipLine(p, end);
+            std::istringstream iss(std::string(s, p));
+            std::string keyword;
+            iss >> keyword;
+
+            if (first && keyword != "ply")
+                return fail("not a PLY file");
+
+            if (keyword == "format")
+            {
+                std::string f;
+                iss >> f;
+                if (f == "ascii") format = Ply_Ascii;
+                else if (f == "binary_little_endian") format = Ply_BinaryLE;
+                else if (f == "binary_big_endian") format = Ply_BinaryBE;
+                else return fail("unknown format " + f);
+                hasFormat = true;
+            }
+            else if (keyword == "element")
+            {
+                PlyElement e;
+                iss >> e.name >> e.count;
+                if (iss.fail())
+                    return fail("invalid element");
+                elements.push_back(e);
+            }
+            else if (keyword == "property")
+            {
+                if (elements.empty())
+                    return fail("property without element");
+
+                PlyProperty prop;
+                std::string type;
+                iss >> type;
+                if (type == "list")
+                {
+                    std::string countType, itemType;
+                    iss >> countType >> itemType >> prop.name;
+                    prop.countType = parseType(countType);
+                    prop.type = parseType(itemType);
+                    if (prop.countType == Ply_None || isFloatType(prop.countType))
+                        return fail("invalid list count type " + countType);
+                }
+                else
+                {
+                    prop.countType = Ply_None;
+                    prop.type = parseType(type);
+                    iss >> prop.name;
+                }
+                if (prop.type == Ply_None)
+                    return fail("unknown property type in '" + std::string(s, p - 1) + "'");
+                elements.back().props.push_back(prop);
+            }
+            else if (keyword == "end_header")
+            {
+                body = p;
+                if (!hasFormat)
+                    return fail("missing format");
+                break;
+            }
+        }
+
+        if (!body)
+            return fail("missing end_header");
+
+        // Binary layout of fixed-size elements
+        for (PlyElement &e : elements)
+        {
+            e.stride = 0;
+            bool fixed = true;
+            for (PlyProperty &prop : e.props)
+            {
+                prop.offset = e.stride;
+                e.stride += typeSize(prop.type);
+                fixed = fixed && prop.countType == Ply_None;
+            }
+            if (!fixed)
+                e.stride = 0;
+        }
+
+        return true;
+    }
+
+    // Locations of the properties of one binary element instance, returns false if out of bounds
+    struct BinaryItem
+    {
+        std::vector<const U8*> ptr;  // scalar value or first list item
+        std::vector<size_t> count;   // list length, 1 for scalars
+    };
+
+    bool walkBinary(const U8 *&p, const U8 *end, const PlyElement &e, bool swap, BinaryItem &item)
+    {
+        item.ptr.resize(e.props.size());
+        item.count.resize(e.props.size());
+        for (size_t k = 0; k < e.props.size(); k++)
+        {
+            const PlyProperty &prop = e.props[k];
+            size_t n = 1;
+            if (prop.countType != Ply_None)
+            {
+                size_t cs = typeSize(prop.countType);
+                if ((size_t)(end - p) < cs)
+                    return false;
+                double c = readBinary(p, prop.countType, swap);
+                if (c < 0.0)
+                    return false;
+                n = (size_t)c;
+                p += cs;
+            }
+            size_t bytes = n * typeSize(prop.type);
+            if ((size_t)(end - p) < bytes)
+                return false;
+            item.ptr[k] = p;
+            item.count[k] = n;
+            p += bytes;
+        }
+        return true;
+    }
+
+    inline float &component(float3 &v, int axis)
+    {
+        return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+    }
+
+    // Fan triangulation of a polygon, returns false if degenerate
+    inline bool addPolygon(const std::vector<U32> &poly, std::vector<U32> &indices)
+    {
+        for (size_t i = 2; i < poly.size(); i++)
+        {
+            indices.push_back(poly[0]);
+            indices.push_back(poly[i - 1]);
+            indices.push_back(poly[i]);
+        }
+        return poly.size() >= 3;
+    }
+
+    // Property index by name, -1 if missing
+    int findProperty(const PlyElement &e, const char *name)
+    {
+        for (size_t k = 0; k < e.props.size(); k++)
+        {
+            if (e.props[k].name == name)
+                return (int)k;
+        }
+        return -1;
+    }
+
+    int findFaceList(const PlyElement &e)
+    {
+        int k = findProperty(e, "vertex_indices");
+        if (k < 0) k = findProperty(e, "vertex_index");
+        return (k >= 0 && e.props[k].countType != Ply_None) ? k : -1;
+    }
+
+    // Vertex attributes: slot of each property (0-2 position, 3-5 normal, -1 unused)
+    std::vector<int> vertexSlots(const PlyElement &e, bool &hasNormals)
+    {
+        static const char *names[] = { "x", "y", "z", "nx", "ny", "nz" };
+        std::vector<int> slots(e.props.size(), -1);
+        int found = 0;
+        for (int s = 0; s < 6; s++)
+        {
+            int k = findProperty(e, names[s]);
+            if (k >= 0 && e.props[k].countType == Ply_None)
+            {
+                slots[k] = s;
+                found |= 1 << s;
+            }
+        }
+        hasNormals = (found & 0x38) == 0x38;
+        if (!hasNormals)
+        {
+            for (int &s : slots)
+                if (s >= 3) s = -1;
+        }
+        return (found & 0x7) == 0x7 ? slots : std::vector<int>();
+    }
+
+    bool readBinaryVertices(const U8 *&p, const U8 *end, const PlyElement &e, bool swap, PlyData &data)
+    {
+        bool hasNormals;
+        std::vector<int> slots = vertexSlots(e, hasNormals);
+        if (slots.empty())
+            return fail("vertex element without x, y, z");
+
+        data.positions.resize(e.count);
+        data.normals.resize(hasNormals ? e.count : 0);
+
+        if (e.stride == 0)
+        {
+            // Variable size, sequential walk
+            BinaryItem item;
+            for (size_t i = 0; i < e.count; i++)
+            {
+                if (!walkBinary(p, end, e, swap, item))
+                    return fail("unexpected end of file in vertex data");
+                for (size_t k = 0; k < slots.size(); k++)
+                {
+                    if (slots[k] < 0) continue;
+                    float3 &dst = (slots[k] < 3) ? data.positions[i] : data.normals[i];
+                    component(dst, slots[k] % 3) = (float)readBinary(item.ptr[k], e.props[k].type, swap);
+                }
+            }
+            return true;
+        }
+
+        if ((size_t)(end - p) / e.stride < e.count)
+            return fail("unexpected end of file in vertex data");
+
+        // Offset of x and nx if the triplets are consecutive floats in host order
+        size_t offsets[6];
+        PlyType types[6];
+        for (size_t k = 0; k < slots.size(); k++)
+        {
+            if (slots[k] < 0) continue;
+            offsets[slots[k]] = e.props[k].offset;
+            types[slots[k]] = e.props[k].type;
+        }
+        auto packed = [&](int s)
+        {
+            return !swap && types[s] == Ply_Float32 && types[s + 1] == Ply_Float32 && types[s + 2] == Ply_Float32 &&
+                offsets[s + 1] == offsets[s] + 4 && offsets[s + 2] == offsets[s] + 8;
+        };
+        const bool packedPositions = packed(0);
+        const bool packedNormals = hasNormals && packed(3);
+
+        const U8 *base = p;
+        const size_t numBatches = (e.count + VertexBatch - 1) / VertexBatch;
+        ThreadPool::getInstance().parallelFor((unsigned int)numBatches, [&](unsigned int b)
+        {
+            size_t iEnd = std::min(e.count, (size_t)(b + 1) * VertexBatch);
+            for (size_t i = (size_t)b * VertexBatch; i < iEnd; i++)
+            {
+                const U8 *v = base + i * e.stride;
+                float3 &pos = data.positions[i];
+                if (packedPositions)
+                    memcpy(&pos.x, v + offsets[0], 3 * sizeof(float));
+                else
+                    pos = float3((float)readBinary(v + offsets[0], types[0], swap),
+                                 (float)readBinary(v + offsets[1], types[1], swap),
+                                 (float)readBinary(v + offsets[2], types[2], swap));
+
+                if (!hasNormals)
+                    continue;
+
+                float3 &n = data.normals[i];
+                if (packedNormals)
+                    memcpy(&n.x, v + offsets[3], 3 * sizeof(float));
+                else
+                    n = float3((float)readBinary(v + offsets[3], types[3], swap),
+                               (float)readBinary(v + offsets[4], types[4], swap),
+                               (float)readBinary(v + offsets[5], types[5], swap));
+            }
+        });
+
+        p += e.count * e.stride;
+        return true;
+    }
+
+    bool readBinaryFaces(const U8 *&p, const U8 *end, const PlyElement &e, bool swap, PlyData &data)
+    {
+        int list = findFaceList(e);
+        if (list < 0)
+            return fail("face element without vertex_indices");
+
+        const PlyType type = e.props[list].type;
+        const size_t size = typeSize(type);
+        const bool direct = !swap && (type == Ply_Int32 || type == Ply_UInt32);
+
+        data.indices.reserve(data.indices.size() + 3 * e.count);
+        std::vector<U32> poly;
+        BinaryItem item;
+        size_t degenerate = 0;
+        for (size_t i = 0; i < e.count; i++)
+        {
+            if (!walkBinary(p, end, e, swap, item))
+                return fail("unexpected end of file in face data");
+
+            poly.resize(item.count[list]);
+            if (direct)
+                memcpy(poly.data(), item.ptr[list], poly.size() * sizeof(U32));
+            else
+                for (size_t j = 0; j < poly.size(); j++)
+                    poly[j] = (U32)readBinary(item.ptr[list] + j * size, type, swap);
+
+            degenerate += !addPolygon(poly, data.indices);
+        }
+
+        if (degenerate > 0)
+            std::cout << "PLY: skipped " << degenerate << " faces with less than three vertices" << std::endl;
+        return true;
+    }
+
+    bool skipBinary(const U8 *&p, const U8 *end, const PlyElement &e, bool swap)
+    {
+        if (e.stride > 0)
+        {
+            if ((size_t)(end - p) / e.stride < e.count)
+                return fail("unexpected end of file in " + e.name);
+            p += e.count * e.stride;
+            return true;
+        }
+
+        BinaryItem item;
+        for (size_t i = 0; i < e.count; i++)
+        {
+            if (!walkBinary(p, end, e, swap, item))
+                return fail("unexpected end of file in " + e.name);
+        }
+        return true;
+    }
+
+    // One line per element instance, properties in header order
+    bool readAscii(const char *&p, const char *end, const PlyElement &e, PlyData &data)
+    {
+        const bool isVertex = (e.name == "vertex");
+        const bool isFace = (e.name == "face");
+        bool hasNormals = false;
+        std::vector<int> slots;
+        int list = -1;
+
+        if (isVertex)
+        {
+            slots = vertexSlots(e, hasNormals);
+            if (slots.empty())
+                return fail("vertex element without x, y, z");
+            data.positions.resize(e.count);
+            data.normals.resize(hasNormals ? e.count : 0);
+        }
+        else if (isFace)
+        {
+            list = findFaceList(e);
+            if (list < 0)
+                return fail("face element without vertex_indices");
+            data.indices.reserve(data.indices.size() + 3 * e.count);
+        }
+        else
+        {
+            for (size_t i = 0; i < e.count && p < end; i++)
+                skipLine(p, end);
+            return true;
+        }
+
+        std::vector<U32> poly;
+        size_t degenerate = 0;
+        for (size_t i = 0; i < e.count; i++)
+        {
+            if (p >= end)
+                return fail("unexpected end of file in " + e.name);
+
+            for (size_t k = 0; k < e.props.size(); k++)
+            {
+                const PlyProperty &prop = e.props[k];
+                float value;
+                if (prop.countType == Ply_None)
+                {
+                    if (!parseFloat(p, end, value))
+                        return fail("invalid value in " + e.name);
+                    if (isVertex && slots[k] >= 0)
+                    {
+                        float3 &dst = (slots[k] < 3) ? data.positions[i] : data.normals[i];
+                        component(dst, slots[k] % 3) = value;
+                    }
+                    continue;
+                }
+
+                S32 n;
+                skipBlank(p, end);
+                if (!parseInt(p, end, n) || n < 0)
+                    return fail("invalid list length in " + e.name);
+
+                poly.clear();
+                for (S32 j = 0; j < n; j++)
+                {
+                    S32 index;
+                    skipBlank(p, end);
+                    if (isFace && (int)k == list && !isFloatType(prop.type))
+                    {
+                        if (!parseInt(p, end, index))
+                            return fail("invalid vertex index");
+                        poly.push_back((U32)index);
+                    }
+                    else if (!parseFloat(p, end, value))
+                    {
+                        return fail("invalid list item in " + e.name);
+                    }
+                }
+                if (isFace && (int)k == list)
+                    degenerate += !addPolygon(poly, data.indices);
+            }
+            skipLine(p, end);
+        }
+
+        if (degenerate > 0)
+            std::cout << "PLY: skipped " << degenerate << " faces with less than three vertices" << std::endl;
+        return true;
+    }
+}
+
+bool loadPly(const std::string &filename, PlyData &data)
+{
+    MappedFile file;
+    if (!file.open(filename))
+        return fail("could not open " + filename);
+
+    const char *begin = (const char*)file.data();
+    const char *end = begin + file.size();
+
+    PlyFormat format = Ply_Ascii;
+    std::vector<PlyElement> elements;
+    const char *body = nullptr;
+    if (!parseHeader(begin, end, format, elements, body))
+        return false;
+
+    const uint16_t one = 1;
+    const bool hostLittleEndian = *(const U8*)&one == 1;
+    const bool swap = (format == Ply_BinaryLE) != hostLittleEndian;
+
+    data = PlyData();
+    const char *p = body;
+    for (const PlyElement &e : elements)
+    {
+        if (e.name == "vertex" && !data.positions.empty())
+            return fail("multiple vertex elements");
+        if (e.name == "vertex" || e.name == "face")
+            std::cout << "Reading " << e.count << " " << e.name << " elements" << std::endl;
+        else
+            std::cout << "Skipping element of type " << e.name << std::endl;
+
+        bool ok;
+        if (format == Ply_Ascii)
+        {
+            ok = readAscii(p, end, e, data);
+        }
+        else
+        {
+            const U8 *q = (const U8*)p;
+            if (e.name == "vertex")
+                ok = readBinaryVertices(q, (const U8*)end, e, swap, data);
+            else if (e.name == "face")
+                ok = readBinaryFaces(q, (const U8*)end, e, swap, data);
+            else
+                ok = skipBinary(q, (const U8*)end, e, swap);
+            p = (const char*)q;
+        }
+
+        if (!ok)
+            return false;
+    }
+
+    const size_t numVertices = data.positions.size();
+    for (U32 i : data.indices)
+    {
+        if (i >= numVertices)
+            return fail("vertex index out of range");
+    }
+
+    return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "rtutil.hpp"
+
+/*
+    PLY reader for ascii, binary_little_endian and binary_big_endian files.
+    Property offsets and types are resolved from the header once. Binary vertex
+    data with a fixed stride is decoded in parallel from the memory mapping,
+    with plain copies when x, y, z (and nx, ny, nz) are consecutive floats in host
+    byte order. Other elements are skipped. Polygons are fan-triangulated.
+*/
+struct PlyData
+{
+    std::vector<float3> positions;
+    std::vector<float3> normals; // empty if the file has none, else one per position
+    std::vector<U32> indices;    // three per triangle
+};
+
+// Prints the reason and returns false on failure
+bool loadPly(const std::string &filename, PlyData &data);
@@ -4,6 +4,7 @@
 #include "triangle.hpp"
 #include "math/float3.hpp"
 #include <iostream>
+#include <string>
 #include <cfloat>
 
 using FireRays::float3;
@@ -11,6 +12,7 @@ using FireRays::float4;
 
 // TODO: remove these!
 typedef cl_uint U32;
+typedef cl_ulong U64;
 typedef cl_int S32;
 typedef cl_float F32;
 typedef cl_uchar U8;
@@ -18,9 +20,61 @@ typedef cl_uchar U8;
 enum SplitMode {
 	SplitMode_SpatialMedian,
 	SplitMode_ObjectMedian,
-	SplitMode_Sah
+	SplitMode_Sah,
+	SplitMode_SahBinned,
+	SplitMode_LBVH
 };
 
+inline const char* splitModeName(SplitMode mode) {
+	switch (mode) {
+	case SplitMode_SpatialMedian: return "Spatial Median";
+	case SplitMode_ObjectMedian: return "Object Median";
+	case SplitMode_Sah: return "SAH";
+	case SplitMode_SahBinned: return "Binned SAH";
+	case SplitMode_LBVH: return "LBVH";
+	default: return "Unknown";
+	}
+}
+
+// Names used in settings.json, full sweep SAH by default
+inline SplitMode parseSplitMode(const std::string &name) {
+	if (name == "spatial_median") return SplitMode_SpatialMedian;
+	if (name == "object_median") return SplitMode_ObjectMedian;
+	if (name == "sah_binned") return SplitMode_SahBinned;
+	if (name == "lbvh") return SplitMode_LBVH;
+	if (name != "sah")
+		std::cout << "WARN: Unknown split mode '" << name << "', using sah (expected sah, sah_binned, object_median, spatial_median or lbvh)" << std::endl;
+	return SplitMode_Sah;
+}
+
+// Storage order of traversal nodes, see nodelayout.hpp
+enum NodeLayout {
+	NodeLayout_DepthFirst,
+	NodeLayout_BreadthFirst,
+	NodeLayout_VanEmdeBoas,
+	NodeLayout_Probability
+};
+
+inline const char* nodeLayoutName(NodeLayout layout) {
+	switch (layout) {
+	case NodeLayout_DepthFirst: return "Depth-first";
+	case NodeLayout_BreadthFirst: return "Breadth-first top levels";
+	case NodeLayout_VanEmdeBoas: return "van Emde Boas";
+	case NodeLayout_Probability: return "Probability-ordered depth-first";
+	default: return "Unknown";
+	}
+}
+
+// Names used in settings.json, depth-first by default
+inline NodeLayout parseNodeLayout(const std::string &name) {
+	if (name == "bfs") return NodeLayout_BreadthFirst;
+	if (name == "veb") return NodeLayout_VanEmdeBoas;
+	if (name == "sah") return NodeLayout_Probability;
+	if (name != "dfs")
+		std::cout << "WARN: Unknown node layout '" << name << "', using dfs (expected dfs, bfs, veb or sah)" << std::endl;
+	return NodeLayout_DepthFirst;
+}
+
 struct AABB_t {
     float3 min, max;
     inline AABB_t() : min(FLT_MAX), max(-FLT_MAX) {}
@@ -43,6 +97,10 @@ struct AABB_t {
 		min = vmin(min, t.min());
 		max = vmax(max, t.max());
 	}
+	inline void expand(const TriangleMesh &mesh, size_t tri) {
+		min = vmin(min, mesh.min(tri));
+		max = vmax(max, mesh.max(tri));
+	}
 	inline void expand(const AABB_t &box) {
 		min = vmin(min, box.min);
 		max = vmax(max, box.max);
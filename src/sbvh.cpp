@@ -1,37 +1,82 @@
+#include <algorithm>
+#include <iterator>
 #include "sbvh.hpp"
 #include "progressview.hpp"
+#include "threadpool.hpp"
+#include "spatialbins.hpp"
+#include "settings.hpp"
 
-SBVH::SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progressView)
+// Stable partition of the refs above 'start', returns size of left group
+template<typename Pred>
+static int stablePartition(std::vector<TriRef> &refs, int start, std::vector<TriRef> &scratch, Pred goesLeft)
+{
+	scratch.clear();
+	int out = start;
+	for (int i = start; i < (int)refs.size(); i++)
+	{
+		if (goesLeft(refs[i]))
+			refs[out++] = refs[i];
+		else
+			scratch.push_back(refs[i]);
+	}
+
+	std::copy(scratch.begin(), scratch.end(), refs.begin() + out);
+	return out - start;
+}
+
+SBVH::SBVH(TriangleMesh *tris, SplitMode mode, ProgressView *progressView, const std::atomic<bool> *cancelFlag)
 {
 	m_triangles = tris;
+	m_mode = mode;
+	recordBuildInfo(HierarchyBuilder_SBVH, 0);
 	progress = progressView;
-
-	NodeSpec rootSpec;
-	rootSpec.refs = tris->size();
+	progressThread = std::this_thread::get_id();
+	cancel = cancelFlag;
 
 	// Setup references. New ones are added (splitting)
 	// and removed (leaf node creation) during building
-	m_refs.resize(rootSpec.refs);
+	BuildFragment root;
+	root.spec.refs = tris->size();
+	root.refs[0].resize(root.spec.refs);
 	for (int i = 0; i < m_triangles->size(); i++)
 	{
-		m_refs[i] = TriRef(i, (*m_triangles)[i]);
-		rootSpec.box.expand(m_refs[i].box);
+		root.refs[0][i] = TriRef(i, *m_triangles);
+		root.spec.box.expand(root.refs[0][i].box());
 	}
 
-	// Shared vector to avoid reallocations
-	rightBoxes.resize(std::max(m_triangles->size(), (size_t)NumSpatialBins) - 1);
-	minOverlap = rootSpec.box.area() * splitAlpha;
+	splitAlpha = Settings::getInstance().getBvhSplitAlpha();
+	minOverlap = root.spec.box.area() * splitAlpha;
+	spatialBins = std::max(2, std::min((S32)MaxSpatialBins, (S32)Settings::getInstance().getBvhSpatialBins()));
 
-	// Perform building
-	SBVHNode* root = build(rootSpec, 0, 0.0f, 1.0f);
-	printf("\rSBVH builder: progress 100%% (%.2f%% duplicates)\n", metrics.duplicates * 100.0f / m_triangles->size());
-
-	// Indices relative to LAST triangle => reverse
-	std::reverse(m_indices.begin(), m_indices.end());
+	// The only full sorts of the build
+	ThreadPool &pool = ThreadPool::getInstance();
+	TaskGroup tasks;
+	root.refs[1] = root.refs[0];
+	root.refs[2] = root.refs[0];
+	for (U32 dim = 0; dim < 3; dim++)
+	{
+		std::vector<TriRef> *refs = &root.refs[dim];
+		pool.submit(tasks, [refs, dim]() { std::sort(refs->begin(), refs->end(), [dim](const TriRef &r1, const TriRef &r2) { return centroidLess(r1, r2, dim); }); });
+	}
+	pool.wait(tasks);
 
-	// Convert tree structure to small node vector
-	convertTree(root, -1);
-	root->deleteTree();
+	// Perform building
+	pool.submit(tasks, [this, &root, &tasks]() { buildFragment(root, 0, 0.0f, 1.0f, tasks); });
+	pool.wait(tasks);
+	if (buildCancelled())
+	{
+		releaseFragment(root);
+		std::cout << "SBVH build cancelled" << std::endl;
+		return;
+	}
+	printf("\rSBVH builder: progress 100%% (%.2f%% duplicates, %u threads)\n", metrics.duplicates * 100.0f / m_triangles->size(), pool.getNumThreads());
+
+	// Convert tree structure to small node vector.
+	// Leaf indices are gathered left to right.
+	m_indices.reserve(m_triangles->size() + metrics.duplicates);
+	convertFragment(root, -1);
+	allocBuildMemory(vectorBytes(m_nodes) + vectorBytes(m_indices));
+	releaseFragment(root);
 	assert(metrics.depth <= MaxDepth);
 	assert(m_indices.size() >= m_triangles->size());
 
@@ -40,16 +85,51 @@ SBVH::SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progress
 	
 	std::cout
 		<< "======================" << std::endl
-		<< "SBVH" << std::endl
+		<< "SBVH (" << splitModeName(m_mode) << ")" << std::endl
 		<< "Splits: " << metrics.splits << " (" << int(metrics.bad_splits / float(metrics.splits) * 100.0f) << "% bad)" << std::endl
 		<< "Depth: " << metrics.depth << std::endl
 		<< "Leaves: " << metrics.splits + 1 << std::endl
 		<< "Duplicates: " << metrics.duplicates << " (" << int(metrics.duplicates * 100.0f / m_triangles->size()) << "%)" << std::endl
+		<< "Peak build memory: " << buildMemoryMiB() << " MiB" << std::endl
+		<< "Spatial binning: " << clipImplementationName() << std::endl
 		<< "======================" << std::endl;
 }
 
+// Fragments in depth-first order, same layout as a serial build
+void SBVH::convertFragment(const BuildFragment &frag, S32 parentId)
+{
+	if (!frag.left)
+	{
+		convertTree(frag, frag.root, parentId);
+		return;
+	}
+
+	U32 ind = m_nodes.size();
+	m_nodes.push_back(Node());
+	m_nodes[ind].box = frag.spec.box;
+	m_nodes[ind].parent = parentId;
+	m_nodes[ind].leftChild = ind + 1;
+	convertFragment(*frag.left, ind);
+	m_nodes[ind].rightChild = m_nodes.size(); // save current vector size
+	convertFragment(*frag.right, ind);
+}
+
+// Build nodes are no longer needed after conversion
+void SBVH::releaseFragment(BuildFragment &frag)
+{
+	frag.root = nullptr;
+	frag.nodes.release();
+	std::vector<U32>().swap(frag.indices);
+	trackMemory(frag);
+	if (frag.left)
+	{
+		releaseFragment(*frag.left);
+		releaseFragment(*frag.right);
+	}
+}
+
 // Convert pointer tree to linear node vector
-void SBVH::convertTree(SBVHNode *node, S32 parentId)
+void SBVH::convertTree(const BuildFragment &frag, SBVHNode *node, S32 parentId)
 {
 	U32 ind = m_nodes.size();
 	m_nodes.push_back(Node());
@@ -58,7 +138,8 @@ void SBVH::convertTree(SBVHNode *node, S32 parentId)
 
 	if (node->isLeaf())
 	{
-		m_nodes[ind].iStart = m_indices.size() - node->hi;
+		m_nodes[ind].iStart = m_indices.size();
+		m_indices.insert(m_indices.end(), frag.indices.begin() + node->lo, frag.indices.begin() + node->hi);
 		U32 sp = node->spannedTris();
 		if (sp > std::numeric_limits<U8>::max())
 			throw std::runtime_error("Too many prims to fit into U8!");
@@ -66,9 +147,10 @@ void SBVH::convertTree(SBVHNode *node, S32 parentId)
 	}
 	else
 	{
-		convertTree(node->leftChild, ind);
+		m_nodes[ind].leftChild = ind + 1;
+		convertTree(frag, node->leftChild, ind);
 		m_nodes[ind].rightChild = m_nodes.size(); // save current vector size
-		convertTree(node->rightChild, ind);
+		convertTree(frag, node->rightChild, ind);
 	}
 }
 
@@ -76,44 +158,141 @@ void SBVH::convertTree(SBVHNode *node, S32 parentId)
 void SBVH::lazyPrintBuildStatus(F32 progress)
 {
 	S32 percentage = S32(ceil(progress * 100.0f));
-	if (percentage > buildPercentage)
+	S32 prev = buildPercentage;
+	if (percentage > prev && buildPercentage.compare_exchange_strong(prev, percentage))
 	{
-		buildPercentage = percentage;
 		F32 duplicates = metrics.duplicates * 100.0f / m_triangles->size();
 		printf("\rSBVH builder: progress %d%% (%.2f%% duplicates)", percentage, duplicates);
+	}
+
+	if (progress && std::this_thread::get_id() == progressThread && percentage > progressShown)
+	{
+		progressShown = percentage;
 		this->progress->showMessage("Building SBVH", percentage / 100.0f);
 	}
 }
 
+// Finished subtrees contribute their share of the progress bar
+void SBVH::advanceProgress(F32 amount)
+{
+	F32 prev = progressDone;
+	while (!progressDone.compare_exchange_weak(prev, prev + amount)) {}
+	lazyPrintBuildStatus(prev + amount);
+}
+
 // Create leaf node. References are removed from stack.
-// Index list will be reversed after building to fix indexing.
-SBVHNode* SBVH::createLeaf(const NodeSpec& spec)
+SBVHNode* SBVH::createLeaf(BuildFragment &frag, const NodeSpec& spec)
+{
+	int lo = frag.indices.size();
+	for (auto it = frag.refs[0].end() - spec.refs; it != frag.refs[0].end(); it++)
+	{
+		frag.indices.push_back(it->ind);
+	}
+
+	for (U32 dim = 0; dim < 3; dim++)
+		frag.refs[dim].resize(frag.refs[dim].size() - spec.refs);
+	return frag.nodes.alloc(spec.box, lo, (int)frag.indices.size());
+}
+
+// Subtrees above the size threshold are split here and built as separate tasks.
+// The children get copies of their ref ranges, so they never share a stack.
+void SBVH::buildFragment(BuildFragment &frag, int depth, F32 progressStart, F32 progressEnd, TaskGroup &tasks)
 {
-	for (int i = 0; i < spec.refs; i++)
+	frag.rightAreas.resize(std::max(frag.spec.refs, spatialBins) - 1);
+	frag.nodes.reserve(frag.spec.refs); // typical node count, arena grows if needed
+	trackMemory(frag);
+
+	NodeSpec left, right;
+	if (frag.spec.refs <= ParallelBuildThreshold || buildCancelled() || !splitNode(frag, frag.spec, depth, left, right))
+	{
+		frag.root = build(frag, frag.spec, depth, progressStart, progressEnd); // null if cancelled
+		assert(frag.refs[0].empty() || buildCancelled());
+	}
+	else
+	{
+		atomicMax(metrics.depth, (U32)depth);
+		F32 progressMid = lerp(progressStart, progressEnd, (F32)right.refs / (F32)(left.refs + right.refs));
+
+		// Left refs at the bottom of the stack, right refs (and duplicates) on top
+		frag.left.reset(new BuildFragment());
+		frag.left->spec = left;
+		frag.right.reset(new BuildFragment());
+		frag.right->spec = right;
+		for (U32 dim = 0; dim < 3; dim++)
+		{
+			const std::vector<TriRef> &refs = frag.refs[dim];
+			frag.left->refs[dim].assign(refs.begin(), refs.begin() + left.refs);
+			frag.right->refs[dim].assign(refs.end() - right.refs, refs.end());
+		}
+		assert(left.refs + right.refs == frag.refs[0].size());
+
+		BuildFragment *lfrag = frag.left.get();
+		BuildFragment *rfrag = frag.right.get();
+		ThreadPool &pool = ThreadPool::getInstance();
+		pool.submit(tasks, [this, lfrag, depth, progressMid, progressEnd, &tasks]() { buildFragment(*lfrag, depth + 1, progressMid, progressEnd, tasks); });
+		pool.submit(tasks, [this, rfrag, depth, progressStart, progressMid, &tasks]() { buildFragment(*rfrag, depth + 1, progressStart, progressMid, tasks); });
+	}
+
+	// Scratch space no longer needed
+	for (U32 dim = 0; dim < 3; dim++)
+		std::vector<TriRef>().swap(frag.refs[dim]);
+	std::vector<TriRef>().swap(frag.scratch);
+	for (U32 side = 0; side < 2; side++)
 	{
-		TriRef last = m_refs.back();
-		m_refs.pop_back();
-		m_indices.push_back(last.ind);
+		std::vector<TriRef>().swap(frag.kept[side]);
+		std::vector<TriRef>().swap(frag.clipped[side]);
 	}
+	std::vector<SpatialDecision>().swap(frag.decisions);
+	std::vector<F32>().swap(frag.rightAreas);
+	trackMemory(frag);
+}
 
-	int start = m_indices.size() - spec.refs;
-	int end = m_indices.size();
-	return new SBVHNode(spec.box, start, end);
+// Reports growth (duplicates, scratch buffers, nodes) or release of fragment memory
+void SBVH::trackMemory(BuildFragment &frag)
+{
+	size_t bytes = frag.bytes();
+	if (bytes > frag.trackedBytes)
+		allocBuildMemory(bytes - frag.trackedBytes);
+	else
+		freeBuildMemory(frag.trackedBytes - bytes);
+	frag.trackedBytes = bytes;
 }
 
 // SBVH construction algorithm, in line with Stich et al. chapter 4.1
-SBVHNode* SBVH::build(NodeSpec &spec, int depth, F32 progressStart, F32 progressEnd)
+SBVHNode* SBVH::build(BuildFragment &frag, NodeSpec &spec, int depth, F32 progressStart, F32 progressEnd)
 {
-	lazyPrintBuildStatus(progressStart);
-	metrics.depth = std::max(metrics.depth, (U32)depth);
+	if (buildCancelled())
+		return nullptr; // tree is discarded
+
+	atomicMax(metrics.depth, (U32)depth);
+
+	NodeSpec left, right;
+	if (!splitNode(frag, spec, depth, left, right))
+	{
+		advanceProgress(progressEnd - progressStart);
+		return createLeaf(frag, spec);
+	}
+
+	trackMemory(frag);
+	F32 progressMid = lerp(progressStart, progressEnd, (F32)right.refs / (F32)(left.refs + right.refs));
 
+	// Built from right to left (so that duplicates can be added to end of ref list)
+	SBVHNode* rightNode = build(frag, right, depth + 1, progressStart, progressMid);
+	SBVHNode* leftNode = build(frag, left, depth + 1, progressMid, progressEnd);
+
+	return frag.nodes.alloc(spec.box, leftNode, rightNode);
+}
+
+// Select and perform split of node, false if node should become a leaf
+bool SBVH::splitNode(BuildFragment &frag, const NodeSpec &spec, int depth, NodeSpec &left, NodeSpec &right)
+{
 	if (spec.refs <= MinLeafElems || depth >= MaxDepth)
-		return createLeaf(spec);
+		return false;
 
 	// 1. Find object split candidate using full SAH search
 	F32 parentArea = spec.box.area();
-	F32 nodeSAH = parentArea * 2 * 1;
-	SplitInfo objectSplit = sahSplit(spec, nodeSAH);
+	F32 nodeSAH = parentArea * 2 * sahParams.costBox;
+	SplitInfo objectSplit = sahSplit(frag, spec, nodeSAH);
 
 	// 2. Find spatial split candidate using chopped binning
 	SplitInfo spatialSplit;
@@ -122,7 +301,7 @@ SBVHNode* SBVH::build(NodeSpec &spec, int depth, F32 progressStart, F32 progress
 		AABB_t overlap = objectSplit.leftBounds;
 		overlap.intersect(objectSplit.rightBounds);
 		if (overlap.area() >= minOverlap)
-			spatialSplit = binSplit(spec, nodeSAH);
+			spatialSplit = binSplit(frag, spec, nodeSAH);
 	}
 
 	// 3. Select the winner candidate
@@ -130,46 +309,50 @@ SBVHNode* SBVH::build(NodeSpec &spec, int depth, F32 progressStart, F32 progress
 	F32 minCost = std::min(objectSplit.cost, std::min(spatialSplit.cost, parentCost));
 
 	// Check if parent is cheaper (SAH)
-	if (minCost == parentCost && spec.refs <= MaxLeafElems)
+	if (minCost == parentCost && spec.refs <= m_maxLeafElems)
 	{
 		assert(spec.refs <= std::numeric_limits<U8>::max());
-		return createLeaf(spec);
+		return false;
 	}
 
 	// Perform partitioning
-	NodeSpec left, right;
 	if (minCost == spatialSplit.cost)
-		partitionSpatial(left, right, spec, spatialSplit);
+		partitionSpatial(frag, left, right, spec, spatialSplit);
 	if (!left.refs || !right.refs)
-		partitionObject(left, right, spec, objectSplit);
+		partitionObject(frag, left, right, spec, objectSplit);
 
 	metrics.splits++;
-
-	// Create inner node.
 	metrics.duplicates += left.refs + right.refs - spec.refs;
-	F32 progressMid = lerp(progressStart, progressEnd, (F32)right.refs / (F32)(left.refs + right.refs));
 
-	// Built from right to left (so that duplicates can be added to end of ref list)
-	SBVHNode* rightNode = build(right, depth + 1, progressStart, progressMid);
-	SBVHNode* leftNode = build(left, depth + 1, progressMid, progressEnd);
-
-	return new SBVHNode(spec.box, leftNode, rightNode);
+	return true;
 }
 
-BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
+BVH::SplitInfo SBVH::sahSplit(BuildFragment &frag, const NodeSpec& spec, F32 nodeSAH)
 {
 	F32 bestTieBreak = FLT_MAX;
 	SplitInfo info;
 
 	// Rightmost N references
-	int start = m_refs.size() - spec.refs;
-	int end = m_refs.size() - 1;
+	std::vector<F32> &rightAreas = frag.rightAreas;
+	int start = frag.refs[0].size() - spec.refs;
+	int end = frag.refs[0].size() - 1;
+
+	// Binned search, unless all centroids coincide
+	if (m_mode == SplitMode_SahBinned)
+	{
+		info = findBinnedSplit(frag.refs[0], start, end);
+		if (info.bin > -1)
+		{
+			info.cost = nodeSAH + info.cost * sahParams.costTri;
+			return info;
+		}
+	}
 
 	// Loop over all three axes to find best split
 	for (U32 dim = 0; dim < 3; dim++)
 	{
-		// Sort along axis
-		sortReferences(start, end, dim);
+		// Already sorted along axis
+		const std::vector<TriRef> &refs = frag.refs[dim];
 
 		// Create AABB lookup
 		//buildBoxLookup(n);
@@ -177,8 +360,8 @@ BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
 		AABB_t rightBounds;
 		for (int i = spec.refs - 1; i > 0; i--)
 		{
-			rightBounds.expand(m_refs[start + i].box);
-			rightBoxes[i - 1] = rightBounds; // use relative indexing (doesn't grow too large)
+			rightBounds.expand(refs[start + i].box());
+			rightAreas[i - 1] = rightBounds.area(); // use relative indexing (doesn't grow too large)
 		}
 
 		AABB_t leftBox;
@@ -187,11 +370,10 @@ BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
 		// Try different split points along axis
 		for (int i = 1; i < spec.refs; i++) // exclude first and last
 		{
-			leftBox.expand(m_refs[start + i - 1].box);
+			leftBox.expand(refs[start + i - 1].box());
 			leftCount++;
 
-			AABB_t &rightBox = rightBoxes[i - 1];
-			F32 areaRight = rightBox.area();
+			F32 areaRight = rightAreas[i - 1];
 			F32 areaLeft = leftBox.area();
 
 			// New best split?
@@ -209,7 +391,6 @@ BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
 				info.cost = cost;
 				info.i = i;
 				info.leftBounds = leftBox;
-				info.rightBounds = rightBox;
 				info.dim = dim;
 				bestTieBreak = tieBreak;
 			}
@@ -219,17 +400,44 @@ BVH::SplitInfo SBVH::sahSplit(const NodeSpec& spec, F32 nodeSAH)
 	assert(info.cost != FLT_MAX);
 	assert(info.i > -1);
 
+	// Only areas are kept in the sweep
+	const std::vector<TriRef> &refs = frag.refs[info.dim];
+	for (int i = info.i; i < spec.refs; i++)
+		info.rightBounds.expand(refs[start + i].box());
+
 	return info;
 }
 
-// Object split cheapest => just sort triangles, update reference ranges
-void SBVH::partitionObject(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& info)
+// Object split cheapest => partition references on all axes, update reference ranges
+void SBVH::partitionObject(BuildFragment &frag, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& info)
 {
 	assert(info.dim > -1);
 	
-	int start = m_refs.size() - spec.refs;
-	int end = m_refs.size() - 1;
-	sortReferences(start, end, info.dim);
+	int start = frag.refs[0].size() - spec.refs;
+	if (info.bin > -1)
+	{
+		const U32 N = m_sahBins;
+		auto inLeftBin = [&](const TriRef &r) { return centroidBin(r, info.dim, info.binOrigin, info.binScale, N) < (U32)info.bin; };
+		for (U32 dim = 0; dim < 3; dim++)
+		{
+			int leftCount = stablePartition(frag.refs[dim], start, frag.scratch, inLeftBin);
+			assert(leftCount == info.i);
+		}
+	}
+	else
+	{
+		// Sweep axis is split as is, order is total => same groups on other axes
+		const TriRef pivot = frag.refs[info.dim][start + info.i];
+		const U32 splitDim = info.dim;
+		auto beforePivot = [&](const TriRef &r) { return centroidLess(r, pivot, splitDim); };
+		for (U32 dim = 0; dim < 3; dim++)
+		{
+			if (dim == splitDim)
+				continue;
+			int leftCount = stablePartition(frag.refs[dim], start, frag.scratch, beforePivot);
+			assert(leftCount == info.i);
+		}
+	}
 
 	left.refs = info.i;
 	left.box = info.leftBounds;
@@ -240,16 +448,20 @@ void SBVH::partitionObject(NodeSpec& left, NodeSpec& right, const NodeSpec& spec
 // Find cheapest spatial split using binned SAH
 // 1. Chop triangles into bins, update bin bounds + triangle counts
 // 2. Build area lookup (per bin boundary), calculate SAH, keep cheapest
-SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
+SBVH::SplitInfo SBVH::binSplit(BuildFragment &frag, const NodeSpec& spec, F32 nodeSAH)
 {
+	const std::vector<TriRef> &refs = frag.refs[0];
+	std::vector<F32> &rightAreas = frag.rightAreas;
+	Bin (&bins)[3][MaxSpatialBins] = frag.bins;
+
 	float3 origin = spec.box.min;
-	float3 binSize = (spec.box.max - origin) * (1.0f / (F32)NumSpatialBins);
+	float3 binSize = (spec.box.max - origin) * (1.0f / (F32)spatialBins);
 	float3 invBinSize = 1.0f / binSize;
 
 	// Init bins
 	for (int dim = 0; dim < 3; dim++)
 	{
-		for (int i = 0; i < NumSpatialBins; i++) 
+		for (int i = 0; i < spatialBins; i++) 
 		{
 			Bin& bin = bins[dim][i];
 			bin.bounds = AABB_t();
@@ -259,28 +471,36 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 	}
 
 	// Perform chopped binning on spanned triangles
-	for (int refIdx = m_refs.size() - spec.refs; refIdx < m_refs.size(); refIdx++)
+	for (int refIdx = refs.size() - spec.refs; refIdx < refs.size(); refIdx++)
 	{
-		const TriRef& ref = m_refs[refIdx];
+		const TriRef& ref = refs[refIdx];
 
 		// Find bins that AABB overlaps
-		int3 firstBin = vclamp(int3((ref.box.min - origin) * invBinSize), 0, NumSpatialBins - 1);
-		int3 lastBin = vclamp(int3((ref.box.max - origin) * invBinSize), firstBin, NumSpatialBins - 1);
+		const AABB_t box = ref.box();
+		int3 firstBin = vclamp(int3((box.min - origin) * invBinSize), 0, spatialBins - 1);
+		int3 lastBin = vclamp(int3((box.max - origin) * invBinSize), firstBin, spatialBins - 1);
 
-		// Clip AABB against bins, expand their boxes
+		// Clip triangle against the planes between its first and last bin at once, expand bin boxes
+		const float3 verts[3] = { m_triangles->position(ref.ind, 0), m_triangles->position(ref.ind, 1), m_triangles->position(ref.ind, 2) };
 		for (int dim = 0; dim < 3; dim++)
 		{
-			TriRef currRef = ref;
-			for (int i = firstBin[dim]; i < lastBin[dim]; i++)
+			U32 planes = lastBin[dim] - firstBin[dim];
+			if (planes > 0)
+				clipToPlanes(verts, dim, origin[dim], binSize[dim], firstBin[dim] + 1, planes, frag.planeBounds);
+
+			// Pieces are limited to what remains right of the previous plane
+			AABB_t currBox = box;
+			for (U32 j = 0; j < planes; j++)
 			{
-				TriRef leftRef, rightRef;
-				F32 splitCoord = origin[dim] + binSize[dim] * (F32)(i + 1);
-				splitReference(leftRef, rightRef, currRef, dim, splitCoord);
-				bins[dim][i].bounds.expand(leftRef.box);
-				currRef = rightRef;
+				AABB_t leftBox = frag.planeBounds.left(j);
+				AABB_t rightBox = frag.planeBounds.right(j);
+				leftBox.intersect(currBox);
+				rightBox.intersect(currBox);
+				bins[dim][firstBin[dim] + j].bounds.expand(leftBox);
+				currBox = rightBox;
 			}
 
-			bins[dim][lastBin[dim]].bounds.expand(currRef.box);
+			bins[dim][lastBin[dim]].bounds.expand(currBox);
 			bins[dim][firstBin[dim]].entering++;
 			bins[dim][lastBin[dim]].exiting++;
 		}
@@ -292,10 +512,10 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 	{
 		// Build AABB lookup, per bin boundary
 		AABB_t rightBounds;
-		for (int i = NumSpatialBins - 1; i > 0; i--)
+		for (int i = spatialBins - 1; i > 0; i--)
 		{
 			rightBounds.expand(bins[dim][i].bounds);
-			rightBoxes[i - 1] = rightBounds;
+			rightAreas[i - 1] = rightBounds.area();
 		}
 
 		// Sweep left to right and select lowest SAH
@@ -303,15 +523,15 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 		int leftNum = 0;
 		int rightNum = spec.refs;
 
-		for (int i = 1; i < NumSpatialBins; i++)
+		for (int i = 1; i < spatialBins; i++)
 		{
 			leftBounds.expand(bins[dim][i - 1].bounds);
 			leftNum += bins[dim][i - 1].entering;
 			rightNum -= bins[dim][i - 1].exiting;
 
 			F32 leftArea = leftBounds.area();
-			F32 rightArea = rightBoxes[i - 1].area();
-			F32 sah = nodeSAH + leftArea * (leftNum) * 1 + rightArea * (rightNum) * 1;
+			F32 rightArea = rightAreas[i - 1];
+			F32 sah = nodeSAH + (leftArea * (leftNum) + rightArea * (rightNum)) * sahParams.costTri;
 			if (sah < split.cost)
 			{
 				split.cost = sah;
@@ -324,59 +544,61 @@ SBVH::SplitInfo SBVH::binSplit(const NodeSpec& spec, F32 nodeSAH)
 }
 
 // Spatial split was cheapest => distribute references (while potentially splitting)
-// Only chosen cheapest split dimension is considered
-void SBVH::partitionSpatial(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split)
+// Only chosen cheapest split dimension is considered.
+// Decisions are made once and applied to every axis: untouched refs keep their order,
+// clipped duplicates are sorted separately and merged in.
+void SBVH::partitionSpatial(BuildFragment &frag, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split)
 {
-	// Left-hand side:      [leftStart, leftEnd[
-	// Uncategorized/split: [leftEnd, rightStart[
-	// Right-hand side:     [rightStart, m_refs.size()[
-
-	// The size of m_refs grows (adding duplicates) and shrinks
-	// (creating leaf nodes) dynamically during building
-
-	int leftStart = m_refs.size() - spec.refs;
-	int leftEnd = leftStart;
-	int rightStart = m_refs.size();
+	const int start = frag.refs[0].size() - spec.refs;
+	const int end = frag.refs[0].size();
 	left.box = right.box = AABB_t();
+	left.refs = right.refs = 0;
 
-	// Scan refs, swap non-intersecting tris to their corresponding sides
-	// Results in a range of intersecting references in the middle
-	for (int i = leftEnd; i < rightStart; i++)
+	// Refs entirely on either side of the plane
+	std::vector<SpatialDecision> &decisions = frag.decisions;
+	decisions.clear();
+	for (int i = start; i < end; i++)
 	{
-		// Entirely on the left-hand side?
-		if (m_refs[i].box.max[split.dim] <= split.pos)
+		const TriRef &ref = frag.refs[0][i];
+		if (ref.hi[split.dim] <= split.pos)
+		{
+			left.box.expand(ref.box());
+			left.refs++;
+		}
+		else if (ref.lo[split.dim] >= split.pos)
 		{
-			left.box.expand(m_refs[i].box);
-			std::swap(m_refs[i], m_refs[leftEnd++]);
+			right.box.expand(ref.box());
+			right.refs++;
 		}
-		// Entirely on the right-hand side?
-		else if (m_refs[i].box.min[split.dim] >= split.pos)
+		else
 		{
-			right.box.expand(m_refs[i].box);
-			std::swap(m_refs[i--], m_refs[--rightStart]);
+			SpatialDecision d;
+			d.ind = ref.ind;
+			d.lref = ref; // replaced by clipped refs
+			decisions.push_back(d);
 		}
 	}
 
-	// Process middle range, duplicating or unsplitting references
-	while (leftEnd < rightStart)
+	// Process intersecting refs, duplicating or unsplitting them
+	for (SpatialDecision &d : decisions)
 	{
-		TriRef lref, rref;
-		splitReference(lref, rref, m_refs[leftEnd], split.dim, split.pos);
+		const TriRef ref = d.lref;
+		splitReference(d.lref, d.rref, ref, split.dim, split.pos);
 
 		// Check how unsplitting / duplicating affects existing AABBs
 		AABB_t lub = left.box;  // left unsplit
 		AABB_t rub = right.box; // right unsplit
 		AABB_t ldb = left.box;  // left duplicate
 		AABB_t rdb = right.box; // right duplicate
-		lub.expand(m_refs[leftEnd].box);
-		rub.expand(m_refs[leftEnd].box);
-		ldb.expand(lref.box);
-		rdb.expand(rref.box);
+		lub.expand(ref.box());
+		rub.expand(ref.box());
+		ldb.expand(d.lref.box());
+		rdb.expand(d.rref.box());
 
-		F32 lac = sahParams.costTri * (leftEnd - leftStart);
-		F32 rac = sahParams.costTri * (m_refs.size() - rightStart);
-		F32 lbc = sahParams.costTri * (leftEnd - leftStart + 1);
-		F32 rbc = sahParams.costTri * (m_refs.size() - rightStart + 1);
+		F32 lac = sahParams.costTri * left.refs;
+		F32 rac = sahParams.costTri * right.refs;
+		F32 lbc = sahParams.costTri * (left.refs + 1);
+		F32 rbc = sahParams.costTri * (right.refs + 1);
 
 		F32 unsplitLeftSAH = lub.area() * lbc + right.box.area() * rac;
 		F32 unsplitRightSAH = left.box.area() * lac + rub.area() * rbc;
@@ -385,65 +607,105 @@ void SBVH::partitionSpatial(NodeSpec& left, NodeSpec& right, const NodeSpec& spe
 
 		if (minSAH == unsplitLeftSAH)
 		{
+			d.side = -1;
 			left.box = lub;
-			leftEnd++;
+			left.refs++;
 		}
 		else if (minSAH == unsplitRightSAH)
 		{
+			d.side = 1;
 			right.box = rub;
-			std::swap(m_refs[leftEnd], m_refs[--rightStart]);
+			right.refs++;
 		}
 		else
 		{
+			d.side = 0;
 			left.box = ldb;
 			right.box = rdb;
-			m_refs[leftEnd++] = lref;
-			m_refs.push_back(rref);
+			left.refs++;
+			right.refs++;
 		}
 	}
 
-	left.refs = leftEnd - leftStart;
-	right.refs = m_refs.size() - rightStart;
-}
+	// Triangle indices are unique within a node
+	auto byIndex = [](const SpatialDecision &d1, const SpatialDecision &d2) { return d1.ind < d2.ind; };
+	std::sort(decisions.begin(), decisions.end(), byIndex);
 
-// Split triangle (reference) into two references based on bin boundary coord
-void SBVH::splitReference(TriRef& left, TriRef& right, const TriRef& ref, int dim, F32 coord)
-{
-	left.ind = right.ind = ref.ind;
-	left.box = right.box = AABB_t();
+	// Left refs at the bottom, right refs on top, on every axis
+	std::vector<TriRef> (&kept)[2] = frag.kept;
+	std::vector<TriRef> (&clipped)[2] = frag.clipped;
+	for (U32 dim = 0; dim < 3; dim++)
+	{
+		std::vector<TriRef> &refs = frag.refs[dim];
+		for (U32 side = 0; side < 2; side++)
+		{
+			kept[side].clear();
+			clipped[side].clear();
+		}
 
-	const U32 offsets[] = { 2, 0, 1 };
-	const RTTriangle &tri = (*m_triangles)[ref.ind];
-	const VertexPNT verts[3] = { tri.v0, tri.v1, tri.v2 };
+		for (int i = start; i < end; i++)
+		{
+			const TriRef &ref = refs[i];
+			if (ref.hi[split.dim] <= split.pos)
+			{
+				kept[0].push_back(ref);
+				continue;
+			}
+			if (ref.lo[split.dim] >= split.pos)
+			{
+				kept[1].push_back(ref);
+				continue;
+			}
 
-	// Compare each vertex against plane that splits left and right bins
-	for (int i = 0; i < 3; i++)
-	{
-		const VertexPNT *v1v = verts + i;
-		const VertexPNT *v2v = verts + offsets[i];
-		float3 p1 = v2v->p;
-		float3 p2 = v1v->p;
-		F32 v0p = p1[dim];
-		F32 v1p = p2[dim];
-
-		// Left or right box?
-		if (v0p <= coord)
-			left.box.expand(p1);
-		if (v0p >= coord)
-			right.box.expand(p1);
-
-		// Check if edge intersects plane (both box AABBs have to be expanded)
-		if ((v0p < coord && v1p > coord) || (v0p > coord && v1p < coord))
+			SpatialDecision key;
+			key.ind = ref.ind;
+			const SpatialDecision &d = *std::lower_bound(decisions.begin(), decisions.end(), key, byIndex);
+			assert(d.ind == ref.ind);
+			if (d.side < 0)
+			{
+				kept[0].push_back(ref);
+			}
+			else if (d.side > 0)
+			{
+				kept[1].push_back(ref);
+			}
+			else
+			{
+				clipped[0].push_back(d.lref);
+				clipped[1].push_back(d.rref);
+			}
+		}
+
+		// Clipping moves centroids, only the duplicates need sorting
+		auto less = [dim](const TriRef &r1, const TriRef &r2) { return centroidLess(r1, r2, dim); };
+		refs.resize(start);
+		for (U32 side = 0; side < 2; side++)
 		{
-			float3 t = lerp(p1, p2, std::max(0.0f, std::min(1.0f, (coord - v0p) / (v1p - v0p))));
-			left.box.expand(t);
-			right.box.expand(t);
+			std::sort(clipped[side].begin(), clipped[side].end(), less);
+			std::merge(kept[side].begin(), kept[side].end(), clipped[side].begin(), clipped[side].end(), std::back_inserter(refs), less);
 		}
 	}
 
+	assert(left.refs + right.refs == (S32)frag.refs[0].size() - start);
+}
+
+// Split triangle (reference) into two references based on bin boundary coord
+void SBVH::splitReference(TriRef& left, TriRef& right, const TriRef& ref, int dim, F32 coord) const
+{
+	AABB_t lbox, rbox;
+	splitBounds(lbox, rbox, ref.ind, ref.box(), dim, coord);
+	left.ind = right.ind = ref.ind;
+	left.setBox(lbox);
+	right.setBox(rbox);
+}
+
+// Clipped bounds of triangle 'ind' (within 'box') on both sides of the plane
+void SBVH::splitBounds(AABB_t& lbox, AABB_t& rbox, U32 ind, const AABB_t& box, int dim, F32 coord) const
+{
+	const float3 verts[3] = { m_triangles->position(ind, 0), m_triangles->position(ind, 1), m_triangles->position(ind, 2) };
+	clipToPlane(verts, dim, coord, lbox, rbox);
+
 	// Intersect with original bounds
-	left.box.max[dim] = coord;
-	right.box.min[dim] = coord;
-	left.box.intersect(ref.box);
-	right.box.intersect(ref.box);
+	lbox.intersect(box);
+	rbox.intersect(box);
 }
@@ -2,53 +2,70 @@
 
 #include <vector>
 #include <fstream>
+#include <thread>
 #include "bvh.hpp"
+#include "arena.hpp"
+#include "spatialbins.hpp"
 #include "math/int3.hpp"
 
 using FireRays::int3;
 class ProgressView;
-class SBVHNode;
 
 /*
 	Split BVH (SBVH), based on "Spatial Splits in Bounding Volume Hierarchies" by Stich et al.
 	Tree built from right to left, so that duplicated refs can be pushed to end of ref stack.
 	Based on implementation by Aila & Laine 09.
+	Large subtrees are built concurrently, each with a ref stack of its own.
+	References are kept in three stacks, each sorted along one axis. They are sorted once at the root
+	and partitioned stably afterwards, so that the full SAH sweep needs no sorting (Wald 07).
 */
 class SBVH : public BVH
 {
 public:
-	SBVH(std::vector<RTTriangle>* tris, SplitMode mode, ProgressView *progress);
-	SBVH(std::vector<RTTriangle>* tris, const std::string filename) : BVH(tris, filename) {}
+	SBVH(TriangleMesh *tris, SplitMode mode, ProgressView *progress, const std::atomic<bool> *cancel = nullptr); // cancelled builds are left empty
+	SBVH(TriangleMesh *tris, const std::string filename) : BVH(tris, filename) {}
+	SBVH(TriangleMesh *tris, const CacheReader &reader) : BVH(tris, reader) {}
 	~SBVH() {}
 
 private:
 	struct NodeSpec;
+	struct BuildFragment;
+	struct SpatialDecision;
 
-	SBVHNode* build(NodeSpec &spec, int depth, F32 progressStart, F32 progressEnd);
-	SBVHNode* createLeaf(const NodeSpec& spec);
-	SplitInfo binSplit(const NodeSpec& spec, F32 nodeSAH);
-	SplitInfo sahSplit(const NodeSpec& spec, F32 nodeSAH);
-	void partitionObject(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split);
-	void partitionSpatial(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split);
-	void splitReference(TriRef& left, TriRef& right, const TriRef& ref, int dim, F32 coord);
+	void buildFragment(BuildFragment &frag, int depth, F32 progressStart, F32 progressEnd, TaskGroup &tasks);
+	SBVHNode* build(BuildFragment &frag, NodeSpec &spec, int depth, F32 progressStart, F32 progressEnd);
+	bool splitNode(BuildFragment &frag, const NodeSpec &spec, int depth, NodeSpec &left, NodeSpec &right);
+	SBVHNode* createLeaf(BuildFragment &frag, const NodeSpec& spec);
+	SplitInfo binSplit(BuildFragment &frag, const NodeSpec& spec, F32 nodeSAH);
+	SplitInfo sahSplit(BuildFragment &frag, const NodeSpec& spec, F32 nodeSAH);
+	void partitionObject(BuildFragment &frag, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split);
+	void partitionSpatial(BuildFragment &frag, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SplitInfo& split);
+	void splitReference(TriRef& left, TriRef& right, const TriRef& ref, int dim, F32 coord) const;
+	void splitBounds(AABB_t& lbox, AABB_t& rbox, U32 ind, const AABB_t& box, int dim, F32 coord) const;
+	void advanceProgress(F32 amount);
 	void lazyPrintBuildStatus(F32 progress);
-	void convertTree(SBVHNode *node, S32 parentId);
+	void convertFragment(const BuildFragment &frag, S32 parentId);
+	void convertTree(const BuildFragment &frag, SBVHNode *node, S32 parentId);
+	void releaseFragment(BuildFragment &frag);
+	void trackMemory(BuildFragment &frag);
+	bool buildCancelled(void) const { return cancel && *cancel; }
 
 	enum
 	{
-		MaxLeafElems = 8,
 		MinLeafElems = 1,
 		MaxDepth = 64,
 		MaxSpatialDepth = 48,
-		NumSpatialBins = 128
+		MaxSpatialBins = 128
 	};
+	static_assert(MaxSpatialBins - 1 <= MaxClipPlanes, "Bin boundaries must fit clipping batch");
 
+	// Updated concurrently by build tasks
 	struct
 	{
-		U32 depth = 0;
-		U32 bad_splits = 0;
-		U32 splits = 0;
-		U32 duplicates = 0;
+		std::atomic<U32> depth { 0 };
+		std::atomic<U32> bad_splits { 0 };
+		std::atomic<U32> splits { 0 };
+		std::atomic<U32> duplicates { 0 };
 	} metrics;
 
 	struct NodeSpec
@@ -65,9 +82,53 @@ private:
 		S32 exiting;
 	};
 
+	// Spatial split outcome of a reference that crosses the split plane
+	struct SpatialDecision
+	{
+		U32 ind;
+		S32 side; // -1: left, 1: right, 0: duplicated
+		TriRef lref, rref;
+	};
+
+	// Subtree built by a single task. Owns the reference stack of the subtree
+	// and scratch space for split searches, reused by all of its nodes. Leaves index into 'indices'.
+	// If the root was split in parallel, its children are separate fragments.
+	struct BuildFragment
+	{
+		NodeSpec spec;
+		std::vector<TriRef> refs[3];    // reference stacks sorted per axis, top spec.refs refs belong to current node
+		std::vector<TriRef> scratch;    // partitioning buffer
+		std::vector<TriRef> kept[2];    // spatial partitioning buffers, left and right
+		std::vector<TriRef> clipped[2];
+		std::vector<SpatialDecision> decisions;
+		std::vector<U32> indices;       // leaf triangle indices, in creation order
+		std::vector<F32> rightAreas;    // SAH builder optimization
+		Bin bins[3][MaxSpatialBins];
+		PlaneBounds planeBounds;        // triangle clipped against inner bin boundaries
+		Arena<SBVHNode> nodes;
+		SBVHNode *root = nullptr;
+		std::unique_ptr<BuildFragment> left;
+		std::unique_ptr<BuildFragment> right;
+		size_t trackedBytes = 0;        // last value reported to build memory statistics
+
+		size_t bytes() const
+		{
+			size_t sum = vectorBytes(scratch) + vectorBytes(decisions) + vectorBytes(indices) + vectorBytes(rightAreas) + nodes.bytes();
+			for (U32 i = 0; i < 3; i++)
+				sum += vectorBytes(refs[i]);
+			for (U32 i = 0; i < 2; i++)
+				sum += vectorBytes(kept[i]) + vectorBytes(clipped[i]);
+			return sum;
+		}
+	};
+
 	ProgressView *progress;
-	
-	Bin bins[3][NumSpatialBins];
-	F32 splitAlpha = 1e-5f; // ~35% duplication rate
+	std::thread::id progressThread; // UI can only be updated from the thread that owns it
+	std::atomic<F32> progressDone { 0.0f };
+	S32 progressShown = -1;
+	const std::atomic<bool> *cancel = nullptr; // checked by build tasks
+
+	F32 splitAlpha;         // from settings, 1e-5 gives ~35% duplication rate
 	F32 minOverlap;         // min area that triggers spatial split search
-};
\ No newline at end of file
+	S32 spatialBins;        // from settings, at most MaxSpatialBins
+};
@@ -2,9 +2,41 @@
 #include "tiny_obj_loader.h"
 
 #include "scene.hpp"
+#include "objloader.hpp"
+#include "plyloader.hpp"
+#include "threadpool.hpp"
 #include "progressview.hpp"
 #include "utils.h"
 #include "bxdf_types.h"
+#include "cachefile.hpp"
+#include "mappedfile.hpp"
+#include "settings.hpp"
+
+// Content hash for the scene package key, 0 for missing files
+static U64 sourceFileHash(const std::string &path)
+{
+    MappedFile f(path);
+    return f.valid() ? (U64)computeHash(f.data(), f.size()) : 0;
+}
+
+// Material libraries read by tinyobj::LoadObj, recorded for the scene package
+class RecordingMaterialReader : public tinyobj::MaterialFileReader
+{
+public:
+    RecordingMaterialReader(const std::string &baseDir, std::vector<std::string> &files)
+        : tinyobj::MaterialFileReader(baseDir), baseDir(baseDir), files(files) {}
+
+    bool operator()(const std::string &matId, std::vector<tinyobj::material_t> *materials,
+                    std::map<std::string, int> *matMap, std::string *err) override
+    {
+        files.push_back(baseDir + matId);
+        return tinyobj::MaterialFileReader::operator()(matId, materials, matMap, err);
+    }
+
+private:
+    std::string baseDir;
+    std::vector<std::string> &files;
+};
 
 Scene::Scene()
 {
@@ -54,7 +86,10 @@ void Scene::loadModel(const std::string filename, ProgressView *progress)
     if (endsWith(filename, "obj"))
     {
         std::cout << "Loading OBJ file: " << filename << std::endl;
-        loadObjWithMaterials(filename, progress);
+        if (Settings::getInstance().getObjLoader() == "tinyobj")
+            loadObjWithMaterials(filename, progress);
+        else
+            loadObjParallel(filename, progress);
     }
     else if (endsWith(filename, "ply"))
     {
@@ -77,6 +112,93 @@ void Scene::loadModel(const std::string filename, ProgressView *progress)
 }
 
 
+bool Scene::importFrom(const CacheReader &reader, size_t sourceHash)
+{
+    size_t numDescs, numTexels, numPathChars, numSources;
+    const TexDescriptor *descs = reader.section<TexDescriptor>(CacheSection_TexDescriptors, numDescs);
+    const cl_uchar *texels = reader.section<cl_uchar>(CacheSection_TexData, numTexels);
+    const char *paths = reader.section<char>(CacheSection_SourcePaths, numPathChars);
+    const U64 *sourceHashes = reader.section<U64>(CacheSection_SourceHashes, numSources);
+    if (!paths || !sourceHashes || (numPathChars > 0 && paths[numPathChars - 1] != '\0'))
+        return false;
+
+    // Edited material libraries or textures invalidate the package
+    sourceFiles.clear();
+    for (size_t pos = 0; pos < numPathChars; pos += sourceFiles.back().size() + 1)
+        sourceFiles.push_back(std::string(paths + pos));
+    if (sourceFiles.size() != numSources)
+        return false;
+    for (size_t i = 0; i < numSources; i++)
+    {
+        if (sourceFileHash(sourceFiles[i]) != sourceHashes[i])
+        {
+            std::cout << "Scene package is stale: " << sourceFiles[i] << " has changed" << std::endl;
+            return false;
+        }
+    }
+
+    if (!reader.read(CacheSection_Triangles, triangles.triangles) || !reader.read(CacheSection_Vertices, triangles.vertices) ||
+        !reader.read(CacheSection_Meshes, meshes) ||
+        !reader.read(CacheSection_Materials, materials) || !descs || !texels || materials.empty())
+        return false;
+
+    for (Texture *t : textures)
+        delete t;
+    textures.clear();
+
+    for (size_t i = 0; i < numDescs; i++)
+    {
+        const TexDescriptor &d = descs[i];
+        if ((size_t)d.offset + (size_t)d.width * d.height * 4 > numTexels)
+            return false;
+        textures.push_back(new Texture("packed_" + std::to_string(i), d.width, d.height, texels + d.offset));
+    }
+
+    materialTypes = 0;
+    for (const Material &m : materials)
+        materialTypes |= m.type;
+
+    this->hash = sourceHash;
+    return true;
+}
+
+// Texture layout matches CLContext::packTextures
+void Scene::exportTo(CacheWriter &writer)
+{
+    std::vector<TexDescriptor> descs;
+    size_t numTexels = 0;
+    for (Texture *tex : textures)
+    {
+        TexDescriptor d;
+        d.offset = (cl_uint)numTexels;
+        d.width = tex->getWidth();
+        d.height = tex->getHeight();
+        descs.push_back(d);
+        numTexels += tex->getWidth() * tex->getHeight() * 4 * 1; // RGBA
+    }
+
+    std::vector<cl_uchar> texels(numTexels);
+    for (size_t i = 0; i < textures.size(); i++)
+        std::memcpy(texels.data() + descs[i].offset, textures[i]->getData(), textures[i]->getWidth() * textures[i]->getHeight() * 4 * 1);
+
+    writer.add(CacheSection_Triangles, triangles.triangles);
+    writer.add(CacheSection_Vertices, triangles.vertices);
+    writer.add(CacheSection_Meshes, meshes);
+    writer.add(CacheSection_Materials, materials);
+    writer.add(CacheSection_TexDescriptors, std::move(descs));
+    writer.add(CacheSection_TexData, std::move(texels));
+
+    std::vector<char> paths;
+    std::vector<U64> sourceHashes;
+    for (const std::string &path : sourceFiles)
+    {
+        paths.insert(paths.end(), path.c_str(), path.c_str() + path.size() + 1);
+        sourceHashes.push_back(sourceFileHash(path));
+    }
+    writer.add(CacheSection_SourcePaths, std::move(paths));
+    writer.add(CacheSection_SourceHashes, std::move(sourceHashes));
+}
+
 // Possible face data formats include:
 //  `f v1/vt1/vn1 v2/vt2/vn2 ...`
 //  `f v1//vn1 v2//vn2 ...`
@@ -174,8 +296,11 @@ void Scene::loadObjWithMaterials(const std::string filePath, ProgressView *progr
     std::string folderPath = filePath.substr(0, fileNameStart + 1);
     std::string meshName = filePath.substr(fileNameStart + 1);
 
-    progress->showMessage("Loading mesh", meshName);
-    bool ret = tinyobj::LoadObj(&attrib, &shapesVec, &materialsVec, &err, filePath.c_str(), folderPath.c_str());
+    if (progress)
+        progress->showMessage("Loading mesh", meshName);
+    std::ifstream input(filePath);
+    RecordingMaterialReader materialReader(folderPath, sourceFiles);
+    bool ret = input && tinyobj::LoadObj(&attrib, &shapesVec, &materialsVec, &err, &input, &materialReader);
 
     if (!err.empty()) // `err` may contain warning message.
     {
@@ -198,11 +323,18 @@ void Scene::loadObjWithMaterials(const std::string filePath, ProgressView *progr
         numTris += s.mesh.indices.size() / 3;
     }
 
+    // Vertices are shared by faces that use the same v/vt/vn combination
+    ObjVertexMap vertexIds;
+    vertexIds.reserve(numTris);
+
     // Loop over shapesVec in file
     for (size_t i = 0; i < shapesVec.size(); i++)
     {
         tinyobj::shape_t &shape = shapesVec[i];
         assert((shapesVec[i].mesh.indices.size() % 3) == 0); // properly triangulated
+        MeshRange range = { triangles.size(), shape.mesh.indices.size() / 3 };
+        if (range.count > 0)
+            meshes.push_back(range);
 
         // Loop over faces in the shape's mesh
         for (size_t f = 0; f < shape.mesh.indices.size() / 3; f++)
@@ -210,48 +342,112 @@ void Scene::loadObjWithMaterials(const std::string filePath, ProgressView *progr
             // Progress bar
             size_t N = triangles.size();
             float done = (float)N / numTris;
-            if (N % 5000 == 0)
+            if (progress && N % 5000 == 0)
                 progress->showMessage("Converting mesh", meshName, done);
             
-            VertexPNT V[3];
-            
-            // Vertices
+            ObjVertexKey keys[3];
             bool allNormals = true;
             for (size_t v = 0; v < 3; v++)
             {
                 auto ind = shape.mesh.indices[3 * f + v];
-                
-                // Position
-                V[v].p = float3(attrib.vertices[3 * ind.vertex_index + 0], attrib.vertices[3 * ind.vertex_index + 1], attrib.vertices[3 * ind.vertex_index + 2]);
+                keys[v].p = ind.vertex_index;
+                keys[v].t = hasTexCoords ? ind.texcoord_index : -1;
+                keys[v].n = hasNormals ? ind.normal_index : -1;
+                allNormals = allNormals && keys[v].n >= 0;
+            }
 
-                // Normal
-                if (ind.normal_index < 0 || !hasNormals)
-                {
-                    allNormals = false;
-                    V[v].n = float3(0.0f);
-                }
-                else
+            IndexedTriangle tri;
+            for (size_t v = 0; v < 3; v++)
+            {
+                ObjVertexKey &key = keys[v];
+                if (!allNormals)
+                    key.n = -1; // flat shaded, zero normal
+
+                auto ins = vertexIds.insert(std::make_pair(key, (U32)triangles.vertices.size()));
+                if (ins.second)
                 {
-                    V[v].n = float3(attrib.normals[3 * ind.normal_index + 0], attrib.normals[3 * ind.normal_index + 1], attrib.normals[3 * ind.normal_index + 2]);
-                }
+                    VertexPNT V;
+                    V.p = float3(attrib.vertices[3 * key.p + 0], attrib.vertices[3 * key.p + 1], attrib.vertices[3 * key.p + 2]);
 
-                // Tex coord
-                if (ind.texcoord_index > -1 && hasTexCoords)
-                    V[v].t = float3(attrib.texcoords[2 * ind.texcoord_index + 0], attrib.texcoords[2 * ind.texcoord_index + 1], 0.0f);
-                else
-                    V[v].t = float3(0.0f);
-            }
+                    if (key.n < 0)
+                        V.n = float3(0.0f);
+                    else
+                        V.n = float3(attrib.normals[3 * key.n + 0], attrib.normals[3 * key.n + 1], attrib.normals[3 * key.n + 2]);
 
-            if(!allNormals)
-                V[0].n = V[1].n = V[2].n = normalize(cross(V[1].p - V[0].p, V[2].p - V[0].p));
+                    if (key.t < 0)
+                        V.t = float3(0.0f);
+                    else
+                        V.t = float3(attrib.texcoords[2 * key.t + 0], attrib.texcoords[2 * key.t + 1], 0.0f);
+
+                    triangles.vertices.push_back(V);
+                }
+                tri.v[v] = ins.first->second;
+            }
 
-            RTTriangle tri(V[0], V[1], V[2]);
             tri.matId = shape.mesh.material_ids[f] + 1; // -1 becomes 0 (default material)
-            triangles.push_back(tri);
+            triangles.triangles.push_back(tri);
         }
     }
 
-    // Read materialsVec into own format
+    addObjMaterials(materialsVec, folderPath);
+}
+
+void Scene::loadObjParallel(const std::string filePath, ProgressView *progress)
+{
+    size_t fileNameStart = filePath.find_last_of("\\"); // assume Windows
+    if (fileNameStart == std::string::npos) fileNameStart = filePath.find_last_of("/"); // Linux/MacOS
+    std::string folderPath = filePath.substr(0, fileNameStart + 1);
+    std::string meshName = filePath.substr(fileNameStart + 1);
+
+    if (progress)
+        progress->showMessage("Loading mesh", meshName);
+
+    ObjData data;
+    if (!::loadObjParallel(filePath, data))
+    {
+        std::cout << "OBJ loading failed (parallel parser)" << std::endl;
+        waitExit();
+    }
+
+    // Material libraries, names map to indices as in tinyobj::LoadObj
+    std::vector<tinyobj::material_t> materialsVec;
+    std::map<std::string, int> materialMap;
+    for (const std::string &lib : data.materialLibs)
+    {
+        addSourceFile(folderPath + lib);
+        std::ifstream input(folderPath + lib);
+        if (!input)
+        {
+            std::cout << "Could not open material library: " << folderPath + lib << std::endl;
+            continue;
+        }
+
+        std::string warning;
+        tinyobj::LoadMtl(&materialMap, &materialsVec, &input, &warning);
+        if (!warning.empty())
+            std::cerr << warning << std::endl;
+    }
+
+    // Parser ids index usemtl names, unknown names get the default material
+    std::vector<int> matIds(data.materialNames.size() + 1, 0);
+    for (size_t i = 0; i < data.materialNames.size(); i++)
+    {
+        auto it = materialMap.find(data.materialNames[i]);
+        if (it != materialMap.end())
+            matIds[i + 1] = it->second + 1;
+    }
+    for (IndexedTriangle &tri : data.mesh.triangles)
+        tri.matId = matIds[tri.matId];
+
+    triangles = std::move(data.mesh);
+    meshes = std::move(data.meshes);
+
+    addObjMaterials(materialsVec, folderPath);
+}
+
+// Read materialsVec into own format
+void Scene::addObjMaterials(std::vector<tinyobj::material_t> &materialsVec, const std::string &folderPath)
+{
     for (tinyobj::material_t &t_mat : materialsVec)
     {
         Material m;
@@ -282,6 +478,7 @@ cl_int Scene::tryImportTexture(const std::string path, std::string name)
     }
 
     // Texture doesn't exist, load it 
+    addSourceFile(path);
     Texture *tex = new Texture(path, name);
     if (tex->getName() == "error") return -1;
 
@@ -391,135 +588,44 @@ void Scene::loadObjModel(const std::string filename)
 /* Used for loading PLY meshes */
 void Scene::loadPlyModel(const std::string filename)
 {
-    struct Element
+    PlyData data;
+    if (!loadPly(filename, data))
     {
-        std::string name;                // e.g. vertex
-        int lines;                       // e.g. 1300
-        std::vector<std::string> props;  // e.g. [x, y, z, nx, ny, nz]
-    };
-
-    // Keep track of what data, and how meny elements each, to expect
-    std::vector<Element> elements;
-
-    // Open input file stream for reading.
-    std::ifstream input(filename, std::ios::in);
-
-    std::string line;
-
-    // Data of current element
-    std::string type = "none";
-    int num_elem = 0;
-    std::vector<std::string> currentProps;
-
-    /* READ HEADERS */
-    while (getline(input, line))
-    {
-        std::istringstream iss(line);
-        std::string s;
-        iss >> s;
-        if (s == "element")
-        {
-            elements.push_back(Element{ type, num_elem, currentProps }); //Push previous element
-            currentProps.clear();
-            iss >> type >> num_elem;
-        }
-        else if (s == "property")
-        {
-            std::string type, name;
-            iss >> type >> name;
-            currentProps.push_back(name);
-        }
-        else if (s == "end_header")
-        {
-            elements.push_back(Element{ type, num_elem, currentProps }); //push last element
-            break;
-        }
+        std::cout << "PLY loading failed" << std::endl;
+        waitExit();
     }
 
-    std::cout << "PLY headers processed" << std::endl;
-
-    std::vector<float3> positions, normals;
-    std::vector<std::array<unsigned, 6>> faces;
-
-    /* READ DATA */
-    for (Element &e : elements)
+    std::cout << "Positions: " << data.positions.size() << std::endl;
+    std::cout << "Normals: " << data.normals.size() << std::endl;
+    std::cout << "Faces: " << data.indices.size() / 3 << std::endl;
+
+    // PLY normals have the same indices as their vertices, zero normals mean flat shading
+    const bool hasNormals = data.normals.size() > 0;
+    const size_t firstVertex = triangles.vertices.size();
+    const size_t firstTri = triangles.size();
+    const size_t numVertices = data.positions.size();
+    const size_t numTris = data.indices.size() / 3;
+    const size_t batch = 1 << 16;
+    triangles.vertices.resize(firstVertex + numVertices);
+    triangles.triangles.resize(firstTri + numTris);
+    ThreadPool::getInstance().parallelFor((unsigned int)((std::max(numVertices, numTris) + batch - 1) / batch), [&](unsigned int b)
     {
-        if (e.name == "vertex")
+        for (size_t i = b * batch; i < std::min(numVertices, (b + 1) * batch); i++)
         {
-            std::cout << "Reading " << e.lines << " vertices" << std::endl;
-            for (int i = 0; i < e.lines; i++)
-            {
-                getline(input, line);
-                std::istringstream iss(line);
-
-                // MSVCCompiler has a float cast performance bug
-                //   => patch: read into string, cast with atof
-                std::map<std::string, float> map;
-                std::string bucket;
-                for (std::string name : e.props)
-                {
-                    iss >> bucket;
-                    map[name] = (float)atof(bucket.c_str());
-                }
-
-                positions.push_back(float3(map["x"], map["y"], map["z"]));
-                if (map.find("nx") != map.end()) // contains normals
-                    normals.push_back(float3(map["nx"], map["ny"], map["nz"]));
-            }
+            VertexPNT &v = triangles.vertices[firstVertex + i];
+            v.p = data.positions[i];
+            v.n = hasNormals ? data.normals[i] : float3(0.0f);
+            v.t = float3(0.0f);
         }
-        else if (e.name == "face")
-        {
-            std::cout << "Reading " << e.lines << " faces" << std::endl;
-            for (int i = 0; i < e.lines; i++)
-            {
-                getline(input, line);
-                std::istringstream iss(line);
-
-                std::array<unsigned, 6>  f; // Face index array
-
-                // Face list format: '3 i1 i2 i3' (triangle) or '4 i1 i2 i3 i4' (quad)
-                // A quad can be represented with two triangles
-
-                int poly_type;
-                iss >> poly_type;
 
-                if (poly_type == 3)
-                {
-                    iss >> f[0] >> f[2] >> f[4];
-                    faces.push_back(f);
-                }
-                else if (poly_type == 4)
-                {
-                    int i0, i1, i2, i3;
-                    iss >> i0 >> i1 >> i2 >> i3;
-
-                    //triangle 1
-                    f[0] = i0; f[2] = i1; f[4] = i2;
-                    faces.push_back(f);
-
-                    //triangle 2
-                    f[0] = i2; f[2] = i3; f[4] = i0;
-                    faces.push_back(f);
-                }
-                else
-                {
-                    std::cout << "Unknown polygon type!" << std::endl;
-                    waitExit();
-                }
-            }
-        }
-        else
+        for (size_t i = b * batch; i < std::min(numTris, (b + 1) * batch); i++)
         {
-            //skip data
-            std::cout << "Skipping element of type " << e.name << std::endl;
-            for (int i = 0; i < e.lines; i++)
-            {
-                getline(input, line);
-            }
+            IndexedTriangle &tri = triangles.triangles[firstTri + i];
+            for (int k = 0; k < 3; k++)
+                tri.v[k] = (cl_uint)(firstVertex + data.indices[3 * i + k]);
+            tri.matId = 0;
         }
-    }
-
-    unpackIndexedData(positions, normals, faces, true); //true = ply format
+    });
 }
 
 void Scene::unpackIndexedData(const std::vector<float3> &positions,
@@ -566,6 +672,6 @@ void Scene::unpackIndexedData(const std::vector<float3> &positions,
             v2.n = normals[f[5]];
         }
 
-        triangles.push_back(RTTriangle(v0, v1, v2));
+        triangles.append(RTTriangle(v0, v1, v2));
     }
 };
\ No newline at end of file
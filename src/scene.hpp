@@ -9,6 +9,7 @@
 #include <vector>
 #include <array>
 #include <memory>
+#include "tiny_obj_loader.h"
 #include "texture.hpp"
 #include "envmap.hpp"
 #include "triangle.hpp"
@@ -16,6 +17,15 @@
 
 using FireRays::float3;
 class ProgressView;
+class CacheReader;
+class CacheWriter;
+
+// Triangles of a single OBJ shape
+struct MeshRange
+{
+    size_t start;
+    size_t count;
+};
 
 class Scene {
 public:
@@ -26,11 +36,17 @@ public:
     void setEnvMap(std::shared_ptr<EnvironmentMap> envMapPtr);
     void loadModel(const std::string filename, ProgressView *progress); // load .obj or .ply model
 
-    std::vector<RTTriangle> &getTriangles() { return triangles; }
+    TriangleMesh &getTriangles() { return triangles; }
+    std::vector<MeshRange> &getMeshes() { return meshes; } // empty if source has no shapes
     std::vector<Material> &getMaterials() { return materials; }
     std::vector<Texture*> &getTextures() { return textures; }
     std::shared_ptr<EnvironmentMap> getEnvMap() { return envmap; }
 
+    // Scene package: parsed geometry, materials and decoded textures, see Tracer::loadScenePackage.
+    // Also records the material libraries and textures read, the package is stale if one of them changed.
+    bool importFrom(const CacheReader &reader, size_t sourceHash); // false if sections are missing or stale
+    void exportTo(CacheWriter &writer);
+
     std::string hashString();
     unsigned int getMaterialTypes() { return materialTypes; }
 
@@ -40,6 +56,12 @@ private:
 
     // With tiny_obj_loader
     void loadObjWithMaterials(const std::string filename, ProgressView *progress);
+
+    // With the parallel parser, see objloader.hpp. Materials are read with tiny_obj_loader
+    void loadObjParallel(const std::string filename, ProgressView *progress);
+
+    void addSourceFile(const std::string &path) { sourceFiles.push_back(path); }
+    void addObjMaterials(std::vector<tinyobj::material_t> &materialsVec, const std::string &folderPath);
     cl_int tryImportTexture(const std::string path, const std::string name);
     cl_int parseShaderType(std::string &type);
 
@@ -49,9 +71,11 @@ private:
                            bool type_ply);
 
   std::shared_ptr<EnvironmentMap> envmap;
-  std::vector<RTTriangle> triangles;
+  TriangleMesh triangles;
+  std::vector<MeshRange> meshes;
   std::vector<Material> materials;
   std::vector<Texture*> textures;
+  std::vector<std::string> sourceFiles; // material libraries and textures, part of the package key
   size_t hash;
   unsigned int materialTypes = 0; // bits represent material types present in scene
 };
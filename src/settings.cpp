@@ -1,4 +1,6 @@
 #include <fstream>
+#include <thread>
+#include <algorithm>
 #include "settings.hpp"
 
 using json = nlohmann::json;
@@ -7,6 +9,26 @@ Settings::Settings()
 {
     init();
     load();
+
+    // Use all hardware threads by default
+    if (bvhBuildThreads == 0)
+        bvhBuildThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Wide traversal kernels exist for 4 and 8 children
+    if (clBvhWidth != 4 && clBvhWidth != 8)
+        clBvhWidth = 2;
+
+    // Quantized bounds are stored in the parent, only supported by wide nodes
+    if (clBvhQuantized && clBvhWidth == 2)
+        clBvhWidth = 4;
+
+    // Instances are only entered by the binary stack traversal
+    if (bvhInstancing)
+    {
+        clBvhWidth = 2;
+        clBvhQuantized = false;
+        clUseBitstack = false;
+    }
 }
 
 void Settings::init()
@@ -20,6 +42,25 @@ void Settings::init()
     wfBufferSize = 1 << 20; // appropriate for dedicated GPU
     clUseBitstack = false;
     clUseSoA = true;
+    clBvhWidth = 2;
+    clBvhQuantized = false;
+    bvhBuildThreads = 0;
+    bvhSplitMode = "sah";
+    bvhSahBins = 32;
+    bvhMaxLeafElems = 8;
+    bvhSplitAlpha = 1e-5f;
+    bvhOptimizePasses = 0;
+    bvhCostBox = 1.0f;
+    bvhCostTri = 1.0f;
+    bvhSpatialBins = 128;
+    bvhAutotune = false;
+    bvhNodeLayout = "dfs";
+    bvhInstancing = false;
+    bvhProgressive = false;
+    bvhPreviewMode = "lbvh";
+    sceneCache = true;
+    hierarchyCacheMiB = 4096;
+    objLoader = "parallel";
 }
 
 inline bool contains(json j, std::string value)
@@ -65,7 +106,26 @@ void Settings::import(json j)
     if (contains(j, "windowHeight")) this->windowHeight = j["windowHeight"].get<int>();
     if (contains(j, "clUseBitstack")) this->clUseBitstack = j["clUseBitstack"].get<bool>();
     if (contains(j, "clUseSoA")) this->clUseSoA = j["clUseSoA"].get<bool>();
+    if (contains(j, "clBvhWidth")) this->clBvhWidth = j["clBvhWidth"].get<unsigned int>();
+    if (contains(j, "clBvhQuantized")) this->clBvhQuantized = j["clBvhQuantized"].get<bool>();
     if (contains(j, "wfBufferSize")) this->wfBufferSize = j["wfBufferSize"].get<unsigned int>();
+    if (contains(j, "bvhBuildThreads")) this->bvhBuildThreads = j["bvhBuildThreads"].get<unsigned int>();
+    if (contains(j, "bvhSplitMode")) this->bvhSplitMode = j["bvhSplitMode"].get<std::string>();
+    if (contains(j, "bvhSahBins")) this->bvhSahBins = j["bvhSahBins"].get<unsigned int>();
+    if (contains(j, "bvhMaxLeafElems")) this->bvhMaxLeafElems = j["bvhMaxLeafElems"].get<unsigned int>();
+    if (contains(j, "bvhSplitAlpha")) this->bvhSplitAlpha = j["bvhSplitAlpha"].get<float>();
+    if (contains(j, "bvhOptimizePasses")) this->bvhOptimizePasses = j["bvhOptimizePasses"].get<unsigned int>();
+    if (contains(j, "bvhCostBox")) this->bvhCostBox = j["bvhCostBox"].get<float>();
+    if (contains(j, "bvhCostTri")) this->bvhCostTri = j["bvhCostTri"].get<float>();
+    if (contains(j, "bvhSpatialBins")) this->bvhSpatialBins = j["bvhSpatialBins"].get<unsigned int>();
+    if (contains(j, "bvhAutotune")) this->bvhAutotune = j["bvhAutotune"].get<bool>();
+    if (contains(j, "bvhNodeLayout")) this->bvhNodeLayout = j["bvhNodeLayout"].get<std::string>();
+    if (contains(j, "bvhInstancing")) this->bvhInstancing = j["bvhInstancing"].get<bool>();
+    if (contains(j, "bvhProgressive")) this->bvhProgressive = j["bvhProgressive"].get<bool>();
+    if (contains(j, "bvhPreviewMode")) this->bvhPreviewMode = j["bvhPreviewMode"].get<std::string>();
+    if (contains(j, "sceneCache")) this->sceneCache = j["sceneCache"].get<bool>();
+    if (contains(j, "hierarchyCacheMiB")) this->hierarchyCacheMiB = j["hierarchyCacheMiB"].get<unsigned int>();
+    if (contains(j, "objLoader")) this->objLoader = j["objLoader"].get<std::string>();
 
     // Map of numbers 1-5 to scenes (shortcuts)
     if (contains(j, "shortcuts"))
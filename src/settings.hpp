@@ -27,7 +27,33 @@ public:
     void setRenderScale(float s) { renderScale = s; };
     bool getUseBitstack() { return clUseBitstack; }
     bool getUseSoA() { return clUseSoA; }
+    unsigned int getBvhWidth() { return clBvhWidth; }
+    bool getBvhQuantized() { return clBvhQuantized; }
     unsigned int getWfBufferSize() { return wfBufferSize; }
+    unsigned int getBvhBuildThreads() { return bvhBuildThreads; }
+    std::string getBvhSplitMode() { return bvhSplitMode; }
+    void setBvhSplitMode(const std::string mode) { bvhSplitMode = mode; }
+    unsigned int getBvhSahBins() { return bvhSahBins; }
+    unsigned int getBvhMaxLeafElems() { return bvhMaxLeafElems; }
+    void setBvhMaxLeafElems(unsigned int n) { bvhMaxLeafElems = n; }
+    float getBvhSplitAlpha() { return bvhSplitAlpha; }
+    void setBvhSplitAlpha(float a) { bvhSplitAlpha = a; }
+    unsigned int getBvhOptimizePasses() { return bvhOptimizePasses; }
+    void setBvhOptimizePasses(unsigned int n) { bvhOptimizePasses = n; }
+    float getBvhCostBox() { return bvhCostBox; }
+    void setBvhCostBox(float c) { bvhCostBox = c; }
+    float getBvhCostTri() { return bvhCostTri; }
+    void setBvhCostTri(float c) { bvhCostTri = c; }
+    unsigned int getBvhSpatialBins() { return bvhSpatialBins; }
+    void setBvhSpatialBins(unsigned int n) { bvhSpatialBins = n; }
+    bool getBvhAutotune() { return bvhAutotune; }
+    std::string getBvhNodeLayout() { return bvhNodeLayout; }
+    bool getBvhInstancing() { return bvhInstancing; }
+    bool getBvhProgressive() { return bvhProgressive; }
+    std::string getBvhPreviewMode() { return bvhPreviewMode; }
+    bool getSceneCache() { return sceneCache; }
+    unsigned int getHierarchyCacheMiB() { return hierarchyCacheMiB; }
+    std::string getObjLoader() { return objLoader; }
 
 private:
     Settings();
@@ -41,8 +67,27 @@ private:
     std::string envMapName;
     std::map<unsigned int, std::string> shortcuts;
     unsigned int wfBufferSize;
+    unsigned int bvhBuildThreads; // 0 = all hardware threads
+    std::string bvhSplitMode;     // sah, sah_binned, object_median, spatial_median, lbvh
+    unsigned int bvhSahBins;      // bins per axis in binned SAH
+    unsigned int bvhMaxLeafElems; // SAH builders: larger nodes are always split, at most 255
+    float bvhSplitAlpha;          // SBVH: min child overlap (relative to root area) for spatial split search
+    unsigned int bvhOptimizePasses; // treelet restructuring passes after build, 0 = off
+    float bvhCostBox;               // SAH cost of a node (box pair) test
+    float bvhCostTri;               // SAH cost of a triangle test
+    unsigned int bvhSpatialBins;    // SBVH: spatial split bins per axis, at most 128
+    bool bvhAutotune;               // time build parameter variants on the device, see tracer.cpp
+    std::string bvhNodeLayout;      // dfs, bfs, veb, sah
+    bool bvhInstancing;             // two-level hierarchy, see twolevelbvh.hpp
+    bool bvhProgressive;            // render on a preview hierarchy while the final one builds, see Tracer::updateHierarchy
+    std::string bvhPreviewMode;     // split mode of the preview hierarchy: lbvh or sah_binned
+    bool sceneCache;                // parsed scenes stored in data/scenes, see Tracer::loadScenePackage
+    unsigned int hierarchyCacheMiB; // disk budget of data/hierarchies, 0 = unlimited
+    std::string objLoader;          // parallel (see objloader.hpp) or tinyobj
     bool clUseBitstack;
     bool clUseSoA;
+    unsigned int clBvhWidth; // traversal node width: 2, 4 or 8
+    bool clBvhQuantized;     // 8-bit child bounds, implies wide nodes
     int windowWidth;
     int windowHeight;
     float renderScale;
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <cassert>
+#include "spatialbins.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SPATIAL_BINS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX
+#else
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
+// Edge i runs from vertex edgeStart[i] to vertex i, same order as the scalar clipper
+static const U32 edgeStart[] = { 2, 0, 1 };
+
+void clipToPlane(const float3 (&verts)[3], U32 dim, F32 coord, AABB_t &lbox, AABB_t &rbox)
+{
+	lbox = rbox = AABB_t();
+
+	// Compare each vertex against plane that splits left and right bins
+	for (int i = 0; i < 3; i++)
+	{
+		const float3 &p1 = verts[edgeStart[i]];
+		const float3 &p2 = verts[i];
+		F32 v0p = p1[dim];
+		F32 v1p = p2[dim];
+
+		// Left or right box?
+		if (v0p <= coord)
+			lbox.expand(p1);
+		if (v0p >= coord)
+			rbox.expand(p1);
+
+		// Check if edge intersects plane (both box AABBs have to be expanded)
+		if ((v0p < coord && v1p > coord) || (v0p > coord && v1p < coord))
+		{
+			F32 t = std::max(0.0f, std::min(1.0f, (coord - v0p) / (v1p - v0p)));
+			float3 p = p1 * (1.0f - t) + p2 * t;
+			lbox.expand(p);
+			rbox.expand(p);
+		}
+	}
+
+	lbox.max[dim] = coord;
+	rbox.min[dim] = coord;
+}
+
+#ifndef SPATIAL_BINS_X86
+
+static void clipToPlanesScalar(const float3 (&verts)[3], U32 dim, F32 origin, F32 step, U32 first, U32 count, PlaneBounds &out)
+{
+	for (U32 j = 0; j < count; j++)
+	{
+		AABB_t lbox, rbox;
+		clipToPlane(verts, dim, origin + step * (F32)(first + j), lbox, rbox);
+		for (int k = 0; k < 3; k++)
+		{
+			out.lmin[k][j] = lbox.min[k];
+			out.lmax[k][j] = lbox.max[k];
+			out.rmin[k][j] = rbox.min[k];
+			out.rmax[k][j] = rbox.max[k];
+		}
+	}
+}
+
+#else
+
+// Lanes hold consecutive planes. Min/max operand order follows vmin/vmax so that ties resolve identically.
+static void clipToPlanesSSE(const float3 (&verts)[3], U32 dim, F32 origin, F32 step, U32 first, U32 count, PlaneBounds &out)
+{
+	const __m128 big = _mm_set1_ps(FLT_MAX);
+	const __m128 small = _mm_set1_ps(-FLT_MAX);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+
+	for (U32 j = 0; j < count; j += 4)
+	{
+		__m128 coord = _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_set1_ps(step), _mm_add_ps(_mm_set1_ps((F32)(first + j)), lanes)));
+		__m128 lmin[3], lmax[3], rmin[3], rmax[3];
+		for (int k = 0; k < 3; k++)
+		{
+			lmin[k] = rmin[k] = big;
+			lmax[k] = rmax[k] = small;
+		}
+
+		for (int i = 0; i < 3; i++)
+		{
+			const float3 &p1 = verts[edgeStart[i]];
+			const float3 &p2 = verts[i];
+			__m128 v0p = _mm_set1_ps(p1[dim]);
+			__m128 v1p = _mm_set1_ps(p2[dim]);
+
+			__m128 inLeft = _mm_cmple_ps(v0p, coord);
+			__m128 inRight = _mm_cmpge_ps(v0p, coord);
+			__m128 crosses = _mm_or_ps(
+				_mm_and_ps(_mm_cmplt_ps(v0p, coord), _mm_cmpgt_ps(v1p, coord)),
+				_mm_and_ps(_mm_cmpgt_ps(v0p, coord), _mm_cmplt_ps(v1p, coord)));
+
+			__m128 t = _mm_max_ps(_mm_min_ps(_mm_div_ps(_mm_sub_ps(coord, v0p), _mm_sub_ps(v1p, v0p)), one), zero);
+			__m128 s = _mm_sub_ps(one, t);
+
+			for (int k = 0; k < 3; k++)
+			{
+				__m128 a = _mm_set1_ps(p1[k]);
+				__m128 x = _mm_add_ps(_mm_mul_ps(a, s), _mm_mul_ps(_mm_set1_ps(p2[k]), t));
+
+				lmin[k] = _mm_min_ps(_mm_or_ps(_mm_and_ps(inLeft, a), _mm_andnot_ps(inLeft, big)), lmin[k]);
+				lmax[k] = _mm_max_ps(_mm_or_ps(_mm_and_ps(inLeft, a), _mm_andnot_ps(inLeft, small)), lmax[k]);
+				rmin[k] = _mm_min_ps(_mm_or_ps(_mm_and_ps(inRight, a), _mm_andnot_ps(inRight, big)), rmin[k]);
+				rmax[k] = _mm_max_ps(_mm_or_ps(_mm_and_ps(inRight, a), _mm_andnot_ps(inRight, small)), rmax[k]);
+
+				__m128 xmin = _mm_or_ps(_mm_and_ps(crosses, x), _mm_andnot_ps(crosses, big));
+				__m128 xmax = _mm_or_ps(_mm_and_ps(crosses, x), _mm_andnot_ps(crosses, small));
+				lmin[k] = _mm_min_ps(xmin, lmin[k]);
+				lmax[k] = _mm_max_ps(xmax, lmax[k]);
+				rmin[k] = _mm_min_ps(xmin, rmin[k]);
+				rmax[k] = _mm_max_ps(xmax, rmax[k]);
+			}
+		}
+
+		for (int k = 0; k < 3; k++)
+		{
+			_mm_storeu_ps(&out.lmin[k][j], lmin[k]);
+			_mm_storeu_ps(&out.lmax[k][j], lmax[k]);
+			_mm_storeu_ps(&out.rmin[k][j], rmin[k]);
+			_mm_storeu_ps(&out.rmax[k][j], rmax[k]);
+		}
+		_mm_storeu_ps(&out.lmax[dim][j], coord);
+		_mm_storeu_ps(&out.rmin[dim][j], coord);
+	}
+}
+
+// Selects with and/andnot, blendv without AVX2 compiles to scalar code on GCC
+TARGET_AVX
+static void clipToPlanesAVX(const float3 (&verts)[3], U32 dim, F32 origin, F32 step, U32 first, U32 count, PlaneBounds &out)
+{
+	const __m256 big = _mm256_set1_ps(FLT_MAX);
+	const __m256 small = _mm256_set1_ps(-FLT_MAX);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 lanes = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+	for (U32 j = 0; j < count; j += 8)
+	{
+		__m256 coord = _mm256_add_ps(_mm256_set1_ps(origin), _mm256_mul_ps(_mm256_set1_ps(step), _mm256_add_ps(_mm256_set1_ps((F32)(first + j)), lanes)));
+		__m256 lmin[3], lmax[3], rmin[3], rmax[3];
+		for (int k = 0; k < 3; k++)
+		{
+			lmin[k] = rmin[k] = big;
+			lmax[k] = rmax[k] = small;
+		}
+
+		for (int i = 0; i < 3; i++)
+		{
+			const float3 &p1 = verts[edgeStart[i]];
+			const float3 &p2 = verts[i];
+			__m256 v0p = _mm256_set1_ps(p1[dim]);
+			__m256 v1p = _mm256_set1_ps(p2[dim]);
+
+			__m256 inLeft = _mm256_cmp_ps(v0p, coord, _CMP_LE_OQ);
+			__m256 inRight = _mm256_cmp_ps(v0p, coord, _CMP_GE_OQ);
+			__m256 crosses = _mm256_or_ps(
+				_mm256_and_ps(_mm256_cmp_ps(v0p, coord, _CMP_LT_OQ), _mm256_cmp_ps(v1p, coord, _CMP_GT_OQ)),
+				_mm256_and_ps(_mm256_cmp_ps(v0p, coord, _CMP_GT_OQ), _mm256_cmp_ps(v1p, coord, _CMP_LT_OQ)));
+
+			__m256 t = _mm256_max_ps(_mm256_min_ps(_mm256_div_ps(_mm256_sub_ps(coord, v0p), _mm256_sub_ps(v1p, v0p)), one), zero);
+			__m256 s = _mm256_sub_ps(one, t);
+
+			for (int k = 0; k < 3; k++)
+			{
+				__m256 a = _mm256_set1_ps(p1[k]);
+				__m256 x = _mm256_add_ps(_mm256_mul_ps(a, s), _mm256_mul_ps(_mm256_set1_ps(p2[k]), t));
+
+				lmin[k] = _mm256_min_ps(_mm256_or_ps(_mm256_and_ps(inLeft, a), _mm256_andnot_ps(inLeft, big)), lmin[k]);
+				lmax[k] = _mm256_max_ps(_mm256_or_ps(_mm256_and_ps(inLeft, a), _mm256_andnot_ps(inLeft, small)), lmax[k]);
+				rmin[k] = _mm256_min_ps(_mm256_or_ps(_mm256_and_ps(inRight, a), _mm256_andnot_ps(inRight, big)), rmin[k]);
+				rmax[k] = _mm256_max_ps(_mm256_or_ps(_mm256_and_ps(inRight, a), _mm256_andnot_ps(inRight, small)), rmax[k]);
+
+				__m256 xmin = _mm256_or_ps(_mm256_and_ps(crosses, x), _mm256_andnot_ps(crosses, big));
+				__m256 xmax = _mm256_or_ps(_mm256_and_ps(crosses, x), _mm256_andnot_ps(crosses, small));
+				lmin[k] = _mm256_min_ps(xmin, lmin[k]);
+				lmax[k] = _mm256_max_ps(xmax, lmax[k]);
+				rmin[k] = _mm256_min_ps(xmin, rmin[k]);
+				rmax[k] = _mm256_max_ps(xmax, rmax[k]);
+			}
+		}
+
+		for (int k = 0; k < 3; k++)
+		{
+			_mm256_storeu_ps(&out.lmin[k][j], lmin[k]);
+			_mm256_storeu_ps(&out.lmax[k][j], lmax[k]);
+			_mm256_storeu_ps(&out.rmin[k][j], rmin[k]);
+			_mm256_storeu_ps(&out.rmax[k][j], rmax[k]);
+		}
+		_mm256_storeu_ps(&out.lmax[dim][j], coord);
+		_mm256_storeu_ps(&out.rmin[dim][j], coord);
+	}
+}
+
+// Most references span a few bins only, these are cheaper with 4 lanes
+TARGET_AVX
+static void clipToPlanesMixed(const float3 (&verts)[3], U32 dim, F32 origin, F32 step, U32 first, U32 count, PlaneBounds &out)
+{
+	if (count > 4)
+		clipToPlanesAVX(verts, dim, origin, step, first, count, out);
+	else
+		clipToPlanesSSE(verts, dim, origin, step, first, count, out);
+}
+
+static bool cpuHasAVX(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	return osxsave && avx && (_xgetbv(0) & 0x6) == 0x6; // OS saves YMM state
+#else
+	return __builtin_cpu_supports("avx") != 0;
+#endif
+}
+
+#endif
+
+typedef void (*ClipFunc)(const float3 (&)[3], U32, F32, F32, U32, U32, PlaneBounds&);
+
+struct ClipImplementation
+{
+	ClipFunc func;
+	const char *name;
+};
+
+static ClipImplementation selectImplementation(void)
+{
+#ifdef SPATIAL_BINS_X86
+	if (cpuHasAVX())
+		return { clipToPlanesMixed, "AVX" };
+	return { clipToPlanesSSE, "SSE" };
+#else
+	return { clipToPlanesScalar, "scalar" };
+#endif
+}
+
+static const ClipImplementation& implementation(void)
+{
+	static const ClipImplementation impl = selectImplementation();
+	return impl;
+}
+
+void clipToPlanes(const float3 (&verts)[3], U32 dim, F32 origin, F32 step, U32 first, U32 count, PlaneBounds &out)
+{
+	assert(count <= MaxClipPlanes);
+	implementation().func(verts, dim, origin, step, first, count, out);
+}
+
+const char* clipImplementationName(void)
+{
+	return implementation().name;
+}
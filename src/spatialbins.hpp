@@ -0,0 +1,40 @@
+#pragma once
+
+#include "rtutil.hpp"
+
+/*
+	Triangle clipping for SBVH spatial binning.
+	A triangle is clipped against a run of equally spaced planes 'origin + step * i' along one axis,
+	several planes at once with SSE (4) or AVX (8). The implementation is picked at runtime from CPU features.
+	Results match the scalar clipper exactly.
+*/
+
+enum
+{
+	MaxClipPlanes = 128
+};
+
+// Unclipped per-plane bounds of the triangle parts left and right of each plane, stored per component
+struct PlaneBounds
+{
+	F32 lmin[3][MaxClipPlanes];
+	F32 lmax[3][MaxClipPlanes];
+	F32 rmin[3][MaxClipPlanes];
+	F32 rmax[3][MaxClipPlanes];
+
+	inline AABB_t left(U32 j) const {
+		return AABB_t(float3(lmin[0][j], lmin[1][j], lmin[2][j]), float3(lmax[0][j], lmax[1][j], lmax[2][j]));
+	}
+	inline AABB_t right(U32 j) const {
+		return AABB_t(float3(rmin[0][j], rmin[1][j], rmin[2][j]), float3(rmax[0][j], rmax[1][j], rmax[2][j]));
+	}
+};
+
+// Bounds of the triangle on both sides of a single plane
+void clipToPlane(const float3 (&verts)[3], U32 dim, F32 coord, AABB_t &lbox, AABB_t &rbox);
+
+// Bounds for planes 'first' to 'first + count - 1', count at most MaxClipPlanes
+void clipToPlanes(const float3 (&verts)[3], U32 dim, F32 origin, F32 step, U32 first, U32 count, PlaneBounds &out);
+
+// Name of the implementation used by clipToPlanes
+const char* clipImplementationName(void);
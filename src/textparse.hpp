@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "rtutil.hpp"
+
+// Number parsing on memory mapped text, which is not null-terminated.
+// Model loaders only, see objloader.cpp and plyloader.cpp
+
+inline bool isBlank(char c) { return c == ' ' || c == '\t'; }
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+inline bool isLineEnd(char c) { return c == '\n' || c == '\r'; }
+
+inline void skipBlank(const char *&p, const char *end)
+{
+    while (p < end && isBlank(*p)) p++;
+}
+
+inline void skipLine(const char *&p, const char *end)
+{
+    const char *nl = (const char*)memchr(p, '\n', end - p);
+    p = nl ? nl + 1 : end;
+}
+
+// Decimal float without locale or null terminator, up to 19 significant digits
+inline bool parseFloat(const char *&p, const char *end, float &value)
+{
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char *s = p;
+    skipBlank(s, end);
+
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = (*s++ == '-');
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; s < end && isDigit(*s); s++, any = true)
+    {
+        if (digits < 19) { mantissa = mantissa * 10 + (*s - '0'); digits += (mantissa > 0); }
+        else exponent++;
+    }
+    if (s < end && *s == '.')
+    {
+        for (s++; s < end && isDigit(*s); s++, any = true)
+        {
+            if (digits < 19) { mantissa = mantissa * 10 + (*s - '0'); digits += (mantissa > 0); exponent--; }
+        }
+    }
+    if (!any)
+        return false;
+
+    if (s < end && (*s == 'e' || *s == 'E'))
+    {
+        const char *e = s + 1;
+        bool negExp = false;
+        if (e < end && (*e == '-' || *e == '+'))
+            negExp = (*e++ == '-');
+        if (e < end && isDigit(*e))
+        {
+            int x = 0;
+            for (; e < end && isDigit(*e); e++)
+                x = std::min(x * 10 + (*e - '0'), 9999);
+            exponent += negExp ? -x : x;
+            s = e;
+        }
+    }
+
+    double v = (double)mantissa;
+    if (exponent < 0)
+        v = (exponent >= -22) ? v / pow10[-exponent] : v * std::pow(10.0, exponent);
+    else if (exponent > 0)
+        v = (exponent <= 22) ? v * pow10[exponent] : v * std::pow(10.0, exponent);
+
+    value = (float)(negative ? -v : v);
+    p = s;
+    return true;
+}
+
+inline bool parseInt(const char *&p, const char *end, S32 &value)
+{
+    const char *s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = (*s++ == '-');
+    if (s == end || !isDigit(*s))
+        return false;
+
+    int64_t v = 0;
+    for (; s < end && isDigit(*s); s++)
+        v = std::min<int64_t>(v * 10 + (*s - '0'), INT32_MAX);
+
+    value = (S32)(negative ? -v : v);
+    p = s;
+    return true;
+}
@@ -2,6 +2,7 @@
 #include "IL/il.h"
 #include "IL/ilu.h"
 #include <iostream>
+#include <cstring>
 
 inline void checkILErrors()
 {
@@ -38,4 +39,11 @@ Texture::Texture(const std::string path, const std::string filename)
     }
 
     ilDeleteImages(1, &ImageName);
-}
\ No newline at end of file
+}
+
+Texture::Texture(const std::string name, cl_uint width, cl_uint height, const cl_uchar *pixels)
+    : name(name), width(width), height(height)
+{
+    data = new cl_uchar[width * height * 4 * 1];
+    std::memcpy(data, pixels, width * height * 4 * 1);
+}
@@ -10,6 +10,7 @@ class Texture
 public:
     //Texture() : width(0), height(0), data(NULL) {} // default constructor
     Texture(const std::string path, const std::string name);
+    Texture(const std::string name, cl_uint width, cl_uint height, const cl_uchar *pixels); // RGBA8, copied
     ~Texture() { if (data) delete[] data; }
 
     cl_uchar *getData() { return data; }
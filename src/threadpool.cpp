@@ -0,0 +1,172 @@
+#include <iterator>
+#include "threadpool.hpp"
+#include "settings.hpp"
+
+// Index of the queue owned by the current thread, -1 for threads outside of any pool
+static thread_local int workerIndex = -1;
+static thread_local const ThreadPool *workerPool = nullptr;
+
+ThreadPool &ThreadPool::getInstance()
+{
+    static ThreadPool instance(Settings::getInstance().getBvhBuildThreads());
+    return instance;
+}
+
+ThreadPool::ThreadPool(unsigned int numThreads) : numQueued(0)
+{
+    unsigned int numWorkers = (numThreads > 1) ? numThreads - 1 : 0;
+    for (unsigned int i = 0; i < numWorkers + 1; i++)
+    {
+        queues.emplace_back(new Queue());
+    }
+
+    for (unsigned int i = 0; i < numWorkers; i++)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(sleepLock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+
+    for (std::thread &t : workers)
+    {
+        t.join();
+    }
+}
+
+// Workers use their own deque, everyone else shares the last one
+unsigned int ThreadPool::ownQueue() const
+{
+    return (workerPool == this) ? (unsigned int)workerIndex : (unsigned int)workers.size();
+}
+
+void ThreadPool::submit(TaskGroup &group, std::function<void()> func)
+{
+    group.pending++;
+
+    // No workers => run immediately, keeps single-threaded builds depth-first
+    if (workers.size() == 0)
+    {
+        Task task = { std::move(func), &group };
+        execute(task);
+        return;
+    }
+
+    Queue &q = *queues[ownQueue()];
+    {
+        std::unique_lock<std::mutex> lock(q.lock);
+        q.tasks.push_back({ std::move(func), &group });
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(sleepLock);
+        numQueued++;
+    }
+    wakeup.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup &group)
+{
+    while (group.pending > 0)
+    {
+        Task task;
+        if (tryPop(task, &group) || trySteal(task, &group))
+            execute(task);
+        else
+            std::this_thread::yield();
+    }
+
+    if (group.error)
+    {
+        std::exception_ptr e = group.error;
+        group.error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+// Newest task of own queue
+bool ThreadPool::tryPop(Task &task, const TaskGroup *group)
+{
+    Queue &q = *queues[ownQueue()];
+    std::unique_lock<std::mutex> lock(q.lock);
+    for (auto it = q.tasks.rbegin(); it != q.tasks.rend(); ++it)
+    {
+        if (group && it->group != group)
+            continue;
+
+        task = std::move(*it);
+        q.tasks.erase(std::next(it).base());
+        numQueued--;
+        return true;
+    }
+
+    return false;
+}
+
+// Oldest task of some other queue
+bool ThreadPool::trySteal(Task &task, const TaskGroup *group)
+{
+    const unsigned int own = ownQueue();
+    const unsigned int N = (unsigned int)queues.size();
+    for (unsigned int i = 1; i < N; i++)
+    {
+        Queue &q = *queues[(own + i) % N];
+        std::unique_lock<std::mutex> lock(q.lock);
+        for (auto it = q.tasks.begin(); it != q.tasks.end(); ++it)
+        {
+            if (group && it->group != group)
+                continue;
+
+            task = std::move(*it);
+            q.tasks.erase(it);
+            numQueued--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::execute(Task &task)
+{
+    try
+    {
+        task.func();
+    }
+    catch (...)
+    {
+        std::unique_lock<std::mutex> lock(task.group->errorLock);
+        if (!task.group->error)
+            task.group->error = std::current_exception();
+    }
+
+    task.group->pending--;
+}
+
+void ThreadPool::workerLoop(unsigned int id)
+{
+    workerIndex = (int)id;
+    workerPool = this;
+
+    while (true)
+    {
+        Task task;
+        if (tryPop(task, nullptr) || trySteal(task, nullptr))
+        {
+            execute(task);
+            continue;
+        }
+
+        // Sleep until new work arrives
+        std::unique_lock<std::mutex> lock(sleepLock);
+        wakeup.wait(lock, [this]() { return stopping || numQueued > 0; });
+        if (stopping)
+            return;
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <memory>
+
+// Keeps track of outstanding tasks, see ThreadPool::wait()
+class TaskGroup
+{
+    friend class ThreadPool;
+
+public:
+    TaskGroup(void) : pending(0) {}
+
+private:
+    std::atomic<int> pending;
+    std::mutex errorLock;
+    std::exception_ptr error; // first exception thrown by a task
+};
+
+/*
+    Work-stealing thread pool used for hierarchy construction.
+    Every worker owns a task deque: tasks are pushed and popped at the back (depth-first),
+    idle workers steal from the front of other deques (largest tasks first in fork-join builds).
+    A thread waiting on a task group executes queued tasks of that group instead of blocking,
+    so that a waiting thread never picks up unrelated work (e.g. a background build).
+*/
+class ThreadPool
+{
+public:
+    // Singleton pattern, sized by settings
+    static ThreadPool &getInstance();
+
+    ThreadPool(unsigned int numThreads); // total number of threads, including the waiting thread
+    ~ThreadPool();
+    ThreadPool(ThreadPool const&) = delete;
+    void operator=(ThreadPool const&) = delete;
+
+    // Tasks may submit more tasks into the same group
+    void submit(TaskGroup &group, std::function<void()> func);
+
+    // Help executing tasks of the group until it is done, rethrows task exceptions
+    void wait(TaskGroup &group);
+
+    // Runs func(i) for i in [0, count) as separate tasks, returns when all are done
+    template<typename F>
+    void parallelFor(unsigned int count, const F &func)
+    {
+        TaskGroup group;
+        for (unsigned int i = 0; i < count; i++)
+            submit(group, [&func, i]() { func(i); });
+        wait(group);
+    }
+
+    unsigned int getNumThreads() const { return (unsigned int)workers.size() + 1; }
+
+private:
+    struct Task
+    {
+        std::function<void()> func;
+        TaskGroup *group;
+    };
+
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    bool tryPop(Task &task, const TaskGroup *group);   // null group: any task
+    bool trySteal(Task &task, const TaskGroup *group);
+    void execute(Task &task);
+    void workerLoop(unsigned int id);
+    unsigned int ownQueue() const;
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues; // one per worker + one shared by external threads
+    std::atomic<int> numQueued;
+    std::mutex sleepLock;
+    std::condition_variable wakeup;
+    bool stopping = false;
+};
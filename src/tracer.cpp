@@ -1,12 +1,18 @@
 #include "tracer.hpp"
+#include "lbvh.hpp"
+#include "twolevelbvh.hpp"
 #include "window.hpp"
 #include "progressview.hpp"
 #include "clcontext.hpp"
 #include "settings.hpp"
+#include "bvhtuning.hpp"
+#include "cachefile.hpp"
 #include "utils.h"
 #include "geom.h"
 
-Tracer::Tracer(int width, int height) : useWavefront(true)
+Tracer::Tracer(int width, int height) :
+    hierarchyCache("data/hierarchies", (size_t)Settings::getInstance().getHierarchyCacheMiB() * 1024 * 1024),
+    useWavefront(true)
 {
     resetParams(width, height);
 
@@ -53,13 +59,29 @@ void Tracer::resetParams(int width, int height)
 // Run whenever a scene is loaded
 void Tracer::init(int width, int height, std::string sceneFile)
 {
+    // Builder still uses the triangles of the previous scene
+    cancelHierarchyUpgrade();
     resetParams(width, height);
 
     window->showMessage("Loading scene");
     selectScene(sceneFile);
     loadState();
+
+    // Build parameters tuned earlier for this device
+    bool tuneHierarchy = false;
+    Settings &s = Settings::getInstance();
+    const SplitMode splitMode = parseSplitMode(s.getBvhSplitMode());
+    if (s.getBvhAutotune() && !s.getBvhInstancing() && hasTuningParameters(splitMode, s.getBvhOptimizePasses()))
+    {
+        BVHTuning tuning;
+        if (loadTuning(clctx->getDeviceName(), splitMode, s.getBvhOptimizePasses(), tuning))
+            tuning.apply();
+        else
+            tuneHierarchy = true;
+    }
+
     window->showMessage("Creating BVH");
-    initHierarchy();
+    initHierarchy(!tuneHierarchy); // tuning replaces the hierarchy anyway
 
     // Diagonal gives maximum ray length within the scene
     AABB_t bounds = bvh->getSceneBounds();
@@ -68,6 +90,15 @@ void Tracer::init(int width, int height, std::string sceneFile)
     window->showMessage("Uploading scene data");
     clctx->uploadSceneData(bvh, scene.get());
 
+    if (tuneHierarchy)
+        autotuneHierarchy();
+
+    // Mapping must be closed before the package can be replaced.
+    // With a pending upgrade, the package is written with the final hierarchy.
+    scenePackage.reset();
+    if (scenePackageStale && !upgradeThread.joinable())
+        saveScenePackage();
+
     // Data uploaded to GPU => no longer needed
     delete bvh;
 
@@ -196,6 +227,9 @@ void Tracer::update()
     glfwPollEvents();
     pollKeys(deltaT);
 
+    // Between frames => no kernels use the old buffers
+    updateHierarchy(false);
+
     glFinish(); // locks execution to refresh rate of display (GL)
 
     // Update RenderParams in GPU memory if needed
@@ -416,6 +450,7 @@ void Tracer::runBenchmark()
     for (int i = 0; i < scenes.size(); i++) {
         std::string counter = std::to_string(i + 1) + "/" + std::to_string(scenes.size());
         init(params.width, params.height, scenes[i]);
+        updateHierarchy(true); // measure the final hierarchy
         resetRenderer();
 
         double startT = glfwGetTime();
@@ -536,7 +571,15 @@ void Tracer::selectScene(std::string file)
     }
 
     scene.reset(new Scene());
-    scene->loadModel(file, window->getProgressView());
+    scenePackage.reset();
+    scenePackageStale = false;
+    if (!loadScenePackage(file))
+    {
+        scene.reset(new Scene()); // package might have been partially imported
+        scene->loadModel(file, window->getProgressView());
+        scenePackageStale = Settings::getInstance().getSceneCache();
+    }
+
     if (envMap)
         scene->setEnvMap(envMap);
 
@@ -569,27 +612,82 @@ void Tracer::initEnvMap()
     }
 }
 
+// Doesn't touch renderer state, safe to call from a background thread.
+// A raised cancel flag leaves the result unusable.
+static BVH *buildHierarchy(TriangleMesh &triangles, SplitMode splitMode, ProgressView *progress, U32 optimizePasses, const std::atomic<bool> *cancel = nullptr)
+{
+    BVH *result;
+    switch (builderForSplitMode(splitMode))
+    {
+    case HierarchyBuilder_LBVH:
+        result = new LBVH(&triangles);
+        break;
+    case HierarchyBuilder_BVH:
+        result = new BVH(&triangles, splitMode);
+        break;
+    default:
+        result = new SBVH(&triangles, splitMode, progress, cancel);
+        break;
+    }
+
+    if (optimizePasses > 0 && !(cancel && *cancel))
+        result->optimizeTreelets(optimizePasses, cancel);
+
+    return result;
+}
+
 // Check if old hierarchy can be reused
-void Tracer::initHierarchy()
+void Tracer::initHierarchy(bool progressive)
 {
-	std::string hashFile = "data/hierarchies/hierarchy_" + sceneHash + ".bin";
-    std::ifstream input(hashFile, std::ios::in);
+    std::string hashFile = hierarchyFile();
 
-    if (input.good())
+    if (Settings::getInstance().getBvhInstancing())
+    {
+        // Instances and object space meshes are not part of the cache
+        std::cout << "Building two-level BVH..." << std::endl;
+        SplitMode mode = parseSplitMode(Settings::getInstance().getBvhSplitMode());
+        m_triangles = &scene->getTriangles();
+        bvh = new TwoLevelBVH(m_triangles, scene->getMeshes(), mode, window->getProgressView());
+        params.n_tris = (cl_uint)m_triangles->size();
+    }
+    else if (scenePackage && loadHierarchy(*scenePackage, scene->getTriangles()))
+    {
+        std::cout << "Reusing packaged BVH..." << std::endl;
+    }
+    else if (loadHierarchy(hashFile, scene->getTriangles()))
     {
         std::cout << "Reusing BVH..." << std::endl;
-        loadHierarchy(hashFile, scene->getTriangles());
+        scenePackageStale = Settings::getInstance().getSceneCache();
     }
     else
     {
-        std::cout << "Building BVH..." << std::endl;
-        constructHierarchy(scene->getTriangles(), SplitMode_Sah, window->getProgressView());
-        saveHierarchy(hashFile);
+        SplitMode mode = parseSplitMode(Settings::getInstance().getBvhSplitMode());
+        SplitMode previewMode = parseSplitMode(Settings::getInstance().getBvhPreviewMode());
+        if (progressive && Settings::getInstance().getBvhProgressive() && previewMode != mode)
+        {
+            // Preview hierarchy is not cached, the final one is saved when swapped in
+            std::cout << "Building preview BVH..." << std::endl;
+            m_triangles = &scene->getTriangles();
+            params.n_tris = (cl_uint)m_triangles->size();
+            bvh = buildHierarchy(*m_triangles, previewMode, window->getProgressView(), 0);
+            startHierarchyUpgrade(mode);
+        }
+        else
+        {
+            std::cout << "Building BVH..." << std::endl;
+            constructHierarchy(scene->getTriangles(), mode, window->getProgressView());
+            saveHierarchy(hashFile);
+            scenePackageStale = Settings::getInstance().getSceneCache();
+        }
     }
+
+    // Cheap, not part of the cached hierarchy
+    bvh->reorderNodes(parseNodeLayout(Settings::getInstance().getBvhNodeLayout()));
 }
 
 Tracer::~Tracer()
 {
+    cancelHierarchyUpgrade();
     delete window;
     delete clctx;
 }
@@ -737,23 +835,260 @@ void Tracer::saveImage()
     clctx->saveImage(fileName, params);
 }
 
-void Tracer::loadHierarchy(const std::string filename, std::vector<RTTriangle>& triangles)
+// False if there is no usable cached hierarchy
+bool Tracer::loadHierarchy(const std::string filename, TriangleMesh &triangles)
 {
     m_triangles = &triangles;
     params.n_tris = (cl_uint)m_triangles->size();
-    bvh = new SBVH(m_triangles, filename);
+
+    try
+    {
+        bvh = new SBVH(m_triangles, filename);
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cout << e.what() << std::endl;
+        bvh = nullptr;
+        return false;
+    }
+
+    if (!checkBuildInfo())
+        return false;
+
+    hierarchyCache.touch(filename);
+    return true;
+}
+
+// False if the package contains no hierarchy (two-level hierarchies are not packaged)
+bool Tracer::loadHierarchy(const CacheReader &package, TriangleMesh &triangles)
+{
+    m_triangles = &triangles;
+    params.n_tris = (cl_uint)m_triangles->size();
+
+    try
+    {
+        bvh = new SBVH(m_triangles, package);
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cout << e.what() << std::endl;
+        bvh = nullptr;
+        return false;
+    }
+
+    return checkBuildInfo();
+}
+
+// Discards a loaded hierarchy built with other parameters than the current settings
+bool Tracer::checkBuildInfo()
+{
+    HierarchyBuildInfo expected = HierarchyBuildInfo::fromSettings(parseSplitMode(Settings::getInstance().getBvhSplitMode()));
+    if (bvh->getBuildInfo() == expected)
+        return true;
+
+    std::cout << "Cached BVH was built with " << bvh->getBuildInfo().describe() << ", expected " << expected.describe() << std::endl;
+    delete bvh;
+    bvh = nullptr;
+    return false;
 }
 
 void Tracer::saveHierarchy(const std::string filename)
 {
     bvh->exportTo(filename);
+    hierarchyCache.insert(filename, sceneHash, bvh->getBuildInfo());
+}
+
+// Keyed by scene and build parameters, several variants per scene
+std::string Tracer::hierarchyFile()
+{
+    HierarchyBuildInfo info = HierarchyBuildInfo::fromSettings(parseSplitMode(Settings::getInstance().getBvhSplitMode()));
+    return hierarchyCache.fileName(sceneHash, info);
 }
 
-void Tracer::constructHierarchy(std::vector<RTTriangle>& triangles, SplitMode splitMode, ProgressView *progress)
+// Skips OBJ/PLY parsing and texture decoding, keyed by the hash of the model file.
+// Scene::importFrom rejects the package if a referenced MTL file or texture has changed.
+bool Tracer::loadScenePackage(const std::string file)
+{
+    if (!Settings::getInstance().getSceneCache())
+        return false;
+
+    auto time1 = std::chrono::high_resolution_clock::now();
+    size_t hash = fileHash(file);
+    sceneHash = std::to_string(hash);
+
+    std::unique_ptr<CacheReader> package(new CacheReader());
+    if (!package->open(scenePackageFile(), CacheKind_Scene) || !scene->importFrom(*package, hash))
+        return false;
+
+    auto time2 = std::chrono::high_resolution_clock::now();
+    std::cout << "Scene package: " << scene->getTriangles().size() << " triangles, " << package->bytes() / (1024 * 1024) << " MiB, "
+        << std::chrono::duration<double, std::milli>(time2 - time1).count() << " ms" << std::endl;
+
+    scenePackage = std::move(package);
+    return true;
+}
+
+// Scene with the current hierarchy. Packages without one are loaded, but the hierarchy is rebuilt.
+void Tracer::saveScenePackage(bool withHierarchy)
+{
+    CacheWriter writer(CacheKind_Scene);
+    scene->exportTo(writer);
+    if (withHierarchy && !Settings::getInstance().getBvhInstancing())
+        bvh->exportTo(writer);
+
+    if (writer.write(scenePackageFile()))
+        std::cout << "Scene package written" << std::endl;
+    else
+        std::cout << "Could not write scene package!" << std::endl;
+
+    scenePackageStale = false;
+}
+
+std::string Tracer::scenePackageFile()
+{
+    return "data/scenes/scene_" + sceneHash + ".bin";
+}
+
+// Build each candidate parameter set, time extension and shadow kernels on the same ray batch.
+// The fastest set is stored per device and applied on later runs, its hierarchy replaces the cached one.
+void Tracer::autotuneHierarchy()
+{
+    const int repetitions = 5;
+    Settings &s = Settings::getInstance();
+    SplitMode mode = parseSplitMode(s.getBvhSplitMode());
+    NodeLayout layout = parseNodeLayout(s.getBvhNodeLayout());
+    std::vector<BVHTuning> candidates = tuningCandidates(BVHTuning::fromSettings(), mode, s.getBvhOptimizePasses());
+
+    // Ray batch: state after the first bounce, as in update()
+    window->showMessage("Tuning BVH");
+    clctx->updateParams(params);
+    clctx->resetPixelIndex();
+    clctx->enqueueWfResetKernel(params);
+    clctx->enqueueWfRaygenKernel(params);
+    clctx->enqueueWfExtRayKernel(params);
+    clctx->enqueueClearWfQueues();
+    clctx->enqueueWfLogicKernel(params, true);
+    clctx->enqueueWfRaygenKernel(params);
+    clctx->enqueueWfMaterialKernels(params);
+    clctx->saveRayBatch();
+
+    // Currently uploaded hierarchy might come from the cache, so the base parameters are rebuilt too
+    delete bvh;
+    bvh = nullptr;
+
+    int best = 0;
+    for (int i = 0; i < candidates.size(); i++)
+    {
+        BVHTuning &t = candidates[i];
+        t.apply();
+        constructHierarchy(scene->getTriangles(), mode, window->getProgressView());
+        bvh->reorderNodes(layout);
+        clctx->uploadHierarchy(bvh);
+        t.traceMs = (float)clctx->timeRayBatch(repetitions);
+        std::cout << "BVH tuning (" << i + 1 << "/" << candidates.size() << "): " << t.describe() << ": " << t.traceMs << " ms" << std::endl;
+
+        if (t.traceMs < candidates[best].traceMs)
+            best = i;
+
+        delete bvh;
+        bvh = nullptr;
+    }
+
+    const BVHTuning &winner = candidates[best];
+    std::cout << "Selected BVH parameters: " << winner.describe() << std::endl;
+    winner.apply();
+    saveTuning(clctx->getDeviceName(), mode, s.getBvhOptimizePasses(), winner);
+
+    // Rebuilding is cheaper in memory than keeping the best candidate around
+    constructHierarchy(scene->getTriangles(), mode, window->getProgressView());
+    saveHierarchy(hierarchyFile());
+    bvh->reorderNodes(layout);
+    clctx->uploadHierarchy(bvh);
+    clctx->resetStats(); // tuning rays are not part of the render
+    scenePackageStale = Settings::getInstance().getSceneCache();
+}
+
+void Tracer::constructHierarchy(TriangleMesh &triangles, SplitMode splitMode, ProgressView *progress)
 {
     m_triangles = &triangles;
     params.n_tris = (cl_uint)m_triangles->size();
-    bvh = new SBVH(m_triangles, splitMode, progress);
+    bvh = buildHierarchy(triangles, splitMode, progress, Settings::getInstance().getBvhOptimizePasses());
+}
+
+// Final hierarchy of the current scene, rendering continues on the preview hierarchy meanwhile
+void Tracer::startHierarchyUpgrade(SplitMode splitMode)
+{
+    TriangleMesh *triangles = m_triangles;
+    U32 passes = Settings::getInstance().getBvhOptimizePasses();
+    upgradeReady = false;
+    upgradeCancelled = false;
+    upgradeThread = std::thread([this, triangles, splitMode, passes]()
+    {
+        auto time1 = std::chrono::high_resolution_clock::now();
+        try
+        {
+            upgradeBvh = buildHierarchy(*triangles, splitMode, nullptr, passes, &upgradeCancelled); // progress view belongs to the main thread
+        }
+        catch (std::exception &e)
+        {
+            std::cout << "Background BVH build failed: " << e.what() << std::endl;
+            upgradeBvh = nullptr;
+        }
+
+        auto time2 = std::chrono::high_resolution_clock::now();
+        if (upgradeCancelled)
+            std::cout << "Background BVH build cancelled" << std::endl;
+        else
+            std::cout << "Background BVH build: " << std::chrono::duration<double, std::milli>(time2 - time1).count() << " ms" << std::endl;
+        upgradeReady = true;
+    });
+}
+
+// Called between frames. Paths in flight only reference triangles, which don't change,
+// so accumulation continues across the swap.
+void Tracer::updateHierarchy(bool wait)
+{
+    if (!upgradeThread.joinable() || (!wait && !upgradeReady))
+        return;
+
+    upgradeThread.join();
+    upgradeReady = false;
+    if (!upgradeBvh)
+    {
+        // Keep rendering with the preview hierarchy, which is not cached
+        if (scenePackageStale)
+        {
+            std::cout << "Writing scene package without hierarchy" << std::endl;
+            saveScenePackage(false);
+        }
+        return;
+    }
+
+    bvh = upgradeBvh;
+    upgradeBvh = nullptr;
+    saveHierarchy(hierarchyFile());
+    bvh->reorderNodes(parseNodeLayout(Settings::getInstance().getBvhNodeLayout()));
+
+    if (Settings::getInstance().getSceneCache())
+        saveScenePackage();
+
+    clctx->uploadHierarchy(bvh);
+    delete bvh;
+    bvh = nullptr;
+    std::cout << "Switched to final BVH" << std::endl;
+}
+
+// Stops the builder early, its result is discarded
+void Tracer::cancelHierarchyUpgrade()
+{
+    if (!upgradeThread.joinable())
+        return;
+
+    upgradeCancelled = true;
+    upgradeThread.join();
+    delete upgradeBvh;
+    upgradeBvh = nullptr;
+    upgradeReady = false;
 }
 
 void Tracer::initCamera()
@@ -5,7 +5,10 @@
 #include <nanogui/nanogui.h>
 #include <string>
 #include <map>
+#include <thread>
+#include <atomic>
 #include "sbvh.hpp"
+#include "hierarchycache.hpp"
 #include "scene.hpp"
 #include "math/float2.hpp"
 #include "math/float3.hpp"
@@ -22,6 +25,7 @@ class CLContext;
 class PTWindow;
 class BVH;
 class Scene;
+class CacheReader;
 
 struct FloatWidget;
 
@@ -77,10 +81,22 @@ private:
 
 private:
     // Create/load/export BVH
-    void initHierarchy();
-    void loadHierarchy(const std::string filename, std::vector<RTTriangle> &triangles);
+    void initHierarchy(bool progressive);
+    bool loadHierarchy(const std::string filename, TriangleMesh &triangles);
+    bool loadHierarchy(const CacheReader &package, TriangleMesh &triangles);
+    bool checkBuildInfo();
     void saveHierarchy(const std::string filename);
-    void constructHierarchy(std::vector<RTTriangle>& triangles, SplitMode splitMode, ProgressView* progress);
+    void constructHierarchy(TriangleMesh &triangles, SplitMode splitMode, ProgressView* progress);
+    void autotuneHierarchy(); // select build parameters for the current device
+    void startHierarchyUpgrade(SplitMode splitMode);
+    void updateHierarchy(bool wait); // swap in the upgraded hierarchy when ready
+    void cancelHierarchyUpgrade();
+    std::string hierarchyFile();
+
+    // Parsed scene and its hierarchy in a single mapped file
+    bool loadScenePackage(const std::string file);
+    void saveScenePackage(bool withHierarchy = true);
+    std::string scenePackageFile();
 
     void pollKeys(float deltaT); // movement keys
     void updateCamera();
@@ -128,8 +144,17 @@ private:
     std::shared_ptr<Scene> scene;
     std::shared_ptr<EnvironmentMap> envMap;
     BVH *bvh = nullptr;
-    std::vector<RTTriangle>* m_triangles;
+    TriangleMesh *m_triangles;
     std::string sceneHash;
+    HierarchyCache hierarchyCache;
+    std::unique_ptr<CacheReader> scenePackage; // mapped until the scene is uploaded
+    bool scenePackageStale = false; // written after upload
+
+    // Final hierarchy built in the background while rendering on a preview one
+    std::thread upgradeThread;
+    std::atomic<bool> upgradeReady { false };
+    std::atomic<bool> upgradeCancelled { false }; // checked by the build tasks
+    BVH *upgradeBvh = nullptr;
     cl_uint iteration;
     int frontBuffer = 0;
     bool hasEnvMap = false;
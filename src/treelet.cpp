@@ -0,0 +1,292 @@
+#include <cassert>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include "treelet.hpp"
+#include "threadpool.hpp"
+
+TreeletOptimizer::TreeletOptimizer(std::vector<Node> &nodes, std::vector<U32> &indices, F32 costBox, F32 costTri, const std::atomic<bool> *cancel)
+	: m_nodes(nodes), m_indices(indices), costBox(costBox), costTri(costTri), cancel(cancel)
+{
+}
+
+bool TreeletOptimizer::optimize(U32 passes, U32 maxDepth)
+{
+	if (m_nodes.size() < 3)
+		return true;
+
+	load();
+
+	// Later passes only revisit larger subtrees (gamma doubled per pass)
+	for (U32 pass = 0; pass < passes; pass++)
+	{
+		runPass(TreeletLeaves << pass);
+	}
+
+	if (cancel && *cancel)
+		return false;
+
+	std::vector<Node> nodes;
+	std::vector<U32> indices;
+	nodes.reserve(m_nodes.size());
+	indices.reserve(m_indices.size());
+	U32 depth = store(0, -1, 0, nodes, indices);
+	if (depth > maxDepth)
+		return false;
+
+	m_nodes.swap(nodes);
+	m_indices.swap(indices);
+	return true;
+}
+
+// Explicit child links, so that treelets can be rewired in place
+void TreeletOptimizer::load()
+{
+	m_tree.resize(m_nodes.size());
+	for (U32 i = 0; i < m_nodes.size(); i++)
+	{
+		const Node &n = m_nodes[i];
+		TreeletNode &t = m_tree[i];
+		t.box = n.box;
+		t.parent = n.parent;
+		if (n.nPrims > 0)
+		{
+			t.iStart = n.iStart;
+			t.nPrims = t.tris = n.nPrims;
+			t.cost = costTri * n.nPrims * n.box.area();
+		}
+		else
+		{
+			t.left = n.leftChild;
+			t.right = n.rightChild;
+		}
+	}
+
+	// Children are stored after their parents in every layout
+	for (size_t i = m_tree.size(); i-- > 0;)
+	{
+		if (m_tree[i].left != -1)
+			refit((S32)i);
+	}
+}
+
+// Bottom-up traversal: the second thread to reach a node processes it,
+// at which point both child subtrees are final and owned by this thread.
+void TreeletOptimizer::runPass(U32 minTris)
+{
+	std::vector<S32> leaves;
+	for (U32 i = 0; i < m_tree.size(); i++)
+	{
+		if (m_tree[i].left == -1)
+			leaves.push_back((S32)i);
+	}
+
+	std::unique_ptr<std::atomic<U32>[]> visits(new std::atomic<U32>[m_tree.size()]);
+	for (U32 i = 0; i < m_tree.size(); i++)
+		visits[i] = 0;
+
+	const U32 ChunkSize = 1024;
+	const U32 numLeaves = (U32)leaves.size();
+	const U32 numChunks = (numLeaves + ChunkSize - 1) / ChunkSize;
+	ThreadPool::getInstance().parallelFor(numChunks, [&](U32 c)
+	{
+		if (cancel && *cancel)
+			return; // result is discarded
+
+		for (U32 i = c * ChunkSize; i < std::min(numLeaves, (c + 1) * ChunkSize); i++)
+		{
+			S32 ni = m_tree[leaves[i]].parent;
+			while (ni != -1 && visits[ni]++ > 0)
+			{
+				refit(ni);
+				if (m_tree[ni].tris >= minTris)
+					restructure(ni);
+				ni = m_tree[ni].parent; // root of a treelet keeps its slot and parent
+			}
+		}
+	});
+}
+
+// Update inner node from its children
+void TreeletOptimizer::refit(S32 ni)
+{
+	TreeletNode &n = m_tree[ni];
+	const TreeletNode &l = m_tree[n.left];
+	const TreeletNode &r = m_tree[n.right];
+
+	n.box = l.box;
+	n.box.expand(r.box);
+	n.tris = l.tris + r.tris;
+
+	F32 area = n.box.area();
+	F32 innerCost = costBox * area + l.cost + r.cost;
+	F32 leafCost = (n.tris <= MaxLeafPrims) ? costTri * n.tris * area : FLT_MAX;
+	n.collapse = (leafCost < innerCost);
+	n.cost = std::min(innerCost, leafCost);
+}
+
+inline U32 popCount(U32 v)
+{
+	U32 c = 0;
+	for (; v; c++)
+		v &= v - 1;
+	return c;
+}
+
+// Find optimal topology of the treelet rooted at 'root'
+void TreeletOptimizer::restructure(S32 root)
+{
+	Treelet t;
+
+	// Form treelet by expanding the leaf with the largest surface area
+	U32 numLeaves = 2, numInternals = 1;
+	t.internals[0] = root;
+	t.leaves[0] = m_tree[root].left;
+	t.leaves[1] = m_tree[root].right;
+
+	while (numLeaves < TreeletLeaves)
+	{
+		S32 best = -1;
+		F32 bestArea = -1.0f;
+		for (U32 i = 0; i < numLeaves; i++)
+		{
+			const TreeletNode &n = m_tree[t.leaves[i]];
+			F32 area = n.box.area();
+			if (n.left != -1 && area > bestArea)
+			{
+				best = (S32)i;
+				bestArea = area;
+			}
+		}
+
+		if (best == -1)
+			break;
+
+		S32 expanded = t.leaves[best];
+		t.internals[numInternals++] = expanded;
+		t.leaves[best] = m_tree[expanded].left;
+		t.leaves[numLeaves++] = m_tree[expanded].right;
+	}
+
+	// Two leaves have a single topology, already handled by refit
+	if (numLeaves < 3)
+		return;
+
+	// Optimal cost of every subset of treelet leaves.
+	// Proper subsets are numerically smaller, so a linear sweep is bottom-up.
+	const U32 numSubsets = 1 << numLeaves;
+	for (U32 s = 1; s < numSubsets; s++)
+	{
+		U32 low = s & (~s + 1);
+		if (s == low)
+		{
+			const TreeletNode &leaf = m_tree[t.leaves[popCount(low - 1)]];
+			t.boxes[s] = leaf.box;
+			t.tris[s] = leaf.tris;
+			t.costs[s] = leaf.cost;
+			continue;
+		}
+
+		t.boxes[s] = t.boxes[s ^ low];
+		t.boxes[s].expand(t.boxes[low]);
+		t.tris[s] = t.tris[s ^ low] + t.tris[low];
+
+		// Partitions containing the lowest bit, each split is considered once
+		F32 bestSplit = FLT_MAX;
+		for (U32 p = (s - 1) & s; p > 0; p = (p - 1) & s)
+		{
+			if (!(p & low))
+				continue;
+
+			F32 c = t.costs[p] + t.costs[s ^ p];
+			if (c < bestSplit)
+			{
+				bestSplit = c;
+				t.partitions[s] = (U8)p;
+			}
+		}
+
+		F32 area = t.boxes[s].area();
+		F32 innerCost = costBox * area + bestSplit;
+		F32 leafCost = (t.tris[s] <= MaxLeafPrims) ? costTri * t.tris[s] * area : FLT_MAX;
+		t.collapse[s] = (leafCost < innerCost);
+		t.costs[s] = std::min(innerCost, leafCost);
+	}
+
+	// Keep current topology unless strictly better
+	const U32 full = numSubsets - 1;
+	if (t.costs[full] >= m_tree[root].cost * (1.0f - 1e-5f))
+		return;
+
+	U32 nextSlot = 1;
+	reconstruct(t, full, root, nextSlot);
+	assert(nextSlot == numInternals);
+}
+
+// Rewire subtree of 'subset', reusing the slots of the treelet's internal nodes
+void TreeletOptimizer::reconstruct(Treelet &t, U32 subset, S32 ni, U32 &nextSlot)
+{
+	const U32 parts[2] = { t.partitions[subset], subset ^ t.partitions[subset] };
+	S32 children[2];
+	for (U32 c = 0; c < 2; c++)
+	{
+		if (popCount(parts[c]) == 1)
+		{
+			children[c] = t.leaves[popCount(parts[c] - 1)];
+		}
+		else
+		{
+			children[c] = t.internals[nextSlot++];
+			reconstruct(t, parts[c], children[c], nextSlot);
+		}
+		m_tree[children[c]].parent = ni;
+	}
+
+	TreeletNode &n = m_tree[ni];
+	n.left = children[0];
+	n.right = children[1];
+	n.box = t.boxes[subset];
+	n.tris = t.tris[subset];
+	n.cost = t.costs[subset];
+	n.collapse = t.collapse[subset];
+}
+
+// Emit depth-first layout, returns depth of subtree
+U32 TreeletOptimizer::store(S32 ni, S32 parent, U32 depth, std::vector<Node> &nodes, std::vector<U32> &indices) const
+{
+	const TreeletNode &t = m_tree[ni];
+	U32 ind = (U32)nodes.size();
+	nodes.push_back(Node());
+	nodes[ind].box = t.box;
+	nodes[ind].parent = parent;
+
+	if (t.left == -1 || t.collapse)
+	{
+		nodes[ind].iStart = (U32)indices.size();
+		gatherIndices(ni, indices);
+		U32 sp = (U32)indices.size() - nodes[ind].iStart;
+		assert(sp > 0 && sp <= std::numeric_limits<U8>::max());
+		nodes[ind].nPrims = (U8)sp;
+		return depth;
+	}
+
+	nodes[ind].leftChild = ind + 1;
+	U32 ldepth = store(t.left, ind, depth + 1, nodes, indices);
+	nodes[ind].rightChild = (U32)nodes.size(); // save current vector size
+	U32 rdepth = store(t.right, ind, depth + 1, nodes, indices);
+	return std::max(ldepth, rdepth);
+}
+
+// Primitives of all leaves in subtree
+void TreeletOptimizer::gatherIndices(S32 ni, std::vector<U32> &indices) const
+{
+	const TreeletNode &t = m_tree[ni];
+	if (t.left == -1)
+	{
+		indices.insert(indices.end(), m_indices.begin() + t.iStart, m_indices.begin() + t.iStart + t.nPrims);
+		return;
+	}
+
+	gatherIndices(t.left, indices);
+	gatherIndices(t.right, indices);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include "bvhnode.hpp"
+
+/*
+	Treelet restructuring, based on "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies" by Karras & Aila 13.
+	Nodes are processed bottom-up in parallel, the optimal topology of each treelet is found by dynamic programming.
+	Subtrees may also be collapsed into single leaves if that lowers the SAH cost.
+	Works on finished hierarchies, the result is stored depth-first (left child at i + 1).
+*/
+class TreeletOptimizer
+{
+public:
+	TreeletOptimizer(std::vector<Node> &nodes, std::vector<U32> &indices, F32 costBox, F32 costTri, const std::atomic<bool> *cancel = nullptr);
+
+	// Returns false if the result would exceed maxDepth or the cancel flag was raised, hierarchy is then left untouched
+	bool optimize(U32 passes, U32 maxDepth);
+
+private:
+	enum
+	{
+		TreeletLeaves = 7,  // 2^7 subsets per treelet
+		MaxLeafPrims = 8    // collapse limit
+	};
+
+	struct TreeletNode
+	{
+		AABB_t box;
+		S32 left = -1;       // -1 for leaves
+		S32 right = -1;
+		S32 parent = -1;
+		U32 iStart = 0;      // leaves: range in index list
+		U32 nPrims = 0;
+		U32 tris = 0;        // primitives in subtree
+		F32 cost = 0.0f;     // unnormalized SAH cost of subtree
+		bool collapse = false; // inner node emitted as a single leaf
+	};
+
+	// Treelet being restructured, tables indexed by subsets of its leaves
+	struct Treelet
+	{
+		S32 leaves[TreeletLeaves];
+		S32 internals[TreeletLeaves - 1];
+		AABB_t boxes[1 << TreeletLeaves];
+		F32 costs[1 << TreeletLeaves];
+		U32 tris[1 << TreeletLeaves];
+		U8 partitions[1 << TreeletLeaves];
+		bool collapse[1 << TreeletLeaves];
+	};
+
+	void load();
+	void runPass(U32 minTris);
+	void refit(S32 ni);
+	void restructure(S32 root);
+	void reconstruct(Treelet &t, U32 subset, S32 ni, U32 &nextSlot);
+	U32 store(S32 ni, S32 parent, U32 depth, std::vector<Node> &nodes, std::vector<U32> &indices) const;
+	void gatherIndices(S32 ni, std::vector<U32> &indices) const;
+
+	std::vector<Node> &m_nodes;
+	std::vector<U32> &m_indices;
+	std::vector<TreeletNode> m_tree;
+	F32 costBox;
+	F32 costTri;
+	const std::atomic<bool> *cancel; // checked between chunks, may be null
+};
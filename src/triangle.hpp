@@ -1,6 +1,8 @@
 #pragma once
 
+#include <vector>
 #include "math/float3.hpp"
+#include "geom.h"
 
 using FireRays::float3;
 
@@ -21,6 +23,7 @@ struct RTTriangle {
     int matId = 0; // default material, defined in scene constructor
 
 	// TODO: Fix alignment issues!
+    RTTriangle(void) {}
     RTTriangle(const VertexPNT &v0i, const VertexPNT &v1i, const VertexPNT &v2i) {
         v0 = v0i;
         v1 = v1i;
@@ -47,3 +50,51 @@ struct RTTriangle {
         return normalize(cross(v1.p - v0.p, v2.p - v0.p));
     }
 };
+
+/*
+    Indexed triangle geometry: vertices are shared between triangles.
+    Uploaded as PackedVertex and IndexedTriangle for shading, plus a LeafTriangle per
+    index list entry for traversal (see geom.h and CLContext::uploadSceneData).
+    A zero vertex normal means flat shading, the geometric normal is used instead.
+*/
+struct TriangleMesh
+{
+    std::vector<VertexPNT> vertices;
+    std::vector<IndexedTriangle> triangles;
+
+    size_t size() const { return triangles.size(); }
+    bool empty() const { return triangles.empty(); }
+    size_t bytes() const { return vertices.size() * sizeof(VertexPNT) + triangles.size() * sizeof(IndexedTriangle); }
+
+    const VertexPNT &vertex(size_t tri, int k) const { return vertices[triangles[tri].v[k]]; }
+    const float3 &position(size_t tri, int k) const { return vertices[triangles[tri].v[k]].p; }
+
+    inline float3 min(size_t tri) const {
+        return vmin(position(tri, 0), vmin(position(tri, 1), position(tri, 2)));
+    }
+
+    inline float3 max(size_t tri) const {
+        return vmax(position(tri, 0), vmax(position(tri, 1), position(tri, 2)));
+    }
+
+    inline float area(size_t tri) const {
+        return length(cross(position(tri, 1) - position(tri, 0), position(tri, 2) - position(tri, 0))) * .5f;
+    }
+
+    // Unpacked copy, for code that handles one triangle at a time
+    RTTriangle triangle(size_t tri) const {
+        RTTriangle t(vertex(tri, 0), vertex(tri, 1), vertex(tri, 2));
+        t.matId = triangles[tri].matId;
+        return t;
+    }
+
+    // Appended with three vertices of its own
+    void append(const RTTriangle &t) {
+        const cl_uint first = (cl_uint)vertices.size();
+        vertices.push_back(t.v0);
+        vertices.push_back(t.v1);
+        vertices.push_back(t.v2);
+        IndexedTriangle tri = { { first, first + 1, first + 2 }, t.matId };
+        triangles.push_back(tri);
+    }
+};
@@ -0,0 +1,229 @@
+#include <iostream>
+#include <cassert>
+#include <cmath>
+#include <unordered_map>
+#include "twolevelbvh.hpp"
+#include "sbvh.hpp"
+#include "lbvh.hpp"
+#include "settings.hpp"
+
+TwoLevelBVH::TwoLevelBVH(TriangleMesh *tris, const std::vector<MeshRange> &meshes, SplitMode mode, ProgressView *progress)
+{
+	m_sceneTriangles = tris;
+	m_mode = mode;
+
+	// Sources without shapes (PLY) form a single mesh
+	std::vector<MeshRange> shapes = meshes;
+	if (shapes.empty())
+		shapes.push_back({ 0, tris->size() });
+
+	findInstances(shapes);
+
+	// Top-level tree at index 0, bottom-level trees appended after it
+	buildTopLevel();
+
+	U32 passes = Settings::getInstance().getBvhOptimizePasses();
+	HierarchyBuilder builder = builderForSplitMode(mode);
+	for (Mesh &mesh : m_meshes)
+	{
+		// Built on a copy with mesh-local vertex indices
+		TriangleMesh meshTris;
+		auto firstVertex = m_meshTriangles.vertices.begin() + mesh.firstVertex;
+		auto firstTri = m_meshTriangles.triangles.begin() + mesh.start;
+		meshTris.vertices.assign(firstVertex, firstVertex + mesh.numVertices);
+		meshTris.triangles.assign(firstTri, firstTri + mesh.count);
+		for (IndexedTriangle &t : meshTris.triangles)
+			for (int k = 0; k < 3; k++)
+				t.v[k] -= mesh.firstVertex;
+
+		if (builder == HierarchyBuilder_LBVH)
+		{
+			LBVH bvh(&meshTris);
+			addBottomLevel(bvh, mesh, passes);
+		}
+		else if (builder == HierarchyBuilder_BVH)
+		{
+			BVH bvh(&meshTris, mode);
+			addBottomLevel(bvh, mesh, passes);
+		}
+		else
+		{
+			SBVH bvh(&meshTris, mode, progress);
+			addBottomLevel(bvh, mesh, passes);
+		}
+	}
+
+	// Translation only: linear part is identity
+	for (const Instance &inst : m_instanceList)
+	{
+		GPUInstance g = {};
+		g.rows[0] = float3(1.0f, 0.0f, 0.0f);
+		g.rows[1] = float3(0.0f, 1.0f, 0.0f);
+		g.rows[2] = float3(0.0f, 0.0f, 1.0f);
+		g.offset = float3(0.0f) - inst.translation;
+		g.root = m_meshes[inst.mesh].root;
+		m_instances.push_back(g);
+	}
+
+	m_triangles = &m_meshTriangles;
+
+	std::cout
+		<< "======================" << std::endl
+		<< "Two-level BVH (" << splitModeName(m_mode) << ")" << std::endl
+		<< "Instances: " << m_instances.size() << std::endl
+		<< "Unique meshes: " << m_meshes.size() << std::endl
+		<< "Triangles stored: " << m_meshTriangles.size() << " of " << tris->size() << std::endl
+		<< "======================" << std::endl;
+}
+
+// Shapes that are translated copies of an earlier one reuse its mesh
+void TwoLevelBVH::findInstances(const std::vector<MeshRange> &shapes)
+{
+	std::unordered_map<size_t, std::vector<U32>> meshesBySize;
+	for (const MeshRange &shape : shapes)
+	{
+		AABB_t bounds;
+		for (size_t i = shape.start; i < shape.start + shape.count; i++)
+			bounds.expand(*m_sceneTriangles, i);
+
+		// Object space origin at minimum corner
+		const float3 origin = bounds.min;
+		const float3 extent = bounds.max - bounds.min;
+		const F32 tolerance = 1e-5f * std::max(extent.x, std::max(extent.y, extent.z));
+
+		std::vector<U32> &candidates = meshesBySize[shape.count];
+		S32 found = -1;
+		for (U32 mi : candidates)
+		{
+			if (sameGeometry(shape, origin, tolerance, m_meshes[mi]))
+			{
+				found = (S32)mi;
+				break;
+			}
+		}
+
+		if (found == -1)
+		{
+			Mesh mesh;
+			mesh.start = (U32)m_meshTriangles.size();
+			mesh.count = (U32)shape.count;
+			mesh.firstVertex = (U32)m_meshTriangles.vertices.size();
+
+			// Vertices referenced by the shape, moved to object space
+			std::unordered_map<U32, U32> remap;
+			for (size_t i = shape.start; i < shape.start + shape.count; i++)
+			{
+				IndexedTriangle t = m_sceneTriangles->triangles[i];
+				for (int k = 0; k < 3; k++)
+				{
+					auto it = remap.find(t.v[k]);
+					if (it == remap.end())
+					{
+						it = remap.insert(std::make_pair(t.v[k], (U32)m_meshTriangles.vertices.size())).first;
+						VertexPNT v = m_sceneTriangles->vertices[t.v[k]];
+						v.p = v.p - origin;
+						m_meshTriangles.vertices.push_back(v);
+					}
+					t.v[k] = it->second;
+				}
+				m_meshTriangles.triangles.push_back(t);
+			}
+			mesh.numVertices = (U32)m_meshTriangles.vertices.size() - mesh.firstVertex;
+
+			found = (S32)m_meshes.size();
+			candidates.push_back((U32)found);
+			m_meshes.push_back(mesh);
+		}
+
+		Instance inst;
+		inst.mesh = (U32)found;
+		inst.translation = origin;
+		inst.bounds = bounds;
+		m_instanceList.push_back(inst);
+	}
+}
+
+inline bool nearlyEqual(const float3 &a, const float3 &b, F32 tolerance)
+{
+	return std::abs(a.x - b.x) <= tolerance && std::abs(a.y - b.y) <= tolerance && std::abs(a.z - b.z) <= tolerance;
+}
+
+inline bool sameVertex(const VertexPNT &world, const float3 &origin, const VertexPNT &object, F32 tolerance)
+{
+	return nearlyEqual(world.p - origin, object.p, tolerance) && nearlyEqual(world.n, object.n, 1e-5f) && nearlyEqual(world.t, object.t, 1e-5f);
+}
+
+bool TwoLevelBVH::sameGeometry(const MeshRange &shape, const float3 &origin, F32 tolerance, const Mesh &mesh) const
+{
+	assert(shape.count == mesh.count);
+	for (U32 i = 0; i < mesh.count; i++)
+	{
+		const IndexedTriangle &w = m_sceneTriangles->triangles[shape.start + i];
+		const IndexedTriangle &o = m_meshTriangles.triangles[mesh.start + i];
+		if (w.matId != o.matId)
+			return false;
+
+		for (int k = 0; k < 3; k++)
+		{
+			if (!sameVertex(m_sceneTriangles->vertices[w.v[k]], origin, m_meshTriangles.vertices[o.v[k]], tolerance))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+void TwoLevelBVH::addBottomLevel(BVH &bvh, Mesh &mesh, U32 optimizePasses)
+{
+	if (optimizePasses > 0)
+		bvh.optimizeTreelets(optimizePasses);
+
+	mesh.root = (U32)m_nodes.size();
+	appendTree(bvh, mesh.start);
+}
+
+// Append nodes and indices of a finished hierarchy, links are offset accordingly
+void TwoLevelBVH::appendTree(const BVH &bvh, U32 triOffset)
+{
+	const U32 nodeOffset = (U32)m_nodes.size();
+	const U32 indexOffset = (U32)m_indices.size();
+	for (Node n : bvh.m_nodes)
+	{
+		if (n.parent != -1)
+			n.parent += nodeOffset;
+
+		if (n.nPrims > 0)
+		{
+			n.iStart += indexOffset;
+		}
+		else
+		{
+			n.leftChild += nodeOffset;
+			n.rightChild += nodeOffset;
+		}
+		m_nodes.push_back(n);
+	}
+
+	for (U32 ind : bvh.m_indices)
+		m_indices.push_back(ind + triOffset);
+}
+
+// Built over proxy triangles with the instance bounds and centroids, leaves index instances
+void TwoLevelBVH::buildTopLevel(void)
+{
+	assert(m_nodes.empty());
+
+	TriangleMesh proxies;
+	for (const Instance &inst : m_instanceList)
+	{
+		const float3 zero(0.0f);
+		VertexPNT lo(inst.bounds.min, zero, zero);
+		VertexPNT hi(inst.bounds.max, zero, zero);
+		VertexPNT center((inst.bounds.min + inst.bounds.max) * 0.5f, zero, zero);
+		proxies.append(RTTriangle(lo, hi, center));
+	}
+
+	BVH top(&proxies, SplitMode_Sah);
+	appendTree(top, 0);
+	m_instanceEntries = (U32)m_indices.size();
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include "bvh.hpp"
+#include "scene.hpp"
+
+class ProgressView;
+
+/*
+	Two-level hierarchy: one bottom-level BVH per unique mesh, a top-level BVH over instances of them.
+	Shapes that are translated copies of each other share a single mesh, which is stored once in object space.
+	Layout of the buffers uploaded to the GPU (traversed with USE_INSTANCING):
+	  nodes:     top-level tree at index 0, followed by the bottom-level trees
+	  indices:   instance indices of top-level leaves, followed by triangle indices of bottom-level leaves
+	  triangles: object space triangles and vertices of all unique meshes
+*/
+class TwoLevelBVH : public BVH
+{
+public:
+	TwoLevelBVH(TriangleMesh *tris, const std::vector<MeshRange> &meshes, SplitMode mode, ProgressView *progress);
+	~TwoLevelBVH() {}
+
+private:
+	// Unique geometry, triangles and vertices in m_meshTriangles
+	struct Mesh
+	{
+		U32 start;
+		U32 count;
+		U32 firstVertex;
+		U32 numVertices;
+		U32 root = 0; // bottom-level root node
+	};
+
+	// Shape placed into the scene by translation
+	struct Instance
+	{
+		U32 mesh;
+		float3 translation; // object to world
+		AABB_t bounds;      // world space
+	};
+
+	void findInstances(const std::vector<MeshRange> &shapes);
+	bool sameGeometry(const MeshRange &shape, const float3 &origin, F32 tolerance, const Mesh &mesh) const;
+	void addBottomLevel(BVH &bvh, Mesh &mesh, U32 optimizePasses);
+	void appendTree(const BVH &bvh, U32 triOffset);
+	void buildTopLevel(void);
+
+	TriangleMesh *m_sceneTriangles;
+	TriangleMesh m_meshTriangles;
+	std::vector<Mesh> m_meshes;
+	std::vector<Instance> m_instanceList;
+};
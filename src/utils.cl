@@ -27,6 +27,27 @@ inline float3 lerp(float u, float v, float3 v1, float3 v2, float3 v3)
     return (1.0f - u - v) * v1 + u * v2 + v * v3;
 }
 
+inline float2 lerp2(float u, float v, float2 v1, float2 v2, float2 v3)
+{
+    return (1.0f - u - v) * v1 + u * v2 + v * v3;
+}
+
+// Octahedral normal of PackedVertex, not normalized
+inline float3 decodeNormal(uint n)
+{
+    const float2 f = convert_float2(as_short2(n)) * (1.0f / 32767.0f);
+    float3 N = (float3)(f.x, f.y, 1.0f - fabs(f.x) - fabs(f.y));
+    const float t = fmax(-N.z, 0.0f);
+    N.x += (N.x >= 0.0f) ? -t : t;
+    N.y += (N.y >= 0.0f) ? -t : t;
+    return N;
+}
+
+inline float2 decodeTexCoord(global PackedVertex *v)
+{
+    return vload_half2(0, (global half*)&v->t);
+}
+
 inline float3 reflect(float3 dir, float3 n) // dir normalized?
 {
     return dir - 2.0f * dot(dir, n) * n;
@@ -146,7 +167,7 @@ inline float3 matGetFloat3(float3 fallback, float2 uv, int idx, global TexDescri
 }
 
 // Construct tangent space, convert normal into world space
-inline float3 tangentSpaceNormal(Hit hit, global Triangle *tris, const Material mat, global TexDescriptor *textures, global uchar *texData)
+inline float3 tangentSpaceNormal(Hit hit, global IndexedTriangle *tris, global PackedVertex *vertices, const Material mat, global TexDescriptor *textures, global uchar *texData)
 {
     if (mat.map_N == -1)
         return hit.N;
@@ -155,12 +176,17 @@ inline float3 tangentSpaceNormal(Hit hit, global Triangle *tris, const Material
     float3 texNormal = matGetFloat3(defaultVal, hit.uvTex, mat.map_N, textures, texData);
     texNormal = 2.0f * texNormal - (float3)(1.0f, 1.0f, 1.0f);
     
-    Triangle t = tris[hit.i];
+    const IndexedTriangle tri = tris[hit.i];
+    global PackedVertex *v0 = &vertices[tri.v[0]];
+    global PackedVertex *v1 = &vertices[tri.v[1]];
+    global PackedVertex *v2 = &vertices[tri.v[2]];
     
-    float3 e1 = t.v1.p - t.v0.p;
-    float3 e2 = t.v2.p - t.v0.p;
-    float3 t1 = t.v1.t - t.v0.t;
-    float3 t2 = t.v2.t - t.v0.t;
+    const float3 p0 = vload3(0, v0->p);
+    float3 e1 = vload3(0, v1->p) - p0;
+    float3 e2 = vload3(0, v2->p) - p0;
+    const float2 uv0 = decodeTexCoord(v0);
+    float2 t1 = decodeTexCoord(v1) - uv0;
+    float2 t2 = decodeTexCoord(v2) - uv0;
 
     // Detect invalid normal map
     float det = (t1.x * t2.y - t1.y * t2.x);
@@ -183,13 +209,13 @@ inline float3 tangentSpaceNormal(Hit hit, global Triangle *tris, const Material
 
 // Read all material parameters at once
 // Can alternatlvely be read separately in bsdf sampling/eval code
-inline void getMaterialParameters(Hit hit, global Triangle *tris, global Material *materials, global uchar *texData, global TexDescriptor *textures, float3 *Kd, float3 *N, float3 *Ks, float *refr)
+inline void getMaterialParameters(Hit hit, global IndexedTriangle *tris, global PackedVertex *vertices, global Material *materials, global uchar *texData, global TexDescriptor *textures, float3 *Kd, float3 *N, float3 *Ks, float *refr)
 {
     const Material mat = materials[hit.matId];
 
 	*Kd = matGetAlbedo(mat.Kd, hit.uvTex, mat.map_Kd, textures, texData);
 	*Ks = matGetFloat3(mat.Ks, hit.uvTex, mat.map_Ks, textures, texData);
-    *N = tangentSpaceNormal(hit, tris, mat, textures, texData);
+    *N = tangentSpaceNormal(hit, tris, vertices, mat, textures, texData);
     *refr = mat.Ni;
 }
 
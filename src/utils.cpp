@@ -1,6 +1,7 @@
 #include "utils.h"
 #include "xxhash/xxhash.h"
 #include "tinyfiledialogs.h"
+#include "mappedfile.hpp"
 #include <fstream>
 #include <iostream>
 #include <vector>
@@ -73,21 +74,15 @@ size_t computeHash(const void* buffer, size_t length)
 
 size_t fileHash(const std::string filename)
 {
-    std::ifstream f(filename, std::ios::binary | std::ios::ate);
+    MappedFile f(filename);
 
-    if (!f)
+    if (!f.valid())
     {
         std::cout << "Could not open file " << filename << " for hashing, exiting..." << std::endl;
         waitExit();
     }
 
-    std::ifstream::pos_type pos = f.tellg();
-    std::vector<char> data(pos);
-    f.seekg(0, std::ios::beg);
-    f.read(&data[0], pos);
-    f.close();
-
-    return computeHash((const void*)data.data(), (size_t)pos);
+    return computeHash((const void*)f.data(), f.size());
 }
 
 std::string getBxdfDefines(unsigned int typeBits)
@@ -6,9 +6,11 @@ kernel void traceExtension(
     global GPUTaskState* tasks,
     global QueueCounters* queueLens,
     global uint* extensionQueue,
-    global Triangle* tris,
+    global IndexedTriangle *tris,
+    global PackedVertex *vertices,
     global GPUNode* nodes,
-    global uint* indices,
+    global LeafTriangle* leafTris,
+    global GPUInstance* instances,
     global RenderParams* params,
     const uint numTasks
 )
@@ -25,7 +27,7 @@ kernel void traceExtension(
 
     // Trace ray
     Hit hit = EMPTY_HIT(FLT_MAX);
-    bvh_intersect(&r, &hit, tris, nodes, indices);
+    bvh_intersect(&r, &hit, tris, vertices, nodes, leafTris, instances);
     if (params->sampleImpl && params->useAreaLight) intersectLight(&hit, &r, params);
     
     global uint *len = &ReadU32(pathLen, tasks);
@@ -25,9 +25,11 @@ kernel void logic(
     global uint *ggxReflQueue,
     global uint *ggxRefrQueue,
     global uint *deltaQueue,
-    global Triangle *tris,
+    global IndexedTriangle *tris,
+    global PackedVertex *vertices,
     global GPUNode *nodes,
-    global uint *indices,
+    global LeafTriangle *leafTris,
+    global GPUInstance *instances,
     read_only image2d_t envMap,
     global float *probTable,
     global int *aliasTable,
@@ -178,7 +180,7 @@ kernel void logic(
 
     // Read hit material (to check if singular etc.)
     Material mat = materials[hit.matId];
-    hit.N = tangentSpaceNormal(hit, tris, mat, textures, texData);
+    hit.N = tangentSpaceNormal(hit, tris, vertices, mat, textures, texData);
     bool backface = dot(hit.N, r.dir) > 0.0f;
     if (backface) hit.N *= -1.0f;
     float3 orig = hit.P - 1e-3f * r.dir;
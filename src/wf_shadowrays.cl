@@ -7,9 +7,9 @@ kernel void traceShadow(
     global GPUTaskState* tasks,
     global QueueCounters* queueLens,
     global uint* shadowQueue,
-    global Triangle* tris,
     global GPUNode* nodes,
-    global uint* indices,
+    global LeafTriangle* leafTris,
+    global GPUInstance* instances,
     global RenderParams* params,
     uint numTasks
 )
@@ -30,7 +30,7 @@ kernel void traceShadow(
     
     // TEST: area light not occluding
     if (params->useAreaLight) intersectLight(&hitL, &r, params);
-    bool occluded = (hitL.i > -1) || bvh_occluded(&r, &lenL, tris, nodes, indices);
+    bool occluded = (hitL.i > -1) || bvh_occluded(&r, &lenL, nodes, leafTris, instances);
 
     // Write hit to path state
     WriteU32(shadowRayBlocked, tasks, occluded);
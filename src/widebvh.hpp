@@ -0,0 +1,176 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "bvhnode.hpp"
+#include "geom.h"
+
+static_assert(sizeof(GPUNode4) == 128, "GPUNode4 must match OpenCL layout");
+static_assert(sizeof(GPUNode8) == 256, "GPUNode8 must match OpenCL layout");
+static_assert(sizeof(GPUQNode4) == 64, "GPUQNode4 must match OpenCL layout");
+static_assert(sizeof(GPUQNode8) == 112, "GPUQNode8 must match OpenCL layout");
+
+// Full precision child bounds
+template<typename WideNode>
+inline void encodeFrame(WideNode &n, const AABB_t &frame) {}
+
+template<typename WideNode>
+inline void encodeBounds(WideNode &n, U32 i, const AABB_t &box)
+{
+	n.minx[i] = box.min.x;
+	n.miny[i] = box.min.y;
+	n.minz[i] = box.min.z;
+	n.maxx[i] = box.max.x;
+	n.maxy[i] = box.max.y;
+	n.maxz[i] = box.max.z;
+}
+
+// Smallest power-of-two scale that covers the frame with 255 steps.
+// Decoding (origin + q * scale) is exact up to the final rounding, same as in bvh.cl.
+template<typename QNode>
+inline void encodeQuantizedFrame(QNode &n, const AABB_t &frame)
+{
+	for (U32 a = 0; a < 3; a++)
+	{
+		F32 extent = frame.max[a] - frame.min[a];
+		int e = -126;
+		if (extent > 0.0f)
+			std::frexp(extent / 255.0f, &e);
+
+		e = std::max(-126, std::min(127, e));
+		while (e < 127 && frame.min[a] + 255.0f * std::ldexp(1.0f, e) < frame.max[a])
+			e++;
+
+		n.origin[a] = frame.min[a];
+		n.exp[a] = (cl_char)e;
+	}
+}
+
+// Rounded outwards, so that decoded boxes always contain the original ones
+template<typename QNode>
+inline void encodeQuantizedBounds(QNode &n, U32 i, const AABB_t &box)
+{
+	cl_uchar *qmin[3] = { n.qminx, n.qminy, n.qminz };
+	cl_uchar *qmax[3] = { n.qmaxx, n.qmaxy, n.qmaxz };
+	for (U32 a = 0; a < 3; a++)
+	{
+		const F32 scale = std::ldexp(1.0f, n.exp[a]);
+		int lo = (int)std::floor((box.min[a] - n.origin[a]) / scale);
+		int hi = (int)std::ceil((box.max[a] - n.origin[a]) / scale);
+		lo = std::max(0, std::min(255, lo));
+		hi = std::max(0, std::min(255, hi));
+
+		while (lo > 0 && n.origin[a] + lo * scale > box.min[a])
+			lo--;
+		while (hi < 255 && n.origin[a] + hi * scale < box.max[a])
+			hi++;
+
+		qmin[a][i] = (cl_uchar)lo;
+		qmax[a][i] = (cl_uchar)hi;
+	}
+}
+
+inline void encodeFrame(GPUQNode4 &n, const AABB_t &frame) { encodeQuantizedFrame(n, frame); }
+inline void encodeFrame(GPUQNode8 &n, const AABB_t &frame) { encodeQuantizedFrame(n, frame); }
+inline void encodeBounds(GPUQNode4 &n, U32 i, const AABB_t &box) { encodeQuantizedBounds(n, i, box); }
+inline void encodeBounds(GPUQNode8 &n, U32 i, const AABB_t &box) { encodeQuantizedBounds(n, i, box); }
+
+/*
+	Collapses a binary BVH into the wide layout traversed with BVH_WIDTH in bvh.cl.
+	Every wide node adopts the frontier of a binary treelet, grown by opening the largest inner child first.
+	Leaves are stored inline in their parent, wide nodes are laid out depth-first.
+	Child bounds are stored in full precision or quantized, depending on the node type.
+*/
+template<typename WideNode>
+class WideBVH
+{
+public:
+	enum { Width = sizeof(WideNode::child) / sizeof(cl_uint) };
+
+	// Wide nodes are written into 'output'
+	WideBVH(const std::vector<Node> &nodes, std::vector<WideNode> &output) : m_nodes(output)
+	{
+		m_nodes.clear();
+		m_nodes.reserve(nodes.size() / (Width - 1) + 1);
+		m_maxStack = std::max(1U, collapse(nodes, 0));
+	}
+
+	U32 getMaxStack() const { return m_maxStack; } // worst-case traversal stack usage
+
+private:
+	// Returns stack entries needed for traversing subtree (node itself already popped)
+	U32 collapse(const std::vector<Node> &nodes, U32 ni)
+	{
+		U32 children[Width];
+		U32 count = 0;
+		if (nodes[ni].nPrims > 0)
+		{
+			children[count++] = ni; // single leaf scene
+		}
+		else
+		{
+			children[count++] = nodes[ni].leftChild;
+			children[count++] = nodes[ni].rightChild;
+		}
+
+		while (count < Width)
+		{
+			S32 best = -1;
+			F32 bestArea = -1.0f;
+			for (U32 i = 0; i < count; i++)
+			{
+				const Node &c = nodes[children[i]];
+				if (c.nPrims == 0 && c.box.area() > bestArea)
+				{
+					best = (S32)i;
+					bestArea = c.box.area();
+				}
+			}
+
+			if (best == -1)
+				break;
+
+			U32 opened = children[best];
+			children[best] = nodes[opened].leftChild;
+			children[count++] = nodes[opened].rightChild;
+		}
+
+		AABB_t frame;
+		for (U32 i = 0; i < count; i++)
+		{
+			frame.expand(nodes[children[i]].box);
+		}
+
+		U32 wi = (U32)m_nodes.size();
+		m_nodes.push_back(WideNode()); // zero-initialized
+		m_nodes[wi].numChildren = count;
+		encodeFrame(m_nodes[wi], frame);
+
+		U32 innerCount = 0, childStack = 0;
+		for (U32 i = 0; i < count; i++)
+		{
+			const Node &c = nodes[children[i]];
+			encodeBounds(m_nodes[wi], i, c.box);
+
+			if (c.nPrims > 0)
+			{
+				m_nodes[wi].child[i] = c.iStart;
+				m_nodes[wi].nPrims[i] = c.nPrims;
+			}
+			else
+			{
+				U32 childIndex = (U32)m_nodes.size(); // vector may grow, no references kept
+				childStack = std::max(childStack, collapse(nodes, children[i]));
+				m_nodes[wi].child[i] = childIndex;
+				innerCount++;
+			}
+		}
+
+		// All inner children pushed, nearest one popped first
+		return (innerCount == 0) ? 0 : std::max(innerCount, innerCount - 1 + childStack);
+	}
+
+	std::vector<WideNode> &m_nodes;
+	U32 m_maxStack;
+};